@@ -0,0 +1,489 @@
+/*
+-- Read-ahead of many files for statgen
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "aread.h"
+
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#define MIN(x,y) ((x) < (y) ? (x) : (y))
+
+
+static void *xalloc(size_t size) {
+	void *p = malloc(size);
+
+	if (p == NULL) {
+		fputs("-- Error: out of memory reading files ahead.\n", stderr);
+		exit(1);
+	}
+	return p;
+}
+
+/* The size of an open file worth reading whole, or 0. */
+static size_t worth_reading(int fd) {
+	struct stat st;
+
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0 ||
+			st.st_size > AREAD_MAX_FILE)
+		return 0;
+	return st.st_size;
+}
+
+/* Wait until size more bytes fit in the budget, then claim them. */
+static void reserve(aread *r, size_t size) {
+	pthread_mutex_lock(&r->lock);
+	while (r->used > 0 && r->used + size > AREAD_BUDGET)
+		pthread_cond_wait(&r->released, &r->lock);
+	r->used += size;
+	pthread_mutex_unlock(&r->lock);
+}
+
+#ifdef HAVE_IO_URING
+/* Claim size bytes of the budget if they fit now; FALSE otherwise. */
+static int try_reserve(aread *r, size_t size) {
+	int fits;
+
+	pthread_mutex_lock(&r->lock);
+	if ((fits = r->used == 0 || r->used + size <= AREAD_BUDGET))
+		r->used += size;
+	pthread_mutex_unlock(&r->lock);
+	return fits;
+}
+#endif
+
+static void unreserve(aread *r, size_t size) {
+	pthread_mutex_lock(&r->lock);
+	r->used -= size;
+	pthread_cond_broadcast(&r->released);
+	pthread_mutex_unlock(&r->lock);
+}
+
+/* A file is ready; once all are, every waiting worker has to hear of it. */
+static void wake(aread *r) {
+	if (r->nready == r->nfiles)
+		pthread_cond_broadcast(&r->completed);
+	else
+		pthread_cond_signal(&r->completed);
+}
+
+/* File i is done: read into data, or to be opened as usual if NULL. */
+static void complete(aread *r, int i, char *data, size_t len) {
+	pthread_mutex_lock(&r->lock);
+	r->data[i] = data;
+	r->len[i] = data != NULL ? len : 0;
+	r->ready[r->nready++] = i;
+	wake(r);
+	pthread_mutex_unlock(&r->lock);
+}
+
+/* Claim the next file to open, or -1; "-" is always left to the caller. */
+static int claim(aread *r) {
+	int i = -1;
+
+	pthread_mutex_lock(&r->lock);
+	while (r->next < r->nfiles) {
+		i = r->next++;
+		if (strcmp(r->paths[i], "-") != 0)
+			break;
+		r->data[i] = NULL;
+		r->len[i] = 0;
+		r->ready[r->nready++] = i;
+		wake(r);
+		i = -1;
+	}
+	pthread_mutex_unlock(&r->lock);
+	return i;
+}
+
+/* A reader of the thread pool: open, pread and close one file at a time. */
+static void *pread_worker(void *arg) {
+	aread *r = arg;
+	char *data;
+	size_t size, got;
+	ssize_t n;
+	int i, fd;
+
+	while ((i = claim(r)) >= 0) {
+		data = NULL;
+		size = 0;
+		if ((fd = open(r->paths[i], O_RDONLY)) >= 0) {
+			if ((size = worth_reading(fd)) > 0) {
+				reserve(r, size);
+				data = xalloc(size);
+				for (got = 0; got < size; got += n) {
+					n = pread(fd, data + got, size - got, got);
+					if (n < 0 && errno == EINTR)
+						n = 0;
+					else if (n <= 0)
+						break;
+				}
+				if (got < size) {
+					free(data);
+					data = NULL;
+					unreserve(r, size);
+				}
+			}
+			close(fd);
+		}
+		complete(r, i, data, size);
+	}
+	return NULL;
+}
+
+#ifdef HAVE_IO_URING
+/* What a completion is for, kept in the low bits of its user data. */
+#define OP_OPEN			0
+#define OP_READ			1
+#define OP_BITS			1
+
+/* The rings shared with the kernel. */
+typedef struct aread_ring {
+	int           fd;
+	unsigned     *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned     *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void         *sq_map, *cq_map;
+	size_t        sq_maplen, cq_maplen, sqes_maplen;
+	unsigned      queued;    /* entries not yet submitted */
+
+	/* Files in flight, by slot. */
+	int           file[AREAD_DEPTH];
+	int           fd_of[AREAD_DEPTH];
+	char         *buf[AREAD_DEPTH];
+	size_t        size[AREAD_DEPTH];
+	size_t        got[AREAD_DEPTH];
+	int           free_slots[AREAD_DEPTH];
+	int           nfree;
+	int           parked[AREAD_DEPTH];  /* opened, waiting for the budget */
+	int           nparked;
+} aread_ring;
+
+static void ring_free(aread_ring *q) {
+	if (q->sqes != NULL && q->sqes != MAP_FAILED)
+		munmap(q->sqes, q->sqes_maplen);
+	if (q->cq_map != NULL && q->cq_map != MAP_FAILED && q->cq_map != q->sq_map)
+		munmap(q->cq_map, q->cq_maplen);
+	if (q->sq_map != NULL && q->sq_map != MAP_FAILED)
+		munmap(q->sq_map, q->sq_maplen);
+	if (q->fd >= 0)
+		close(q->fd);
+	free(q);
+}
+
+/* Both operations must be supported; they arrived in Linux 5.6. */
+static int ring_supports(aread_ring *q) {
+	size_t size = sizeof(struct io_uring_probe) +
+			256 * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe *probe = calloc(1, size);
+	int ok;
+
+	if (probe == NULL)
+		return 0;
+	ok = syscall(__NR_io_uring_register, q->fd, IORING_REGISTER_PROBE,
+			probe, 256) == 0 &&
+		probe->last_op >= IORING_OP_OPENAT && probe->last_op >= IORING_OP_READ &&
+		(probe->ops[IORING_OP_OPENAT].flags & IO_URING_OP_SUPPORTED) &&
+		(probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED);
+	free(probe);
+	return ok;
+}
+
+/* Set up a ring of AREAD_DEPTH entries; NULL if the kernel refuses. */
+static aread_ring *ring_open(void) {
+	struct io_uring_params p;
+	aread_ring *q = calloc(1, sizeof(*q));
+	char *sq, *cq;
+	int i;
+
+	if (q == NULL)
+		return NULL;
+	memset(&p, 0, sizeof(p));
+	if ((q->fd = syscall(__NR_io_uring_setup, AREAD_DEPTH, &p)) < 0) {
+		free(q);
+		return NULL;
+	}
+	q->sq_maplen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	q->cq_maplen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (q->cq_maplen > q->sq_maplen)
+			q->sq_maplen = q->cq_maplen;
+		q->cq_maplen = q->sq_maplen;
+	}
+	q->sq_map = mmap(NULL, q->sq_maplen, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, q->fd, IORING_OFF_SQ_RING);
+	if (q->sq_map == MAP_FAILED) {
+		ring_free(q);
+		return NULL;
+	}
+	q->cq_map = (p.features & IORING_FEAT_SINGLE_MMAP) ? q->sq_map :
+		mmap(NULL, q->cq_maplen, PROT_READ | PROT_WRITE,
+				MAP_SHARED | MAP_POPULATE, q->fd, IORING_OFF_CQ_RING);
+	q->sqes_maplen = p.sq_entries * sizeof(struct io_uring_sqe);
+	q->sqes = mmap(NULL, q->sqes_maplen, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, q->fd, IORING_OFF_SQES);
+	if (q->cq_map == MAP_FAILED || q->sqes == MAP_FAILED || !ring_supports(q)) {
+		ring_free(q);
+		return NULL;
+	}
+
+	sq = q->sq_map;
+	cq = q->cq_map;
+	q->sq_head = (unsigned *)(sq + p.sq_off.head);
+	q->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	q->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	q->sq_array = (unsigned *)(sq + p.sq_off.array);
+	q->cq_head = (unsigned *)(cq + p.cq_off.head);
+	q->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	q->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	q->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	for (i = 0; i < AREAD_DEPTH; i++)
+		q->free_slots[i] = AREAD_DEPTH - 1 - i;
+	q->nfree = AREAD_DEPTH;
+	return q;
+}
+
+/*
+-- The next entry to fill in, which ring_queue() then hands to the
+-- kernel. At most one entry per slot is outstanding, so one is free.
+*/
+static struct io_uring_sqe *ring_entry(aread_ring *q, int op, int slot) {
+	unsigned index = *q->sq_tail & *q->sq_mask;
+	struct io_uring_sqe *sqe = &q->sqes[index];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = op;
+	sqe->user_data = ((unsigned long long)slot << OP_BITS) |
+		(op == IORING_OP_OPENAT ? OP_OPEN : OP_READ);
+	q->sq_array[index] = index;
+	return sqe;
+}
+
+static void ring_queue(aread_ring *q) {
+	__atomic_store_n(q->sq_tail, *q->sq_tail + 1, __ATOMIC_RELEASE);
+	q->queued++;
+}
+
+static void ring_read(aread_ring *q, int slot) {
+	struct io_uring_sqe *sqe = ring_entry(q, IORING_OP_READ, slot);
+
+	sqe->fd = q->fd_of[slot];
+	sqe->addr = (unsigned long long)(uintptr_t)(q->buf[slot] + q->got[slot]);
+	sqe->len = q->size[slot] - q->got[slot];
+	sqe->off = q->got[slot];
+	ring_queue(q);
+}
+
+/* Submit what is queued and wait for at least one completion. */
+static void ring_enter(aread_ring *q) {
+	int n;
+
+	do {
+		n = syscall(__NR_io_uring_enter, q->fd, q->queued, 1,
+				IORING_ENTER_GETEVENTS, NULL, 0);
+	} while (n < 0 && (errno == EINTR || errno == EAGAIN || errno == EBUSY));
+	if (n < 0) {
+		perror("-- Error: io_uring_enter failed");
+		exit(1);
+	}
+	q->queued -= MIN((unsigned)n, q->queued);
+}
+
+/* Finish the file in a slot, read or not, and free the slot. */
+static void ring_done(aread *r, aread_ring *q, int slot, int ok) {
+	if (q->fd_of[slot] >= 0)
+		close(q->fd_of[slot]);
+	if (!ok && q->buf[slot] != NULL) {
+		free(q->buf[slot]);
+		unreserve(r, q->size[slot]);
+		q->buf[slot] = NULL;
+	}
+	complete(r, q->file[slot], q->buf[slot], q->size[slot]);
+	q->buf[slot] = NULL;
+	q->free_slots[q->nfree++] = slot;
+}
+
+/* Start reading an opened file, whose bytes have been reserved. */
+static void ring_start(aread_ring *q, int slot) {
+	q->buf[slot] = xalloc(q->size[slot]);
+	q->got[slot] = 0;
+	ring_read(q, slot);
+}
+
+/*
+-- Start reading the parked files, oldest first, while they fit in the
+-- budget; if wait, wait for the first to fit. Only waiting with nothing
+-- in flight is safe, as this thread has to submit and complete reads.
+*/
+static void ring_unpark(aread *r, aread_ring *q, int wait) {
+	int slot;
+
+	while (q->nparked > 0) {
+		slot = q->parked[0];
+		if (wait)
+			reserve(r, q->size[slot]);
+		else if (!try_reserve(r, q->size[slot]))
+			break;
+		wait = 0;
+		memmove(q->parked, q->parked + 1, --q->nparked * sizeof(*q->parked));
+		ring_start(q, slot);
+	}
+}
+
+static void ring_completion(aread *r, aread_ring *q,
+		const struct io_uring_cqe *cqe) {
+	int slot = cqe->user_data >> OP_BITS;
+
+	if ((cqe->user_data & ((1 << OP_BITS) - 1)) == OP_OPEN) {
+		q->fd_of[slot] = cqe->res;
+		if (cqe->res < 0 || (q->size[slot] = worth_reading(cqe->res)) == 0)
+			ring_done(r, q, slot, 0);
+		else if (q->nparked == 0 && try_reserve(r, q->size[slot]))
+			ring_start(q, slot);
+		else
+			q->parked[q->nparked++] = slot;
+		return;
+	}
+
+	if (cqe->res == -EINTR || cqe->res == -EAGAIN) {
+		ring_read(q, slot);
+	} else if (cqe->res <= 0) {
+		ring_done(r, q, slot, 0);  /* failed, or the file shrank */
+	} else if ((q->got[slot] += cqe->res) < q->size[slot]) {
+		ring_read(q, slot);
+	} else {
+		ring_done(r, q, slot, 1);
+	}
+}
+
+/*
+-- The io_uring reader: keep up to AREAD_DEPTH files opening or reading.
+-- No more are opened while some wait for the budget.
+*/
+static void *ring_worker(void *arg) {
+	aread *r = arg;
+	aread_ring *q = r->ring;
+	struct io_uring_sqe *sqe;
+	unsigned head, tail;
+	int i, slot, more = 1;
+
+	for (;;) {
+		ring_unpark(r, q, 0);
+		while (more && q->nparked == 0 && q->nfree > 0) {
+			if ((i = claim(r)) < 0) {
+				more = 0;
+				break;
+			}
+			slot = q->free_slots[--q->nfree];
+			q->file[slot] = i;
+			q->fd_of[slot] = -1;
+			sqe = ring_entry(q, IORING_OP_OPENAT, slot);
+			sqe->fd = AT_FDCWD;
+			sqe->addr = (unsigned long long)(uintptr_t)r->paths[i];
+			sqe->open_flags = O_RDONLY;
+			ring_queue(q);
+		}
+		if (q->nfree + q->nparked == AREAD_DEPTH) {
+			if (q->nparked == 0)
+				break;
+			ring_unpark(r, q, 1);  /* nothing in flight */
+		}
+		ring_enter(q);
+
+		head = *q->cq_head;
+		tail = __atomic_load_n(q->cq_tail, __ATOMIC_ACQUIRE);
+		for (; head != tail; head++)
+			ring_completion(r, q, &q->cqes[head & *q->cq_mask]);
+		__atomic_store_n(q->cq_head, head, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+#endif /* HAVE_IO_URING */
+
+aread *aread_start(int nfiles, char *const paths[]) {
+	aread *r = xalloc(sizeof(*r));
+	int i;
+
+	memset(r, 0, sizeof(*r));
+	r->paths = paths;
+	r->nfiles = nfiles;
+	r->data = xalloc(nfiles * sizeof(*r->data));
+	r->len = xalloc(nfiles * sizeof(*r->len));
+	r->ready = xalloc(nfiles * sizeof(*r->ready));
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->completed, NULL);
+	pthread_cond_init(&r->released, NULL);
+
+#ifdef HAVE_IO_URING
+	if ((r->ring = ring_open()) != NULL) {
+		if (pthread_create(&r->threads[0], NULL, ring_worker, r) == 0) {
+			r->nthreads = 1;
+			return r;
+		}
+		ring_free(r->ring);
+		r->ring = NULL;
+	}
+#endif
+	for (i = 0; i < MIN(AREAD_THREADS, nfiles); i++) {
+		if (pthread_create(&r->threads[i], NULL, pread_worker, r) != 0)
+			break;
+		r->nthreads++;
+	}
+	if (r->nthreads == 0)
+		while ((i = claim(r)) >= 0)
+			complete(r, i, NULL, 0);  /* open them all as usual */
+	return r;
+}
+
+int aread_next(aread *r, char **data, size_t *len) {
+	int i = -1;
+
+	pthread_mutex_lock(&r->lock);
+	while (r->taken == r->nready && r->nready < r->nfiles)
+		pthread_cond_wait(&r->completed, &r->lock);
+	if (r->taken < r->nready) {
+		i = r->ready[r->taken++];
+		*data = r->data[i];
+		*len = r->len[i];
+	}
+	pthread_mutex_unlock(&r->lock);
+	return i;
+}
+
+void aread_release(aread *r, char *data, size_t len) {
+	if (data == NULL)
+		return;
+	free(data);
+	unreserve(r, len);
+}
+
+/* Only to be called once aread_next() has returned -1. */
+void aread_stop(aread *r) {
+	int i;
+
+	for (i = 0; i < r->nthreads; i++)
+		pthread_join(r->threads[i], NULL);
+#ifdef HAVE_IO_URING
+	if (r->ring != NULL)
+		ring_free(r->ring);
+#endif
+	pthread_mutex_destroy(&r->lock);
+	pthread_cond_destroy(&r->completed);
+	pthread_cond_destroy(&r->released);
+	free(r->data);
+	free(r->len);
+	free(r->ready);
+	free(r);
+}
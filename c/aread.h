@@ -0,0 +1,59 @@
+/*
+-- Read-ahead of many files for statgen
+--
+-- When several files are summarized at once, opening and reading them
+-- one at a time in each worker keeps the disk at a queue depth of one
+-- per worker. Instead, this module opens and reads whole files ahead of
+-- the workers, with up to AREAD_DEPTH of them in flight at once, and
+-- hands them out as they complete. On Linux the opens and reads go
+-- through io_uring, using its system calls directly (built with
+-- HAVE_IO_URING); where io_uring is missing or not permitted, a pool of
+-- threads does the same with open() and pread().
+*/
+
+#ifndef __AREAD_H
+#define __AREAD_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+#define AREAD_DEPTH			64			/* files being opened or read at once */
+#define AREAD_THREADS		16			/* readers when io_uring is not used */
+#define AREAD_MAX_FILE		(16 << 20)	/* larger files are mapped as usual */
+#define AREAD_BUDGET		(256 << 20)	/* bytes read and not yet released */
+
+typedef struct aread {
+	char *const  *paths;
+	int           nfiles;
+	char        **data;      /* of each file once read, or NULL */
+	size_t       *len;
+	int          *ready;     /* files in the order they completed */
+	int           nready;
+	int           taken;     /* of ready, by aread_next() */
+	int           next;      /* file to be opened next */
+	size_t        used;      /* bytes read and not yet released */
+	struct aread_ring *ring; /* io_uring, if it is used */
+	int           nthreads;
+	pthread_t     threads[AREAD_THREADS];
+	pthread_mutex_t lock;
+	pthread_cond_t  completed;
+	pthread_cond_t  released;
+} aread;
+
+/*
+-- Public interface of the module:
+--
+--  aread_start() starts reading the files in the background.
+--  aread_next() waits for the next file to complete, in any order, and
+--  returns its index, or -1 once every file has been handed out. The
+--  contents are NULL for files that are better opened as usual: stdin,
+--  anything but a small regular file, or a file that could not be read
+--  (so that opening it reports the error). aread_release() returns the
+--  contents once they are parsed, which lets more files be read.
+*/
+extern aread       *aread_start(int nfiles, char *const paths[]);
+extern int          aread_next(aread *r, char **data, size_t *len);
+extern void         aread_release(aread *r, char *data, size_t len);
+extern void         aread_stop(aread *r);
+
+#endif /* __AREAD_H */
@@ -0,0 +1,443 @@
+/*
+-- Benchmarks for statgen
+--
+-- Times the statistics kernels, the parsers and, given the path of a
+-- statgen binary, whole runs of statgen over generated files, so that
+-- the effect of a change can be measured rather than guessed.
+--
+--   bench [-n values] [-r runs] [-d directory] [statgen]
+--
+-- Each benchmark is run over n values (10^7 by default) the given number
+-- of times and the fastest run is reported. The results are written as
+-- tab-separated values with a heading line: the benchmark, the number of
+-- values, nanoseconds per value and megabytes of input per second (for
+-- the kernels, of the doubles they are passed).
+*/
+
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "input.h"
+#define  INLINE  /* open-code stats routines */
+#include "stats.h"
+#include "stats_basic.h"
+#include "stats_shard.h"
+
+#define MAX_ARRAY		(1 << 24)	/* values kept in memory at once */
+#define TEXT_WIDTH		16			/* bytes of a formatted value, at most */
+#define BENCH_THREADS	4			/* recording at once into one summary */
+
+static long long   numValues = 10000000;
+static int         numRuns = 3;
+static const char *dataDir = "/tmp";
+
+static double     *values;
+static size_t      numArray;     /* values in memory, repeated as needed */
+static char       *text;
+static size_t      textlen;
+static size_t      tailLen;      /* of the text of the last, partial repeat */
+static char       *raw;          /* the values as byte-swapped doubles */
+
+static volatile double sink;     /* keeps results from being optimized out */
+
+
+static void *xalloc(size_t size) {
+	void *p = malloc(size);
+
+	if (p == NULL) {
+		fputs("-- Error: out of memory allocating benchmark data.\n", stderr);
+		exit(1);
+	}
+	return p;
+}
+
+static double Now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+/* Positive values of a few magnitudes, like latencies; xorshift64*. */
+static double NextValue(uint64 *state) {
+	double u;
+
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	u = ((*state * 2685821657736338717ULL) >> 11) * (1.0 / 9007199254740992.0);
+	return floor(exp(8.0 * u) * 1e4) / 1e4;
+}
+
+static void Report(const char *name, long long n, double seconds,
+		double bytes) {
+	printf("%s\t%lld\t%.3f\t%.1f\n", name, n, seconds * 1e9 / n,
+			bytes / seconds / 1e6);
+	fflush(stdout);
+}
+
+static void MakeData(void) {
+	uint64 state = 88172645463325252ULL;
+	size_t i, n;
+	char *p;
+
+	numArray = numValues < MAX_ARRAY ? (size_t)numValues : MAX_ARRAY;
+	values = xalloc(numArray * sizeof(double));
+	text = p = xalloc(numArray * TEXT_WIDTH);
+	raw = xalloc(numArray * sizeof(double));
+	for (i = 0; i < numArray; i++) {
+		values[i] = NextValue(&state);
+		p += snprintf(p, TEXT_WIDTH, "%.4f\n", values[i]);
+	}
+	textlen = p - text;
+	n = numValues % numArray;
+	for (p = text; n > 0; n--)
+		p = memchr(p, '\n', text + textlen - p) + 1;
+	tailLen = p - text;
+	for (i = 0; i < numArray; i++) {
+		unsigned char *src = (unsigned char *)&values[i];
+
+		for (n = 0; n < sizeof(double); n++)
+			raw[i * sizeof(double) + n] = src[sizeof(double) - 1 - n];
+	}
+}
+
+/*
+-- The kernels. Each summarizes n values of the array (repeated if n is
+-- larger) and returns something that depends on all of them.
+*/
+
+static double BenchUpdate(long long n) {
+	stats_data s;
+	size_t i;
+
+	stats_init(&s);
+	for (; n > 0; n -= numArray)
+		for (i = 0; i < numArray && (long long)i < n; i++)
+			stats_update(&s, values[i]);
+	return stats_variance(&s);
+}
+
+static double BenchBatch(long long n) {
+	stats_data s;
+
+	stats_init(&s);
+	for (; n > 0; n -= numArray)
+		stats_update_batch(&s, values, n < (long long)numArray ? (size_t)n : numArray);
+	return stats_variance(&s);
+}
+
+static double BenchShard(long long n) {
+	stats_sharded s;
+	stats_shard *shard;
+	stats_data out;
+	size_t i;
+
+	stats_sharded_init(&s);
+	shard = stats_sharded_join(&s);
+	for (; n > 0; n -= numArray)
+		for (i = 0; i < numArray && (long long)i < n; i++)
+			stats_shard_update(shard, values[i]);
+	stats_sharded_leave(&s, shard);
+	stats_sharded_read(&s, &out);
+	stats_sharded_free(&s);
+	return stats_variance(&out);
+}
+
+/*
+-- BENCH_THREADS threads record into one summary, sharded or locked,
+-- sharing the n values between them so that all n are recorded.
+*/
+typedef struct shared_run {
+	stats_sharded    sharded;
+	stats_data       locked;
+	pthread_mutex_t  lock;
+} shared_run;
+
+typedef struct shared_thread {
+	shared_run      *run;
+	long long        n;
+} shared_thread;
+
+static void *RecordSharded(void *arg) {
+	shared_thread *t = arg;
+	shared_run *run = t->run;
+	stats_shard *shard = stats_sharded_join(&run->sharded);
+	long long i;
+
+	for (i = 0; i < t->n; i++)
+		stats_shard_update(shard, values[i % numArray]);
+	stats_sharded_leave(&run->sharded, shard);
+	return NULL;
+}
+
+static void *RecordLocked(void *arg) {
+	shared_thread *t = arg;
+	shared_run *run = t->run;
+	long long i;
+
+	for (i = 0; i < t->n; i++) {
+		pthread_mutex_lock(&run->lock);
+		stats_update(&run->locked, values[i % numArray]);
+		pthread_mutex_unlock(&run->lock);
+	}
+	return NULL;
+}
+
+static double RunShared(long long n, void *(*record)(void *)) {
+	pthread_t threads[BENCH_THREADS];
+	shared_thread each[BENCH_THREADS];
+	shared_run run;
+	stats_data out;
+	int i;
+
+	stats_sharded_init(&run.sharded);
+	stats_init(&run.locked);
+	pthread_mutex_init(&run.lock, NULL);
+	for (i = 0; i < BENCH_THREADS; i++) {
+		each[i].run = &run;
+		each[i].n = n / BENCH_THREADS + (i < n % BENCH_THREADS);
+		pthread_create(&threads[i], NULL, record, &each[i]);
+	}
+	for (i = 0; i < BENCH_THREADS; i++)
+		pthread_join(threads[i], NULL);
+	stats_sharded_read(&run.sharded, &out);
+	stats_merge(&out, &run.locked);
+	stats_sharded_free(&run.sharded);
+	pthread_mutex_destroy(&run.lock);
+	return stats_variance(&out);
+}
+
+static double BenchShardThreads(long long n) {
+	return RunShared(n, RecordSharded);
+}
+
+static double BenchLockedThreads(long long n) {
+	return RunShared(n, RecordLocked);
+}
+
+static double BenchBasic(long long n) {
+	stats_basic_f64 s;
+
+	stats_basic_f64_init(&s);
+	for (; n > 0; n -= numArray)
+		stats_basic_f64_update_batch(&s, values,
+				n < (long long)numArray ? (size_t)n : numArray);
+	return s.sum + s.max;
+}
+
+static double BenchPrecise(long long n) {
+	stats_precise s;
+	stats_data out;
+
+	stats_precise_init(&s);
+	for (; n > 0; n -= numArray)
+		stats_precise_update_batch(&s, values,
+				n < (long long)numArray ? (size_t)n : numArray);
+	stats_precise_result(&s, &out);
+	return stats_variance(&out);
+}
+
+static double BenchZ(long long n) {
+	double sum = 0.0;
+	long long i;
+
+	for (i = 0; i < n; i++)
+		sum += Z(0.0005 + (i % 1000) * 0.0004);
+	return sum;
+}
+
+static double BenchT(long long n) {
+	double sum = 0.0;
+	long long i;
+
+	for (i = 0; i < n; i++)
+		sum += T(0.025, 1 + (int)(i % 29));
+	return sum;
+}
+
+/* Parse the text of the values as statgen does, block by block. */
+static double BenchParseText(long long n) {
+	const char *p, *q, *end;
+	double x, sum = 0.0;
+
+	for (; n > 0; n -= numArray) {
+		end = text + (n < (long long)numArray ? tailLen : textlen);
+		for (p = text; (p = input_skip_space(p, end)) < end; p = q) {
+			if ((q = input_parse_double(p, end, &x)) == NULL)
+				input_bad_token(p, end);
+			sum += x;
+		}
+	}
+	return sum;
+}
+
+static double BenchDecode(long long n) {
+	input_format fmt = { INPUT_F64, 1, 0 };
+	double batch[STATS_BATCH_BLOCK], sum = 0.0;
+	size_t i, k;
+
+	for (; n > 0; n -= numArray)
+		for (i = 0; i < numArray && (long long)i < n; i += k) {
+			k = numArray - i < STATS_BATCH_BLOCK ? numArray - i : STATS_BATCH_BLOCK;
+			if ((long long)k > n - (long long)i)
+				k = n - i;
+			input_decode(&fmt, raw + i * sizeof(double), k, batch);
+			sum += batch[0] + batch[k - 1];
+		}
+	return sum;
+}
+
+static void RunKernel(const char *name, double (*kernel)(long long),
+		long long n, double bytes) {
+	double start, best = HUGE_VAL;
+	int r;
+
+	for (r = 0; r < numRuns; r++) {
+		start = Now();
+		sink = kernel(n);
+		if ((start = Now() - start) < best)
+			best = start;
+	}
+	Report(name, n, best, bytes);
+}
+
+/*
+-- Write the n values to path, as text or as native doubles, unless a
+-- file of the right size is there from an earlier run. It is written
+-- under another name and renamed, so an interrupted run leaves none.
+*/
+static double WriteFile(const char *path, int binary) {
+	double size = binary ? (double)numValues * sizeof(double) :
+		(double)textlen * (numValues / numArray) + tailLen;
+	char tmp[4096 + 4];
+	struct stat st;
+	FILE *fp;
+	long long n;
+	size_t k;
+
+	if (stat(path, &st) == 0 && (double)st.st_size == size)
+		return size;
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	if ((fp = fopen(tmp, "wb")) == NULL) {
+		perror(tmp);
+		exit(1);
+	}
+	for (n = numValues; n > 0; n -= k) {
+		k = n < (long long)numArray ? (size_t)n : numArray;
+		if (binary)
+			fwrite(values, sizeof(double), k, fp);
+		else
+			fwrite(text, 1, k == numArray ? textlen : tailLen, fp);
+	}
+	if (fclose(fp) != 0 || rename(tmp, path) != 0) {
+		perror(path);
+		exit(1);
+	}
+	return size;
+}
+
+/* Time runs of statgen over path, with its output thrown away. */
+static void RunStatgen(const char *name, const char *statgen,
+		const char *path, double bytes, char *const args[]) {
+	char *argv[8];
+	double start, best = HUGE_VAL;
+	int r, i, status;
+	pid_t pid;
+
+	argv[0] = (char *)statgen;
+	for (i = 0; args[i] != NULL; i++)
+		argv[i + 1] = args[i];
+	argv[i + 1] = (char *)path;
+	argv[i + 2] = NULL;
+	for (r = 0; r < numRuns; r++) {
+		start = Now();
+		if ((pid = fork()) == 0) {
+			int fd = open("/dev/null", O_WRONLY);
+
+			dup2(fd, STDOUT_FILENO);
+			execv(statgen, argv);
+			perror(statgen);
+			_exit(127);
+		}
+		if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+				WEXITSTATUS(status) != 0) {
+			fprintf(stderr, "-- Error: %s failed on %s.\n", statgen, path);
+			exit(1);
+		}
+		if ((start = Now() - start) < best)
+			best = start;
+	}
+	Report(name, numValues, best, bytes);
+}
+
+int main(int argc, char *argv[]) {
+	char textPath[4096], binaryPath[4096];
+	double bytes;
+	int c;
+
+	while ((c = getopt(argc, argv, "d:n:r:")) != EOF) {
+		switch (c) {
+		 case 'd':
+			dataDir = optarg;
+			break;
+		 case 'n':
+			numValues = (long long)strtod(optarg, NULL);
+			break;
+		 case 'r':
+			numRuns = atoi(optarg);
+			break;
+		 default:
+			fprintf(stderr, "Usage: %s [-n values] [-r runs] [-d directory] "
+					"[statgen]\n", argv[0]);
+			exit(1);
+		}
+	}
+	if (numValues < 1 || numRuns < 1) {
+		fputs("-- Error: -n and -r need to be positive.\n", stderr);
+		exit(1);
+	}
+
+	MakeData();
+	bytes = (double)numValues * sizeof(double);
+	puts("benchmark\tvalues\tns_per_value\tmb_per_s");
+	RunKernel("stats_update", BenchUpdate, numValues, bytes);
+	RunKernel("stats_update_batch", BenchBatch, numValues, bytes);
+	RunKernel("stats_shard_update", BenchShard, numValues, bytes);
+	RunKernel("stats_shard_update_4_threads", BenchShardThreads, numValues,
+			bytes);
+	RunKernel("mutex_update_4_threads", BenchLockedThreads, numValues, bytes);
+	RunKernel("stats_basic_f64", BenchBasic, numValues, bytes);
+	RunKernel("stats_precise", BenchPrecise, numValues, bytes);
+	RunKernel("Z", BenchZ, numValues, bytes);
+	RunKernel("T", BenchT, numValues, bytes);
+	RunKernel("parse_text", BenchParseText, numValues,
+			(double)textlen * (numValues / numArray) + tailLen);
+	RunKernel("decode_f64_swapped", BenchDecode, numValues, bytes);
+
+	if (optind < argc) {
+		static char *textArgs[] = { NULL };
+		static char *binaryArgs[] = { "-b", NULL };
+		static char *quantileArgs[] = { "-q", NULL };
+
+		snprintf(textPath, sizeof(textPath), "%s/statgen-bench-%lld.txt",
+				dataDir, numValues);
+		snprintf(binaryPath, sizeof(binaryPath), "%s/statgen-bench-%lld.f64",
+				dataDir, numValues);
+		bytes = WriteFile(textPath, 0);
+		RunStatgen("statgen_text", argv[optind], textPath, bytes, textArgs);
+		RunStatgen("statgen_text_percentiles", argv[optind], textPath, bytes,
+				quantileArgs);
+		bytes = WriteFile(binaryPath, 1);
+		RunStatgen("statgen_f64", argv[optind], binaryPath, bytes, binaryArgs);
+	}
+	return 0;
+}
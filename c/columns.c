@@ -0,0 +1,588 @@
+/*
+-- Multi-column input for statgen
+*/
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define  INLINE  /* open-code stats routines */
+#include "stats.h"
+#include "columns.h"
+#include "input.h"
+
+#define IS_BLANK(c)	((c) != '\n' && INPUT_IS_SPACE(c))
+
+
+static void *xalloc(size_t count, size_t size) {
+	void *p = calloc(count ? count : 1, size);
+
+	if (p == NULL) {
+		fputs("-- Error: out of memory allocating columns.\n", stderr);
+		exit(1);
+	}
+	return p;
+}
+
+/* Parse a list such as "1,3-5,8-" (fields are numbered from 1). */
+int columns_parse_list(column_layout *layout, const char *list) {
+	const char *p = list;
+	char *stop;
+
+	free(layout->ranges);
+	layout->ranges = NULL;
+	layout->nranges = 0;
+	do {
+		column_range r;
+
+		r.lo = strtol(p, &stop, 10);
+		if (stop == p || r.lo < 1)
+			return -1;
+		r.hi = r.lo;
+		if (*stop == '-') {
+			p = stop + 1;
+			r.hi = (*p == ',' || *p == '\0') ? INT_MAX : strtol(p, &stop, 10);
+			if (r.hi < r.lo || (r.hi != INT_MAX && stop == p))
+				return -1;
+			if (r.hi == INT_MAX)
+				stop = (char *)p;
+		}
+		if (*stop != ',' && *stop != '\0')
+			return -1;
+		layout->ranges = realloc(layout->ranges,
+				(layout->nranges + 1) * sizeof(column_range));
+		if (layout->ranges == NULL)
+			return -1;
+		layout->ranges[layout->nranges++] = r;
+		p = stop + 1;
+	} while (*stop == ',');
+	return 0;
+}
+
+/*
+-- Find the next field on the line [p, eol), storing its bounds. Returns
+-- where the following field search should start, or NULL at line end.
+*/
+static const char *next_field(const column_layout *layout, const char *p,
+		const char *eol, const char **field, const char **fend) {
+	if (p == NULL || p > eol)
+		return NULL;
+	if (layout->delimiter) {
+		const char *d = memchr(p, layout->delimiter, eol - p);
+		*field = p;
+		*fend = (d == NULL) ? eol : d;
+		return (d == NULL) ? eol + 1 : d + 1;
+	}
+	while (p < eol && IS_BLANK(*p))
+		p++;
+	if (p >= eol)
+		return NULL;
+	*field = p;
+	while (p < eol && !INPUT_IS_SPACE(*p))
+		p++;
+	*fend = p;
+	return p;
+}
+
+/*
+-- Convert a field; returns 0 if it is empty (a missing value), 1 if
+-- it holds a number and -1 if it holds anything else.
+*/
+static int parse_field(const char *p, const char *fend, double *x) {
+	const char *q;
+
+	p = input_skip_space(p, fend);
+	if (p == fend)
+		return 0;
+	q = input_parse_double(p, fend, x);
+	if (q == NULL || input_skip_space(q, fend) != fend)
+		return -1;
+	return 1;
+}
+
+static int field_selected(const column_layout *layout, int field) {
+	int i;
+
+	if (field == layout->keyfield)
+		return 0;
+	if (layout->ranges == NULL)
+		return layout->keyfield == 0 || field == (layout->keyfield == 1 ? 2 : 1);
+	for (i = 0; i < layout->nranges; i++) {
+		if (field >= layout->ranges[i].lo && field <= layout->ranges[i].hi)
+			return 1;
+	}
+	return 0;
+}
+
+const char *columns_setup(column_layout *layout, const char *p,
+		const char *end) {
+	const char *line, *eol, *q, *field, *fend;
+	int i, n, header = 0;
+	double x;
+
+	/* Skip blank lines. */
+	for (;;) {
+		if (p >= end)
+			return NULL;
+		eol = memchr(p, '\n', end - p);
+		if (eol == NULL)
+			eol = end;
+		for (q = p; q < eol && INPUT_IS_SPACE(*q); q++)
+			;
+		if (q < eol)
+			break;
+		p = eol + 1;
+	}
+	line = p;
+
+	/* Size the layout from the fields on this line and the -k list. */
+	n = 0;
+	for (q = line; (q = next_field(layout, q, eol, &field, &fend)) != NULL; )
+		n++;
+	layout->nfields = n;
+	for (i = 0; i < layout->nranges; i++) {
+		if (layout->ranges[i].hi != INT_MAX && layout->ranges[i].hi > n)
+			layout->nfields = layout->ranges[i].hi;
+	}
+	if (layout->keyfield > layout->nfields)
+		layout->nfields = layout->keyfield;
+	if (layout->keyfield > 0 && layout->ranges == NULL && layout->nfields < 2)
+		layout->nfields = 2;
+	layout->slot = xalloc(layout->nfields, sizeof(int));
+	layout->labels = xalloc(layout->nfields, sizeof(char *));
+	layout->ncols = 0;
+	for (i = 0; i < layout->nfields; i++) {
+		layout->slot[i] = field_selected(layout, i + 1) ? layout->ncols++ : -1;
+	}
+	if (layout->keyfield > 0 && layout->ncols != 1) {
+		fputs("-- Error: grouping needs exactly one value field.\n", stderr);
+		exit(1);
+	}
+
+	/* A non-numeric selected field means the line names the columns. */
+	i = 0;
+	for (q = line; (q = next_field(layout, q, eol, &field, &fend)) != NULL; i++) {
+		if (layout->slot[i] >= 0 && parse_field(field, fend, &x) < 0)
+			header = 1;
+	}
+	i = 0;
+	for (q = line; (q = next_field(layout, q, eol, &field, &fend)) != NULL; i++) {
+		int s = layout->slot[i];
+		if (s >= 0 && header) {
+			field = input_skip_space(field, fend);
+			while (fend > field && INPUT_IS_SPACE(fend[-1]))
+				fend--;
+			layout->labels[s] = strndup(field, fend - field);
+		}
+	}
+	for (i = 0; i < layout->nfields; i++) {
+		int s = layout->slot[i];
+		if (s >= 0 && layout->labels[s] == NULL) {
+			char name[16];
+			snprintf(name, sizeof(name), "%d", i + 1);
+			layout->labels[s] = strdup(name);
+		}
+	}
+
+	layout->ready = 1;
+	return header ? (eol < end ? eol + 1 : end) : line;
+}
+
+void columns_reset(column_layout *layout) {
+	int i;
+
+	for (i = 0; i < layout->ncols; i++)
+		free(layout->labels[i]);
+	free(layout->labels);
+	free(layout->slot);
+	layout->labels = NULL;
+	layout->slot = NULL;
+	layout->nfields = layout->ncols = 0;
+	layout->ready = 0;
+}
+
+/* The ranges are shared, not copied; they are never changed once parsed. */
+void columns_copy_options(column_layout *dst, const column_layout *src) {
+	memset(dst, 0, sizeof(*dst));
+	dst->delimiter = src->delimiter;
+	dst->nranges = src->nranges;
+	dst->ranges = src->ranges;
+	dst->keyfield = src->keyfield;
+	dst->quantiles = src->quantiles;
+}
+
+void columns_accum_init(column_accum *acc, const column_layout *layout) {
+	int i;
+
+	acc->ncols = layout->ncols;
+	acc->stats = xalloc(acc->ncols, sizeof(stats_data));
+	acc->batch = xalloc((size_t)acc->ncols * STATS_BATCH_BLOCK, sizeof(double));
+	acc->pending = xalloc(acc->ncols, sizeof(int));
+	acc->sketches = NULL;
+	for (i = 0; i < acc->ncols; i++)
+		stats_init(&acc->stats[i]);
+	if (layout->quantiles != SKETCH_NONE) {
+		acc->sketches = xalloc(acc->ncols, sizeof(sketch));
+		for (i = 0; i < acc->ncols; i++)
+			sketch_init(&acc->sketches[i], layout->quantiles == SKETCH_EXACT);
+	}
+}
+
+static void flush_column(column_accum *acc, int s) {
+	double *batch = acc->batch + (size_t)s * STATS_BATCH_BLOCK;
+
+	stats_update_batch(&acc->stats[s], batch, acc->pending[s]);
+	if (acc->sketches != NULL)
+		sketch_add_batch(&acc->sketches[s], batch, acc->pending[s]);
+	acc->pending[s] = 0;
+}
+
+void columns_accumulate(const column_layout *layout, column_accum *acc,
+		const char *p, const char *end) {
+	const char *eol, *q, *field, *fend;
+	double *batch;
+	int i, s;
+
+	for (; p < end; p = eol + 1) {
+		eol = memchr(p, '\n', end - p);
+		if (eol == NULL)
+			eol = end;
+		i = 0;
+		for (q = p; i < layout->nfields &&
+				(q = next_field(layout, q, eol, &field, &fend)) != NULL; i++) {
+			if ((s = layout->slot[i]) < 0)
+				continue;
+			batch = acc->batch + (size_t)s * STATS_BATCH_BLOCK;
+			switch (parse_field(field, fend, &batch[acc->pending[s]])) {
+			 case 1:
+				if (++acc->pending[s] == STATS_BATCH_BLOCK)
+					flush_column(acc, s);
+				break;
+			 case -1:
+				input_bad_token(input_skip_space(field, fend), fend);
+				break;
+			}
+		}
+	}
+}
+
+void columns_flush(column_accum *acc) {
+	int s;
+
+	for (s = 0; s < acc->ncols; s++)
+		flush_column(acc, s);
+}
+
+void columns_merge(column_accum *dst, column_accum *src) {
+	int s;
+
+	columns_flush(src);
+	for (s = 0; s < dst->ncols; s++) {
+		stats_merge(&dst->stats[s], &src->stats[s]);
+		if (dst->sketches != NULL)
+			sketch_merge(&dst->sketches[s], &src->sketches[s]);
+	}
+}
+
+void columns_accum_free(column_accum *acc) {
+	int s;
+
+	for (s = 0; acc->sketches != NULL && s < acc->ncols; s++)
+		sketch_free(&acc->sketches[s]);
+	free(acc->sketches);
+	free(acc->stats);
+	free(acc->batch);
+	free(acc->pending);
+	memset(acc, 0, sizeof(*acc));
+}
+
+void columns_group_init(group_accum *acc, int quantiles, int compact) {
+	keytab_init(&acc->keys);
+	acc->quantiles = quantiles;
+	acc->compact = compact;
+	acc->capacity = 0;
+	acc->moments = NULL;
+	acc->ranges = NULL;
+	acc->moments32 = NULL;
+	acc->ranges32 = NULL;
+	acc->cached = NULL;
+	acc->sketches = NULL;
+	if (compact) {
+		size_t i;
+
+		if ((acc->cached = malloc(GROUP_CACHE_SIZE * sizeof(group_cached)))
+				== NULL) {
+			fputs("-- Error: out of memory for groups.\n", stderr);
+			exit(1);
+		}
+		for (i = 0; i < GROUP_CACHE_SIZE; i++)
+			acc->cached[i].index = SIZE_MAX;
+	}
+}
+
+/*
+-- The summary of a key as a stats_data, and back, so that the numbers
+-- are worked out by stats.c as they are for a single stream.
+*/
+static void group_load(const group_accum *acc, size_t i, stats_data *s) {
+	if (acc->compact) {
+		s->count = acc->moments32[i].count;
+		s->mean = acc->moments32[i].mean;
+		s->variance = acc->moments32[i].variance;
+		s->min = acc->ranges32[i].min;
+		s->max = acc->ranges32[i].max;
+	} else {
+		s->count = acc->moments[i].count;
+		s->mean = acc->moments[i].mean;
+		s->variance = acc->moments[i].variance;
+		s->min = acc->ranges[i].min;
+		s->max = acc->ranges[i].max;
+	}
+}
+
+static void group_store(group_accum *acc, size_t i, const stats_data *s) {
+	if (acc->compact) {
+		acc->moments32[i].count = s->count;
+		acc->moments32[i].mean = (float)s->mean;
+		acc->moments32[i].variance = (float)s->variance;
+		acc->ranges32[i].min = (float)s->min;
+		acc->ranges32[i].max = (float)s->max;
+	} else {
+		acc->moments[i].count = s->count;
+		acc->moments[i].mean = s->mean;
+		acc->moments[i].variance = s->variance;
+		acc->ranges[i].min = s->min;
+		acc->ranges[i].max = s->max;
+	}
+}
+
+/* Make room for at least capacity keys. */
+static void group_grow(group_accum *acc, size_t capacity) {
+	int failed;
+
+	if (acc->compact) {
+		acc->moments32 = realloc(acc->moments32,
+				capacity * sizeof(group_moments_f32));
+		acc->ranges32 = realloc(acc->ranges32, capacity * sizeof(group_range_f32));
+		failed = acc->moments32 == NULL || acc->ranges32 == NULL;
+	} else {
+		acc->moments = realloc(acc->moments, capacity * sizeof(group_moments));
+		acc->ranges = realloc(acc->ranges, capacity * sizeof(group_range));
+		failed = acc->moments == NULL || acc->ranges == NULL;
+	}
+	if (acc->quantiles != SKETCH_NONE) {
+		acc->sketches = realloc(acc->sketches, capacity * sizeof(sketch));
+		failed |= acc->sketches == NULL;
+	}
+	if (failed) {
+		fputs("-- Error: out of memory growing groups.\n", stderr);
+		exit(1);
+	}
+	acc->capacity = capacity;
+}
+
+/* Return the index of a key's accumulators, creating them if it is new. */
+static size_t group_slot(group_accum *acc, const char *key, size_t len) {
+	size_t count = keytab_count(&acc->keys);
+	size_t index = keytab_lookup(&acc->keys, key, len);
+
+	if (index == count) {
+		stats_data empty;
+
+		if (index == acc->capacity)
+			group_grow(acc, acc->capacity ? 2 * acc->capacity : 1024);
+		stats_init(&empty);
+		group_store(acc, index, &empty);
+		if (acc->sketches != NULL)
+			sketch_init(&acc->sketches[index], acc->quantiles == SKETCH_EXACT);
+	}
+	return index;
+}
+
+/* Merge the values of a cached key into its summary and free the entry. */
+static void group_uncache(group_accum *acc, group_cached *c) {
+	stats_data s;
+
+	if (c->index == SIZE_MAX)
+		return;
+	group_load(acc, c->index, &s);
+	stats_merge(&s, &c->data);
+	group_store(acc, c->index, &s);
+	c->index = SIZE_MAX;
+}
+
+void columns_group_add(group_accum *acc, const char *key, size_t len,
+		double x) {
+	size_t index = group_slot(acc, key, len);
+	group_cached *c;
+	stats_data s;
+
+	if (acc->compact) {
+		c = &acc->cached[index % GROUP_CACHE_SIZE];
+		if (c->index != index) {
+			group_uncache(acc, c);
+			c->index = index;
+			stats_init(&c->data);
+		}
+		stats_update(&c->data, x);
+	} else {
+		group_load(acc, index, &s);
+		stats_update(&s, x);
+		group_store(acc, index, &s);
+	}
+	if (acc->sketches != NULL)
+		sketch_add(&acc->sketches[index], x);
+}
+
+/*
+-- Accumulate the lines of a region; a line without a key or with a bad
+-- value is fatal if strict, and otherwise skipped. Returns the skipped.
+*/
+static size_t group_lines(const column_layout *layout, group_accum *acc,
+		const char *p, const char *end, int strict) {
+	const char *eol, *q, *field, *fend, *key, *kend;
+	int i, found, valid;
+	size_t skipped = 0;
+	double x;
+
+	for (; p < end; p = eol + 1) {
+		eol = memchr(p, '\n', end - p);
+		if (eol == NULL)
+			eol = end;
+		key = kend = NULL;
+		valid = 0;
+		i = 0;
+		for (q = p; i < layout->nfields &&
+				(q = next_field(layout, q, eol, &field, &fend)) != NULL; i++) {
+			if (i + 1 == layout->keyfield) {
+				key = input_skip_space(field, fend);
+				for (kend = fend; kend > key && INPUT_IS_SPACE(kend[-1]); kend--)
+					;
+			} else if (layout->slot[i] >= 0) {
+				if ((found = parse_field(field, fend, &x)) < 0 && strict)
+					input_bad_token(input_skip_space(field, fend), fend);
+				valid = found;
+			}
+		}
+		if (key == NULL) {
+			if (i == 0)
+				continue;		/* blank line */
+			if (strict) {
+				fprintf(stderr, "-- Error: line has no field %d to group by.\n",
+						layout->keyfield);
+				exit(1);
+			}
+			valid = -1;
+		}
+		if (valid > 0)
+			columns_group_add(acc, key, kend - key, x);
+		else if (valid < 0)
+			skipped++;
+	}
+	columns_group_flush(acc);
+	return skipped;
+}
+
+void columns_group_accumulate(const column_layout *layout, group_accum *acc,
+		const char *p, const char *end) {
+	group_lines(layout, acc, p, end, 1);
+}
+
+size_t columns_group_accept(const column_layout *layout, group_accum *acc,
+		const char *p, const char *end) {
+	return group_lines(layout, acc, p, end, 0);
+}
+
+void columns_group_flush(group_accum *acc) {
+	size_t i;
+
+	for (i = 0; acc->cached != NULL && i < GROUP_CACHE_SIZE; i++)
+		group_uncache(acc, &acc->cached[i]);
+}
+
+/* Fold src into dst; keys new to dst are appended in src's order. */
+void columns_group_merge(group_accum *dst, const group_accum *src) {
+	size_t i, len, n = keytab_count(&src->keys);
+	const char *key;
+
+	stats_data to, from;
+
+	for (i = 0; i < n; i++) {
+		size_t index;
+		key = keytab_key_at(&src->keys, i, &len);
+		index = group_slot(dst, key, len);
+		group_load(dst, index, &to);
+		group_load(src, i, &from);
+		stats_merge(&to, &from);
+		group_store(dst, index, &to);
+		if (dst->sketches != NULL)
+			sketch_merge(&dst->sketches[index], &src->sketches[i]);
+	}
+}
+
+uint64 columns_group_count(const group_accum *acc, size_t index) {
+	return acc->compact ? acc->moments32[index].count :
+		acc->moments[index].count;
+}
+
+void columns_group_stats(const group_accum *acc, size_t index,
+		stats_data *out) {
+	group_load(acc, index, out);
+}
+
+/* The loops over the separate arrays are simple enough to vectorize. */
+void columns_group_results(const group_accum *acc, size_t first, size_t n,
+		stats_data *out) {
+	size_t i;
+
+	if (acc->compact) {
+		const group_moments_f32 *m = acc->moments32 + first;
+		const group_range_f32 *r = acc->ranges32 + first;
+
+		for (i = 0; i < n; i++) {
+			out[i].count = m[i].count;
+			out[i].mean = m[i].mean;
+			out[i].variance = m[i].variance;
+		}
+		for (i = 0; i < n; i++) {
+			out[i].min = r[i].min;
+			out[i].max = r[i].max;
+		}
+	} else {
+		const group_moments *m = acc->moments + first;
+		const group_range *r = acc->ranges + first;
+
+		for (i = 0; i < n; i++) {
+			out[i].count = m[i].count;
+			out[i].mean = m[i].mean;
+			out[i].variance = m[i].variance;
+		}
+		for (i = 0; i < n; i++) {
+			out[i].min = r[i].min;
+			out[i].max = r[i].max;
+		}
+	}
+}
+
+void columns_group_free(group_accum *acc) {
+	size_t i, n = keytab_count(&acc->keys);
+
+	for (i = 0; acc->sketches != NULL && i < n; i++)
+		sketch_free(&acc->sketches[i]);
+	keytab_free(&acc->keys);
+	free(acc->moments);
+	free(acc->ranges);
+	free(acc->moments32);
+	free(acc->ranges32);
+	free(acc->cached);
+	free(acc->sketches);
+	acc->moments = NULL;
+	acc->ranges = NULL;
+	acc->moments32 = NULL;
+	acc->ranges32 = NULL;
+	acc->cached = NULL;
+	acc->sketches = NULL;
+	acc->capacity = 0;
+}
@@ -0,0 +1,159 @@
+/*
+-- Multi-column input for statgen
+--
+-- Splits each line into fields once and accumulates the selected fields
+-- into an array of stats_data, one per column.
+*/
+
+#ifndef __COLUMNS_H
+#define __COLUMNS_H
+
+#include "stats.h"
+#include "keytab.h"
+#include "sketch.h"
+
+typedef struct column_range {
+	int           lo;
+	int           hi;        /* INT_MAX for an open range such as "3-" */
+} column_range;
+
+/* Which fields of a line are summarized, and under which labels. */
+typedef struct column_layout {
+	/* Options, kept across files. */
+	char          delimiter; /* field separator, or 0 for runs of blanks */
+	int           nranges;
+	column_range *ranges;    /* fields selected by -k, or NULL for all */
+	int           keyfield;  /* field to group by, or 0 */
+	int           quantiles; /* kind of sketch kept per column (sketch.h) */
+
+	/* Discovered from the first line of each file. */
+	int           ready;
+	int           nfields;   /* number of entries in slot */
+	int          *slot;      /* column of each field, or -1 if unused */
+	int           ncols;
+	char        **labels;
+} column_layout;
+
+/* Per-thread accumulators for each column, with a batch buffer apiece. */
+typedef struct column_accum {
+	int           ncols;
+	stats_data   *stats;
+	sketch       *sketches;  /* one per column, or NULL */
+	double       *batch;     /* ncols x STATS_BATCH_BLOCK values */
+	int          *pending;
+} column_accum;
+
+/*
+-- What every value of a key updates, apart from the range it seldom
+-- changes, so that counting and merging keys reads fewer cache lines.
+-- Compact groups (--compact) keep the mean, variance and range of each
+-- key in single precision, in 24 bytes rather than 40.
+*/
+typedef struct group_moments {
+	uint64        count;
+	double        mean;
+	double        variance;
+} group_moments;
+
+typedef struct group_moments_f32 {
+	uint64        count;
+	float         mean;
+	float         variance;
+} group_moments_f32;
+
+typedef struct group_range {
+	double        min;
+	double        max;
+} group_range;
+
+typedef struct group_range_f32 {
+	float         min;
+	float         max;
+} group_range_f32;
+
+/*
+-- The values of compact groups are summarized in double precision, per
+-- key among the last few added to, and merged into the key's single
+-- precision summary when it is flushed: at the end of each region, or
+-- when another key takes its entry. The summaries are thus rounded once
+-- per flush rather than once per value, which would stop the mean of a
+-- key moving once it had about 2^24 values.
+*/
+#define GROUP_CACHE_SIZE		256
+
+typedef struct group_cached {
+	size_t        index;     /* of the key, or SIZE_MAX if unused */
+	stats_data    data;      /* its values since the last flush */
+} group_cached;
+
+/* Accumulators for the value field of each distinct key (--group-by). */
+typedef struct group_accum {
+	keytab        keys;
+	int           quantiles; /* kind of sketch kept per key (sketch.h) */
+	int           compact;   /* moments and ranges are single precision */
+	size_t        capacity;
+	group_moments     *moments;    /* indexed like keys, unless compact */
+	group_range       *ranges;
+	group_moments_f32 *moments32;  /* indexed like keys, if compact */
+	group_range_f32   *ranges32;
+	group_cached      *cached;     /* GROUP_CACHE_SIZE entries, if compact */
+	sketch       *sketches;  /* indexed like keys, or NULL */
+} group_accum;
+
+/*
+-- Public interface of the module:
+--
+--  columns_setup() examines the first non-blank line of a file to size
+--  the layout; if that line is not numeric it supplies the column
+--  labels. It returns where accumulation should begin, or NULL if the
+--  region held no non-blank line (call it again with the next region).
+--  When grouping, the key field is never a column and the value field
+--  defaults to the first other field. columns_copy_options() gives a
+--  fresh layout the options of another, to read a file concurrently.
+--  columns_group_accept() accumulates like columns_group_accumulate()
+--  but skips malformed lines instead of exiting, returning how many,
+--  for input from clients; columns_group_add() adds one keyed value,
+--  which columns_group_flush() then makes part of the summary.
+--  columns_group_count() and columns_group_stats() read the summary of
+--  a key, and columns_group_results() those of a run of keys at once.
+*/
+extern int          columns_parse_list(column_layout *layout,
+                                       const char *list);
+extern const char  *columns_setup(column_layout *layout, const char *p,
+                                  const char *end);
+extern void         columns_reset(column_layout *layout);
+extern void         columns_copy_options(column_layout *dst,
+                                         const column_layout *src);
+
+extern void         columns_accum_init(column_accum *acc,
+                                       const column_layout *layout);
+extern void         columns_accumulate(const column_layout *layout,
+                                       column_accum *acc, const char *p,
+                                       const char *end);
+extern void         columns_flush(column_accum *acc);
+extern void         columns_merge(column_accum *dst, column_accum *src);
+extern void         columns_accum_free(column_accum *acc);
+
+extern void         columns_group_init(group_accum *acc, int quantiles,
+                                       int compact);
+extern void         columns_group_accumulate(const column_layout *layout,
+                                             group_accum *acc, const char *p,
+                                             const char *end);
+extern size_t       columns_group_accept(const column_layout *layout,
+                                         group_accum *acc, const char *p,
+                                         const char *end);
+extern void         columns_group_add(group_accum *acc, const char *key,
+                                      size_t len, double x);
+extern void         columns_group_flush(group_accum *acc);
+extern void         columns_group_merge(group_accum *dst,
+                                        const group_accum *src);
+extern uint64       columns_group_count(const group_accum *acc,
+                                        size_t index);
+extern void         columns_group_stats(const group_accum *acc, size_t index,
+                                        stats_data *out);
+extern void         columns_group_results(const group_accum *acc,
+                                          size_t first, size_t n,
+                                          stats_data *out);
+extern void         columns_group_free(group_accum *acc);
+
+#endif /* __COLUMNS_H */
@@ -0,0 +1,523 @@
+/*
+-- Input layer for statgen
+--
+-- Note: numbers are converted with the exact fast path described in
+-- W. D. Clinger, "How to Read Floating Point Numbers Accurately", PLDI
+-- 1990: a decimal significand below 2^53 scaled by an exact power of
+-- ten up to 10^22 is correctly rounded by a single multiply or divide.
+-- Where long double carries a 64-bit significand, the same trick covers
+-- the 17 digit significands printed by most tools: the product rounded
+-- to 64 bits rounds to the correct double unless it lands exactly on a
+-- halfway point, which is detected. Anything else (long significands,
+-- huge exponents, inf, nan, hex) is handed to strtod() so results are
+-- identical to the old fscanf() path.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <float.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "input.h"
+
+#define IS_DIGIT(c)	((unsigned)((c) - '0') < 10)
+
+#define MAX_DIGITS	19		/* decimal digits that always fit in 64 bits */
+#define MAX_EXACT	22		/* largest exactly representable power of ten */
+
+static const double exact_pow10[MAX_EXACT + 1] = {
+	1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+#if LDBL_MANT_DIG == 64
+#define MAX_EXACT_LONG	27		/* 5^27 < 2^64 */
+
+static const long double exact_pow10_long[MAX_EXACT_LONG + 1] = {
+	1e0L,  1e1L,  1e2L,  1e3L,  1e4L,  1e5L,  1e6L,  1e7L,  1e8L,  1e9L,
+	1e10L, 1e11L, 1e12L, 1e13L, 1e14L, 1e15L, 1e16L, 1e17L, 1e18L, 1e19L,
+	1e20L, 1e21L, 1e22L, 1e23L, 1e24L, 1e25L, 1e26L, 1e27L
+};
+
+/* Scale in extended precision; returns 0 if rounding to double may be off. */
+static int extended_scale(unsigned long long mantissa, int exp10, double *x) {
+	long double r = mantissa;
+	unsigned long long bits;
+	int e;
+
+	if (exp10 < 0)
+		r /= exact_pow10_long[-exp10];
+	else
+		r *= exact_pow10_long[exp10];
+	bits = (unsigned long long)ldexpl(frexpl(r, &e), 64);
+	if ((bits & 0x7FF) == 0x400)
+		return 0;
+	*x = (double)r;
+	return 1;
+}
+#endif /* LDBL_MANT_DIG */
+
+
+/* Use the input in memory (in->map) in place, or decompress it. */
+static void use_memory(input_stream *in, int detect) {
+	int type = detect ? zinput_detect(in->map, in->maplen) : ZINPUT_NONE;
+
+	if (type == ZINPUT_NONE)
+		return;
+
+	/* The mapping is only read by the decompressor from now on. */
+	in->zmap = in->map;
+	in->zmaplen = in->maplen;
+	in->map = NULL;
+	in->z = zinput_open(type, -1, in->zmap, in->zmaplen, NULL, 0);
+}
+
+static int alloc_buffer(input_stream *in) {
+	in->bufsize = INPUT_BLOCK_SIZE;
+	in->buf = malloc(in->bufsize);
+	if (in->buf == NULL) {
+		fputs("-- Error: out of memory allocating input buffer.\n", stderr);
+		return -1;
+	}
+	return 0;
+}
+
+int input_open(input_stream *in, FILE *fp, int detect) {
+	struct stat st;
+	ssize_t n;
+	int type;
+
+	memset(in, 0, sizeof(*in));
+	in->fd = fileno(fp);
+
+	/* Map regular files, unless something has already consumed part of it. */
+	if (fstat(in->fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 &&
+			lseek(in->fd, 0, SEEK_CUR) == 0) {
+		void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, in->fd, 0);
+		if (map != MAP_FAILED) {
+			madvise(map, st.st_size, MADV_SEQUENTIAL);
+			in->map = map;
+			in->maplen = st.st_size;
+			use_memory(in, detect);
+			if (in->z == NULL)
+				return 0;
+		}
+	}
+
+	if (alloc_buffer(in) != 0)
+		return -1;
+	if (in->z != NULL || !detect)
+		return 0;
+
+	/*
+	-- Look at the first bytes of a stream, only until they cannot begin a
+	-- compressed one, so a slow pipe is not waited on. input_next() hands
+	-- them out before reading any more.
+	*/
+	while (zinput_prefix(in->buf, in->carry)) {
+		n = read(in->fd, in->buf + in->carry, in->bufsize - in->carry);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			perror("-- Error: read failed");
+			exit(1);
+		}
+		if (n == 0) {
+			in->eof = 1;
+			break;
+		}
+		in->carry += n;
+	}
+	type = zinput_detect(in->buf, in->carry);
+	if (type != ZINPUT_NONE) {
+		in->z = zinput_open(type, in->fd, NULL, 0, in->buf, in->carry);
+		in->carry = 0;
+		in->eof = 0;
+	}
+	in->sniffed = in->carry > 0;
+	return 0;
+}
+
+/* Read input that is already in memory (and stays owned by the caller). */
+int input_open_memory(input_stream *in, const char *data, size_t len,
+		int detect) {
+	memset(in, 0, sizeof(*in));
+	in->fd = -1;
+	in->map = (char *)data;
+	in->maplen = len;
+	in->borrowed = 1;
+	use_memory(in, detect);
+	if (in->z != NULL)
+		return alloc_buffer(in);
+	return 0;
+}
+
+/* Fill dst from the input, as read() does. */
+static ssize_t input_read(input_stream *in, char *dst, size_t size) {
+	if (in->z != NULL)
+		return zinput_read(in->z, dst, size);
+	return read(in->fd, dst, size);
+}
+
+int input_next(input_stream *in, const char **begin, const char **end) {
+	size_t len, cut;
+	int fresh = in->sniffed;
+
+	if (in->map != NULL) {
+		if (in->eof)
+			return 0;
+		in->eof = 1;
+		*begin = in->map;
+		*end = in->map + in->maplen;
+		return 1;
+	}
+
+	/* Move the incomplete token left over from the last block to the front. */
+	len = in->carry;
+	if (len > 0)
+		memmove(in->buf, in->buf + in->consumed, len);
+	in->carry = 0;
+	in->consumed = 0;
+	in->sniffed = 0;
+
+	for (;;) {
+		ssize_t n;
+
+		if (in->eof) {
+			if (len == 0)
+				return 0;
+			*begin = in->buf;
+			*end = in->buf + len;
+			return 1;
+		}
+		if (fresh) {
+			/* The bytes input_open() looked at, before waiting for more. */
+			fresh = 0;
+		} else {
+			if (len == in->bufsize) {
+				/* A single token larger than the buffer; make room for it. */
+				char *buf = realloc(in->buf, 2 * in->bufsize);
+				if (buf == NULL) {
+					fputs("-- Error: out of memory growing input buffer.\n", stderr);
+					exit(1);
+				}
+				in->buf = buf;
+				in->bufsize *= 2;
+			}
+
+			n = input_read(in, in->buf + len, in->bufsize - len);
+			if (n < 0) {
+				if (errno == EINTR)
+					continue;
+				perror("-- Error: read failed");
+				exit(1);
+			}
+			if (n == 0) {
+				in->eof = 1;
+				continue;
+			}
+			len += n;
+		}
+
+		/* Hand out everything up to the last separator or whole record. */
+		if (in->recsize > 0)
+			cut = len - len % in->recsize;
+		else if (in->lines)
+			for (cut = len; cut > 0 && in->buf[cut - 1] != '\n'; cut--)
+				;
+		else
+			for (cut = len; cut > 0 && !INPUT_IS_SPACE(in->buf[cut - 1]); cut--)
+				;
+		if (cut > 0) {
+			*begin = in->buf;
+			*end = in->buf + cut;
+			in->consumed = cut;
+			in->carry = len - cut;
+			return 1;
+		}
+	}
+}
+
+void input_set_record_size(input_stream *in, size_t size) {
+	in->recsize = size;
+}
+
+void input_set_line_mode(input_stream *in) {
+	in->lines = 1;
+}
+
+/*
+-- Wait up to timeout_ms for more input; returns 0 on timeout. Mapped
+-- and exhausted inputs never block.
+*/
+int input_poll(input_stream *in, int timeout_ms) {
+	struct pollfd p;
+	int n;
+
+	if (in->map != NULL || in->eof)
+		return 1;
+	if (in->z != NULL)
+		return zinput_poll(in->z, timeout_ms);
+	p.fd = in->fd;
+	p.events = POLLIN;
+	do {
+		n = poll(&p, 1, timeout_ms);
+	} while (n < 0 && errno == EINTR);
+	return n != 0;
+}
+
+void input_close(input_stream *in) {
+	if (in->map != NULL && !in->borrowed)
+		munmap(in->map, in->maplen);
+	if (in->z != NULL)
+		zinput_close(in->z);
+	if (in->zmap != NULL && !in->borrowed)
+		munmap(in->zmap, in->zmaplen);
+	free(in->buf);
+	memset(in, 0, sizeof(*in));
+}
+
+const char *input_skip_space(const char *p, const char *end) {
+	while (p < end && INPUT_IS_SPACE(*p))
+		p++;
+	return p;
+}
+
+/* Convert a token the fast path cannot handle exactly. */
+static const char *slow_parse_double(const char *p, const char *end,
+		double *value) {
+	char small[128], *token = small, *stop;
+	size_t len = 0;
+
+	while (p + len < end && !INPUT_IS_SPACE(p[len]))
+		len++;
+	if (len >= sizeof(small) && (token = malloc(len + 1)) == NULL)
+		return NULL;
+	memcpy(token, p, len);
+	token[len] = '\0';
+
+	*value = strtod(token, &stop);
+	len = stop - token;
+	if (token != small)
+		free(token);
+	return len == 0 ? NULL : p + len;
+}
+
+/*
+-- Parse a number at p, returning a pointer just past it (or NULL if p
+-- does not start with a number). The caller decides what may follow.
+*/
+const char *input_parse_double(const char *p, const char *end,
+		double *value) {
+	const char *start = p;
+	unsigned long long mantissa = 0;
+	int digits = 0, seen = 0, exp10 = 0, negative = 0;
+	double x;
+
+	if (p < end && (*p == '-' || *p == '+'))
+		negative = (*p++ == '-');
+
+	for (; p < end && IS_DIGIT(*p); p++, seen++) {
+		if (digits < MAX_DIGITS) {
+			mantissa = 10 * mantissa + (*p - '0');
+			digits += (mantissa != 0);
+		} else {
+			exp10++;
+			digits++;
+		}
+	}
+	if (p < end && *p == '.') {
+		for (p++; p < end && IS_DIGIT(*p); p++, seen++) {
+			if (digits < MAX_DIGITS) {
+				mantissa = 10 * mantissa + (*p - '0');
+				digits += (mantissa != 0);
+				exp10--;
+			} else {
+				digits++;
+			}
+		}
+	}
+	if (seen == 0)
+		return slow_parse_double(start, end, value);
+
+	if (p < end && (*p == 'e' || *p == 'E')) {
+		const char *q = p + 1;
+		int e = 0, eneg = 0;
+
+		if (q < end && (*q == '-' || *q == '+'))
+			eneg = (*q++ == '-');
+		if (q < end && IS_DIGIT(*q)) {
+			for (; q < end && IS_DIGIT(*q); q++) {
+				if (e < 100000)
+					e = 10 * e + (*q - '0');
+			}
+			exp10 += eneg ? -e : e;
+			p = q;
+		}
+	}
+
+	/* Hex floats and other oddities need the full strtod() syntax. */
+	if (p < end && (*p == '.' || *p == 'x' || *p == 'X' ||
+			*p == 'p' || *p == 'P'))
+		return slow_parse_double(start, end, value);
+
+	if (digits > MAX_DIGITS)
+		return slow_parse_double(start, end, value);
+
+	if (mantissa <= (1ULL << 53) && exp10 >= -MAX_EXACT && exp10 <= MAX_EXACT) {
+		x = (double)mantissa;
+		if (exp10 < 0)
+			x /= exact_pow10[-exp10];
+		else
+			x *= exact_pow10[exp10];
+	}
+#if LDBL_MANT_DIG == 64
+	else if (exp10 < -MAX_EXACT_LONG || exp10 > MAX_EXACT_LONG ||
+			!extended_scale(mantissa, exp10, &x))
+		return slow_parse_double(start, end, value);
+#else
+	else
+		return slow_parse_double(start, end, value);
+#endif /* LDBL_MANT_DIG */
+	*value = negative ? -x : x;
+	return p;
+}
+
+void input_bad_token(const char *p, const char *end) {
+	const char *q = p;
+
+	while (q < end && !INPUT_IS_SPACE(*q) && q - p < 40)
+		q++;
+	fprintf(stderr, "-- Error: '%.*s' is not a number.\n", (int)(q - p), p);
+	exit(1);
+}
+
+int input_parse_format(const char *spec, input_format *fmt) {
+	static const struct {
+		const char  *name;
+		input_type   type;
+	} types[] = {
+		{ "text", INPUT_TEXT }, { "f64", INPUT_F64 }, { "f32", INPUT_F32 },
+		{ "i32", INPUT_I32 },   { "i64", INPUT_I64 }, { "u64", INPUT_U64 }
+	};
+	const char *comma = strchr(spec, ',');
+	size_t len = comma ? (size_t)(comma - spec) : strlen(spec);
+	int i, big = 0;
+
+	for (i = 0; i < (int)(sizeof(types) / sizeof(types[0])); i++) {
+		if (strlen(types[i].name) == len && strncmp(spec, types[i].name, len) == 0)
+			break;
+	}
+	if (i == (int)(sizeof(types) / sizeof(types[0])))
+		return -1;
+	fmt->type = types[i].type;
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	big = 1;
+#endif
+	fmt->swap = 0;
+	fmt->compressed = fmt->type == INPUT_TEXT;
+	for (; comma != NULL; comma = strchr(comma + 1, ',')) {
+		len = strcspn(comma + 1, ",");
+		if (len == 2 && strncmp(comma + 1, "le", 2) == 0)
+			fmt->swap = big;
+		else if (len == 2 && strncmp(comma + 1, "be", 2) == 0)
+			fmt->swap = !big;
+		else if (len == 1 && comma[1] == 'z')
+			fmt->compressed = 1;
+		else
+			return -1;
+	}
+	return 0;
+}
+
+size_t input_record_size(const input_format *fmt) {
+	switch (fmt->type) {
+	 case INPUT_F32:
+	 case INPUT_I32:
+		return 4;
+	 case INPUT_F64:
+	 case INPUT_I64:
+	 case INPUT_U64:
+		return 8;
+	 default:
+		return 0;
+	}
+}
+
+/* Convert count binary records at src (of any alignment) to doubles. */
+void input_decode(const input_format *fmt, const char *src, size_t count,
+		double *dst) {
+	size_t i;
+
+	switch (fmt->type) {
+	 case INPUT_F64:
+	 case INPUT_I64:
+	 case INPUT_U64:
+		for (i = 0; i < count; i++, src += 8) {
+			unsigned long long bits;
+			memcpy(&bits, src, 8);
+			if (fmt->swap)
+				bits = __builtin_bswap64(bits);
+			if (fmt->type == INPUT_F64)
+				memcpy(&dst[i], &bits, 8);
+			else if (fmt->type == INPUT_I64)
+				dst[i] = (double)(long long)bits;
+			else
+				dst[i] = (double)bits;
+		}
+		break;
+
+	 case INPUT_F32:
+	 case INPUT_I32:
+		for (i = 0; i < count; i++, src += 4) {
+			unsigned int bits;
+			float f;
+			memcpy(&bits, src, 4);
+			if (fmt->swap)
+				bits = __builtin_bswap32(bits);
+			if (fmt->type == INPUT_F32) {
+				memcpy(&f, &bits, 4);
+				dst[i] = f;
+			} else {
+				dst[i] = (int)bits;
+			}
+		}
+		break;
+
+	 default:
+		break;
+	}
+}
+
+/*
+-- Convert count integer records at src to 64-bit integers without going
+-- through double; u64 records keep their bits (read dst as unsigned).
+*/
+void input_decode_int(const input_format *fmt, const char *src, size_t count,
+		long long *dst) {
+	size_t i;
+
+	if (fmt->type == INPUT_I32) {
+		for (i = 0; i < count; i++, src += 4) {
+			unsigned int bits;
+			memcpy(&bits, src, 4);
+			if (fmt->swap)
+				bits = __builtin_bswap32(bits);
+			dst[i] = (int)bits;
+		}
+		return;
+	}
+	for (i = 0; i < count; i++, src += 8) {
+		unsigned long long bits;
+		memcpy(&bits, src, 8);
+		if (fmt->swap)
+			bits = __builtin_bswap64(bits);
+		dst[i] = (long long)bits;
+	}
+}
@@ -0,0 +1,91 @@
+/*
+-- Input layer for statgen
+--
+-- Reads input in large blocks (or maps regular files into memory) and
+-- parses numbers in place, avoiding the per-value cost of fscanf().
+-- Compressed input is recognized and decompressed on the fly (zinput.h).
+*/
+
+#ifndef __INPUT_H
+#define __INPUT_H
+
+#include <stddef.h>
+#include <stdio.h>
+#include "zinput.h"
+
+#define INPUT_IS_SPACE(c)	((c) == ' ' || (c) == '\n' || (c) == '\t' || \
+                         	 (c) == '\r' || (c) == '\f' || (c) == '\v')
+
+/* Size of the blocks read from non-seekable inputs such as pipes. */
+#define INPUT_BLOCK_SIZE	(1 << 20)
+
+/* Encodings of the input accepted by --input-format. */
+typedef enum input_type {
+	INPUT_TEXT = 0,
+	INPUT_F64,
+	INPUT_F32,
+	INPUT_I32,
+	INPUT_I64,
+	INPUT_U64
+} input_type;
+
+typedef struct input_format {
+	input_type    type;
+	int           swap;      /* non-zero if byte order differs from ours */
+	int           compressed;  /* may be gzip or zstd: text, or ",z" */
+} input_format;
+
+typedef struct input_stream {
+	int           fd;
+	char         *map;       /* mapping of a regular file, or NULL */
+	size_t        maplen;
+	char         *buf;       /* block buffer when the input is not mapped */
+	size_t        bufsize;
+	size_t        consumed;  /* bytes of buf handed out by input_next() */
+	size_t        carry;     /* bytes of an incomplete token following them */
+	size_t        recsize;   /* binary record size, or 0 for text */
+	int           lines;     /* cut text regions at line ends */
+	int           eof;
+	zinput       *z;         /* decompressor, if the input is compressed */
+	char         *zmap;      /* mapping of a compressed regular file */
+	size_t        zmaplen;
+	int           borrowed;  /* map and zmap belong to the caller */
+	int           sniffed;   /* carry was read by input_open(), unseen */
+} input_stream;
+
+/*
+-- Public interface of the module:
+--
+--  input_next() hands out successive regions of the input which always
+--  end on a token boundary, so that no number is split between regions.
+--  The region remains valid until the next call. For binary input
+--  (input_set_record_size()), regions hold whole records instead, and
+--  in line mode (input_set_line_mode()) they hold whole lines.
+--  input_open_memory() reads input the caller already holds in memory.
+--  Either looks for gzip or zstd data only if detect is non-zero, since
+--  packed binary values may begin with the same bytes.
+*/
+extern int          input_open(input_stream *in, FILE *fp, int detect);
+extern int          input_open_memory(input_stream *in, const char *data,
+                                      size_t len, int detect);
+extern void         input_set_record_size(input_stream *in, size_t size);
+extern void         input_set_line_mode(input_stream *in);
+extern int          input_next(input_stream *in, const char **begin,
+                               const char **end);
+extern int          input_poll(input_stream *in, int timeout_ms);
+extern void         input_close(input_stream *in);
+
+extern const char  *input_skip_space(const char *p, const char *end);
+extern const char  *input_parse_double(const char *p, const char *end,
+                                       double *value);
+extern void         input_bad_token(const char *p, const char *end);
+
+extern int          input_parse_format(const char *spec, input_format *fmt);
+extern size_t       input_record_size(const input_format *fmt);
+extern void         input_decode(const input_format *fmt, const char *src,
+                                 size_t count, double *dst);
+extern void         input_decode_int(const input_format *fmt,
+                                     const char *src, size_t count,
+                                     long long *dst);
+
+#endif /* __INPUT_H */
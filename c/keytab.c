@@ -0,0 +1,136 @@
+/*
+-- Key table for statgen
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "keytab.h"
+
+#define INITIAL_SLOTS	1024
+
+static void *xrealloc(void *p, size_t size) {
+	if ((p = realloc(p, size)) == NULL) {
+		fputs("-- Error: out of memory growing key table.\n", stderr);
+		exit(1);
+	}
+	return p;
+}
+
+/* Multiply-rotate hash over 8 byte words, finished with murmur3's fmix64. */
+static uint32 hash_key(const char *key, size_t len) {
+	uint64 h = 0x9E3779B97F4A7C15ULL ^ len, w;
+
+	for (; len >= 8; key += 8, len -= 8) {
+		memcpy(&w, key, 8);
+		h = (h ^ w) * 0xBF58476D1CE4E5B9ULL;
+		h = (h << 31) | (h >> 33);
+	}
+	if (len > 0) {
+		w = 0;
+		memcpy(&w, key, len);
+		h = (h ^ w) * 0xBF58476D1CE4E5B9ULL;
+	}
+	h ^= h >> 33;
+	h *= 0xFF51AFD7ED558CCDULL;
+	h ^= h >> 33;
+	h *= 0xC4CEB9FE1A85EC53ULL;
+	h ^= h >> 33;
+	return (uint32)h;
+}
+
+/* Copy a key into the arena, NUL terminated. */
+static const char *arena_copy(keytab *tab, const char *key, size_t len) {
+	keytab_block *b = tab->arena;
+	char *p;
+
+	if (b == NULL || b->size - b->used < len + 1) {
+		size_t size = len + 1 > KEYTAB_ARENA_BLOCK ? len + 1 : KEYTAB_ARENA_BLOCK;
+		b = xrealloc(NULL, offsetof(keytab_block, data) + size);
+		b->next = tab->arena;
+		b->used = 0;
+		b->size = size;
+		tab->arena = b;
+	}
+	p = b->data + b->used;
+	memcpy(p, key, len);
+	p[len] = '\0';
+	b->used += len + 1;
+	return p;
+}
+
+static void grow_slots(keytab *tab) {
+	size_t i, j, mask;
+
+	free(tab->slots);
+	tab->nslots = tab->nslots ? 2 * tab->nslots : INITIAL_SLOTS;
+	tab->slots = calloc(tab->nslots, sizeof(keytab_slot));
+	if (tab->slots == NULL) {
+		fputs("-- Error: out of memory growing key table.\n", stderr);
+		exit(1);
+	}
+	mask = tab->nslots - 1;
+	for (i = 0; i < tab->count; i++) {
+		for (j = tab->keys[i].hash & mask; tab->slots[j].index; j = (j + 1) & mask)
+			;
+		tab->slots[j].hash = tab->keys[i].hash;
+		tab->slots[j].index = i + 1;
+	}
+}
+
+void keytab_init(keytab *tab) {
+	memset(tab, 0, sizeof(*tab));
+	grow_slots(tab);
+}
+
+size_t keytab_lookup(keytab *tab, const char *key, size_t len) {
+	uint32 hash = hash_key(key, len);
+	size_t mask = tab->nslots - 1, i;
+	keytab_key *k;
+
+	for (i = hash & mask; tab->slots[i].index; i = (i + 1) & mask) {
+		if (tab->slots[i].hash == hash) {
+			k = &tab->keys[tab->slots[i].index - 1];
+			if (k->len == len && memcmp(k->key, key, len) == 0)
+				return tab->slots[i].index - 1;
+		}
+	}
+
+	if (tab->count == tab->capacity) {
+		tab->capacity = tab->capacity ? 2 * tab->capacity : INITIAL_SLOTS / 2;
+		tab->keys = xrealloc(tab->keys, tab->capacity * sizeof(keytab_key));
+	}
+	k = &tab->keys[tab->count];
+	k->key = arena_copy(tab, key, len);
+	k->len = len;
+	k->hash = hash;
+	tab->slots[i].hash = hash;
+	tab->slots[i].index = ++tab->count;
+
+	/* Keep the load factor at or below one half. */
+	if (2 * tab->count > tab->nslots)
+		grow_slots(tab);
+	return tab->count - 1;
+}
+
+size_t keytab_count(const keytab *tab) {
+	return tab->count;
+}
+
+const char *keytab_key_at(const keytab *tab, size_t index, size_t *len) {
+	if (len != NULL)
+		*len = tab->keys[index].len;
+	return tab->keys[index].key;
+}
+
+void keytab_free(keytab *tab) {
+	keytab_block *b, *next;
+
+	for (b = tab->arena; b != NULL; b = next) {
+		next = b->next;
+		free(b);
+	}
+	free(tab->slots);
+	free(tab->keys);
+	memset(tab, 0, sizeof(*tab));
+}
@@ -0,0 +1,58 @@
+/*
+-- Key table for statgen
+--
+-- Maps key strings to dense indexes 0, 1, 2, ... in order of first
+-- appearance, so callers can keep per-key state in plain arrays. Uses
+-- open addressing with linear probing over (hash, index) pairs, and
+-- copies keys into a block arena rather than allocating them one by one.
+*/
+
+#ifndef __KEYTAB_H
+#define __KEYTAB_H
+
+#include <stddef.h>
+#include "stats.h"
+
+#define KEYTAB_ARENA_BLOCK	(1 << 20)
+
+typedef struct keytab_slot {
+	uint32        hash;
+	uint32        index;     /* entry index + 1, or 0 if the slot is empty */
+} keytab_slot;
+
+typedef struct keytab_key {
+	const char   *key;
+	uint32        len;
+	uint32        hash;
+} keytab_key;
+
+typedef struct keytab_block {
+	struct keytab_block *next;
+	size_t        used;
+	size_t        size;
+	char          data[1];
+} keytab_block;
+
+typedef struct keytab {
+	size_t        nslots;    /* always a power of two */
+	keytab_slot  *slots;
+	size_t        count;
+	size_t        capacity;
+	keytab_key   *keys;      /* count entries, in order of first appearance */
+	keytab_block *arena;
+} keytab;
+
+/*
+-- Public interface of the module:
+--
+--  keytab_lookup() returns the index of key, adding it if it is new;
+--  compare keytab_count() before and after to detect new keys.
+*/
+extern void         keytab_init(keytab *tab);
+extern size_t       keytab_lookup(keytab *tab, const char *key, size_t len);
+extern size_t       keytab_count(const keytab *tab);
+extern const char  *keytab_key_at(const keytab *tab, size_t index,
+                                  size_t *len);
+extern void         keytab_free(keytab *tab);
+
+#endif /* __KEYTAB_H */
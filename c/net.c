@@ -0,0 +1,168 @@
+/*
+-- Sockets for statgen
+*/
+
+#include <errno.h>
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "net.h"
+
+int net_is_address(const char *spec) {
+	return strncmp(spec, "unix:", 5) == 0 || strncmp(spec, "tcp:", 4) == 0;
+}
+
+int net_is_datagram(const char *spec) {
+	return strncmp(spec, "udp:", 4) == 0;
+}
+
+static void net_error(const char *what, const char *spec) {
+	fprintf(stderr, "-- Error: could not %s '%s': %s.\n", what, spec,
+			strerror(errno));
+	exit(1);
+}
+
+static int unix_socket(const char *spec, struct sockaddr_un *sun) {
+	int fd;
+
+	memset(sun, 0, sizeof(*sun));
+	sun->sun_family = AF_UNIX;
+	if (strlen(spec + 5) >= sizeof(sun->sun_path)) {
+		fprintf(stderr, "-- Error: socket path '%s' is too long.\n", spec + 5);
+		exit(1);
+	}
+	strcpy(sun->sun_path, spec + 5);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		net_error("create a socket for", spec);
+	return fd;
+}
+
+/* Resolve "tcp:[HOST:]PORT" or "udp:..."; the caller frees the result. */
+static struct addrinfo *inet_resolve(const char *spec, int passive,
+		int socktype) {
+	struct addrinfo hints, *res;
+	char host[256];
+	const char *port = strrchr(spec + 4, ':');
+	int err;
+
+	if (port == NULL) {
+		port = spec + 4;
+		host[0] = '\0';
+	} else if (port - (spec + 4) >= (long)sizeof(host)) {
+		fprintf(stderr, "-- Error: host name in '%s' is too long.\n", spec);
+		exit(1);
+	} else {
+		memcpy(host, spec + 4, port - (spec + 4));
+		host[port++ - (spec + 4)] = '\0';
+	}
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = socktype;
+	hints.ai_flags = passive ? AI_PASSIVE : 0;
+	if ((err = getaddrinfo(host[0] ? host : NULL, port, &hints, &res)) != 0) {
+		fprintf(stderr, "-- Error: could not resolve '%s': %s.\n", spec,
+				gai_strerror(err));
+		exit(1);
+	}
+	return res;
+}
+
+int net_listen(const char *spec) {
+	struct sockaddr_un sun;
+	struct addrinfo *res, *ai;
+	struct stat st;
+	int fd = -1, on = 1;
+
+	if (strncmp(spec, "unix:", 5) == 0) {
+		fd = unix_socket(spec, &sun);
+		/* Only a socket left by an earlier listener is replaced. */
+		if (lstat(sun.sun_path, &st) == 0) {
+			if (!S_ISSOCK(st.st_mode)) {
+				fprintf(stderr, "-- Error: '%s' exists and is not a socket.\n",
+						sun.sun_path);
+				exit(1);
+			}
+			unlink(sun.sun_path);
+		}
+		if (bind(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0)
+			net_error("bind", spec);
+	} else {
+		res = inet_resolve(spec, 1, SOCK_STREAM);
+		for (ai = res; ai != NULL; ai = ai->ai_next) {
+			if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0)
+				continue;
+			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+			if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+				break;
+			close(fd);
+			fd = -1;
+		}
+		freeaddrinfo(res);
+		if (fd < 0)
+			net_error("bind", spec);
+	}
+	if (listen(fd, SOMAXCONN) < 0)
+		net_error("listen on", spec);
+	return fd;
+}
+
+int net_bind(const char *spec) {
+	struct addrinfo *res, *ai;
+	int fd = -1;
+
+	res = inet_resolve(spec, 1, SOCK_DGRAM);
+	for (ai = res; ai != NULL; ai = ai->ai_next) {
+		if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0)
+			continue;
+		if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	if (fd < 0)
+		net_error("bind", spec);
+	return fd;
+}
+
+int net_accept(int fd) {
+	int conn;
+
+	do {
+		conn = accept(fd, NULL, NULL);
+	} while (conn < 0 && errno == EINTR);
+	if (conn < 0)
+		net_error("accept a connection on", "socket");
+	return conn;
+}
+
+int net_connect(const char *spec) {
+	struct sockaddr_un sun;
+	struct addrinfo *res, *ai;
+	int fd = -1;
+
+	if (strncmp(spec, "unix:", 5) == 0) {
+		fd = unix_socket(spec, &sun);
+		if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0)
+			net_error("connect to", spec);
+		return fd;
+	}
+	res = inet_resolve(spec, 0, SOCK_STREAM);
+	for (ai = res; ai != NULL; ai = ai->ai_next) {
+		if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0)
+			continue;
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(res);
+	if (fd < 0)
+		net_error("connect to", spec);
+	return fd;
+}
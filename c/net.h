@@ -0,0 +1,28 @@
+/*
+-- Sockets for statgen
+--
+-- Addresses are written "unix:PATH" for a UNIX domain socket or
+-- "tcp:[HOST:]PORT" for TCP. HOST defaults to every interface when
+-- listening and to the local host when connecting. "udp:[HOST:]PORT"
+-- names a UDP socket, which only statgen --serve receives on.
+*/
+
+#ifndef __NET_H
+#define __NET_H
+
+/*
+-- Public interface of the module:
+--
+--  net_is_address() tells stream socket addresses from file names, and
+--  net_is_datagram() tells UDP addresses. The other functions return
+--  file descriptors and exit with a message on failure; net_bind()
+--  binds a UDP socket, which any number of threads may receive on.
+*/
+extern int          net_is_address(const char *spec);
+extern int          net_is_datagram(const char *spec);
+extern int          net_listen(const char *spec);
+extern int          net_bind(const char *spec);
+extern int          net_accept(int fd);
+extern int          net_connect(const char *spec);
+
+#endif /* __NET_H */
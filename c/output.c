@@ -0,0 +1,347 @@
+/*
+-- Output formatting for statgen
+*/
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "output.h"
+
+typedef struct output_field {
+	const char   *heading;
+	int           kind;
+	int           width;
+	int           source;
+} output_field;
+
+static int          format = OUTPUT_TEXT;
+static int          decimals;
+static output_field fields[OUTPUT_MAX_FIELDS];
+static int          nfields;
+static char        *buf;
+static size_t       len;
+static int          outfd = STDOUT_FILENO;
+static output_sink  sink;       /* takes the output instead, if set */
+static void        *sinkArg;
+
+static const double scale[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9
+};
+
+/* Largest scaled value whose rounding is decided within a double. */
+#define MAX_SCALED		1099511627776.0		/* 2^40 */
+
+
+int output_format(const char *name) {
+	if (strcmp(name, "text") == 0)
+		return OUTPUT_TEXT;
+	if (strcmp(name, "tsv") == 0)
+		return OUTPUT_TSV;
+	if (strcmp(name, "json") == 0)
+		return OUTPUT_JSON;
+	if (strcmp(name, "binary") == 0)
+		return OUTPUT_BINARY;
+	return -1;
+}
+
+void output_init(int fmt, int places) {
+	format = fmt;
+	decimals = places;
+	nfields = 0;
+	if (buf == NULL) {
+		if ((buf = malloc(OUTPUT_BUFFER_SIZE)) == NULL) {
+			fputs("-- Error: out of memory allocating the output buffer.\n",
+					stderr);
+			exit(1);
+		}
+		atexit(output_flush);
+	}
+}
+
+void output_add_field(const char *heading, int kind, int width, int source) {
+	if (nfields == OUTPUT_MAX_FIELDS) {
+		fputs("-- Error: too many fields to display.\n", stderr);
+		exit(1);
+	}
+	fields[nfields].heading = heading;
+	fields[nfields].kind = kind;
+	fields[nfields].width = width;
+	fields[nfields].source = source;
+	nfields++;
+}
+
+int output_field_count(void) {
+	return nfields;
+}
+
+void output_flush(void) {
+	size_t done = 0;
+	ssize_t n;
+
+	if (sink != NULL) {
+		sink(sinkArg, buf, len);
+		len = 0;
+		return;
+	}
+	while (done < len) {
+		n = write(outfd, buf + done, len - done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && outfd != STDOUT_FILENO)
+			break;  /* the client went away */
+		if (n < 0) {
+			len = 0;  /* do not try again from atexit() */
+			perror("-- Error: write failed");
+			exit(1);
+		}
+		done += n;
+	}
+	len = 0;
+}
+
+/* Flush what is buffered for the old descriptor first. */
+void output_set_fd(int fd) {
+	output_flush();
+	outfd = fd;
+	sink = NULL;
+}
+
+void output_set_sink(output_sink fn, void *arg) {
+	output_flush();
+	sink = fn;
+	sinkArg = arg;
+}
+
+/* Room for n more bytes; no field needs more than a small fraction. */
+static char *reserve(size_t n) {
+	if (len + n > OUTPUT_BUFFER_SIZE)
+		output_flush();
+	return buf + len;
+}
+
+static void put(const char *s, size_t n) {
+	while (n > 0) {
+		size_t part = n < OUTPUT_BUFFER_SIZE / 2 ? n : OUTPUT_BUFFER_SIZE / 2;
+
+		memcpy(reserve(part), s, part);
+		len += part;
+		s += part;
+		n -= part;
+	}
+}
+
+static void put_char(char c) {
+	*reserve(1) = c;
+	len++;
+}
+
+/* Right align (or, if width < 0, left align) s after a blank. */
+static void put_padded(const char *s, size_t n, int width) {
+	int pad = (width < 0 ? -width : width) - (int)n;
+
+	put_char(' ');
+	if (width < 0)
+		put(s, n);
+	for (; pad > 0; pad--)
+		put_char(' ');
+	if (width >= 0)
+		put(s, n);
+}
+
+/* Digits of v before end, returning where they start. */
+static char *format_unsigned(char *end, uint64 v) {
+	do {
+		*--end = '0' + (int)(v % 10);
+		v /= 10;
+	} while (v > 0);
+	return end;
+}
+
+/*
+-- Format x as printf("%.*f") would. Values scaled by 10^decimals are
+-- rounded with integer arithmetic when the double decides the rounding;
+-- ties, huge values and NaN fall back to snprintf().
+*/
+static size_t format_fixed(char *out, size_t size, double x) {
+	double y, whole, frac;
+	uint64 r, unit;
+	char digits[32], *p, *end = digits + sizeof(digits);
+	size_t n = 0;
+	int i;
+
+	if (decimals >= (int)(sizeof(scale) / sizeof(scale[0])))
+		return snprintf(out, size, "%.*f", decimals, x);
+	y = fabs(x) * scale[decimals];
+	if (y < MAX_SCALED) {
+		whole = floor(y);
+		frac = y - whole;
+		if (fabs(frac - 0.5) > 1.0 / 512) {
+			r = (uint64)whole + (frac > 0.5);
+			unit = (uint64)scale[decimals];
+			if (signbit(x))
+				out[n++] = '-';
+			p = format_unsigned(end, r / unit);
+			memcpy(out + n, p, end - p);
+			n += end - p;
+			if (decimals > 0) {
+				out[n++] = '.';
+				r %= unit;
+				for (i = decimals - 1; i >= 0; i--, r /= 10)
+					out[n + i] = '0' + (int)(r % 10);
+				n += decimals;
+			}
+			return n;
+		}
+	}
+	return snprintf(out, size, "%.*f", decimals, x);
+}
+
+/* The shortest of %.15g, %.16g and %.17g that reads back as x. */
+static size_t format_shortest(char *out, size_t size, double x) {
+	int n = 0, precision;
+
+	for (precision = 15; precision <= 17; precision++) {
+		n = snprintf(out, size, "%.*g", precision, x);
+		if (strtod(out, NULL) == x)
+			break;
+	}
+	return n;
+}
+
+static void put_json_string(const char *s) {
+	char esc[8];
+
+	put_char('"');
+	for (; *s != '\0'; s++) {
+		if (*s == '"' || *s == '\\') {
+			put_char('\\');
+			put_char(*s);
+		} else if ((unsigned char)*s < 0x20) {
+			snprintf(esc, sizeof(esc), "\\u%04x", (unsigned char)*s);
+			put(esc, 6);
+		} else {
+			put_char(*s);
+		}
+	}
+	put_char('"');
+}
+
+static void put_le(uint64 v, int bytes) {
+	char *p = reserve(bytes);
+	int i;
+
+	for (i = 0; i < bytes; i++)
+		p[i] = (char)(v >> (8 * i));
+	len += bytes;
+}
+
+void output_headings(void) {
+	int i;
+
+	if (format == OUTPUT_JSON || format == OUTPUT_BINARY)
+		return;
+	for (i = 0; i < nfields; i++) {
+		if (format == OUTPUT_TEXT) {
+			put_padded(fields[i].heading, strlen(fields[i].heading),
+					fields[i].width);
+		} else {
+			if (i > 0)
+				put_char('\t');
+			put(fields[i].heading, strlen(fields[i].heading));
+		}
+	}
+	if (nfields > 0)
+		put_char('\n');
+}
+
+void output_break(void) {
+	if (format == OUTPUT_TEXT || format == OUTPUT_TSV)
+		put_char('\n');
+}
+
+static void put_binary(const output_field *f, const output_value *v) {
+	uint64 bits;
+	double x;
+
+	switch (f->kind) {
+	 case OUTPUT_LABEL:
+		put_le(strlen(v->text), 4);
+		put(v->text, strlen(v->text));
+		break;
+	 case OUTPUT_COUNT:
+		put_le(v->count, 8);
+		break;
+	 default:
+		x = v->text != NULL ? strtod(v->text, NULL) : v->number;
+		memcpy(&bits, &x, sizeof(bits));
+		put_le(bits, 8);
+		break;
+	}
+}
+
+void output_row(const output_value *values) {
+	char text[512], *p, *end = text + sizeof(text);
+	const output_value *v;
+	const output_field *f;
+	size_t n;
+	int i;
+
+	if (format == OUTPUT_JSON)
+		put_char('{');
+	for (i = 0; i < nfields; i++) {
+		f = &fields[i];
+		v = &values[f->source];
+		if (format == OUTPUT_BINARY) {
+			put_binary(f, v);
+			continue;
+		}
+
+		p = text;
+		if (f->kind == OUTPUT_LABEL) {
+			p = (char *)v->text;
+			n = strlen(p);
+		} else if (f->kind == OUTPUT_COUNT) {
+			p = format_unsigned(end, v->count);
+			n = end - p;
+		} else if (v->text != NULL) {
+			n = strlen(v->text);
+			memcpy(text, v->text, n);
+			if (format == OUTPUT_TEXT && decimals > 0) {
+				text[n++] = '.';
+				memset(text + n, '0', decimals);
+				n += decimals;
+			}
+		} else if (format == OUTPUT_TEXT) {
+			n = format_fixed(text, sizeof(text), v->number);
+		} else if (format == OUTPUT_JSON && !isfinite(v->number)) {
+			n = 4;
+			memcpy(text, "null", 4);
+		} else {
+			n = format_shortest(text, sizeof(text), v->number);
+		}
+
+		if (format == OUTPUT_TEXT) {
+			put_padded(p, n, f->width);
+		} else if (format == OUTPUT_TSV) {
+			if (i > 0)
+				put_char('\t');
+			put(p, n);
+		} else {
+			if (i > 0)
+				put_char(',');
+			put_json_string(f->heading);
+			put_char(':');
+			if (f->kind == OUTPUT_LABEL)
+				put_json_string(p);
+			else
+				put(p, n);
+		}
+	}
+	if (format == OUTPUT_JSON)
+		put_char('}');
+	if (format != OUTPUT_BINARY && nfields > 0)
+		put_char('\n');
+}
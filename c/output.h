@@ -0,0 +1,75 @@
+/*
+-- Output formatting for statgen
+--
+-- Rows are formatted into one large buffer that is written to standard
+-- output with a single write() when it fills, when output_flush() is
+-- called and at exit, rather than with a call to fprintf() per field.
+-- The fields of a row are declared once with output_add_field(), so a
+-- row is formatted by a loop over just the fields that are displayed.
+--
+-- Formats:
+--
+--   text    fixed-width columns with a fixed number of decimals
+--   tsv     a heading line, then tab-separated values, numbers in the
+--           shortest form that reads back as the same double
+--   json    one object per row, keyed by the headings; NaN and
+--           infinities are null
+--   binary  no headings; for each field of a row, in order, a label as
+--           uint32 length and its bytes, a count as uint64 and any other
+--           number as a double, all little endian
+*/
+
+#ifndef __OUTPUT_H
+#define __OUTPUT_H
+
+#include <stddef.h>
+#include "stats.h"
+
+#define OUTPUT_TEXT			0
+#define OUTPUT_TSV			1
+#define OUTPUT_JSON			2
+#define OUTPUT_BINARY		3
+
+#define OUTPUT_LABEL		0    /* kinds of field */
+#define OUTPUT_COUNT		1
+#define OUTPUT_NUMBER		2
+
+#define OUTPUT_MAX_FIELDS	48
+#define OUTPUT_BUFFER_SIZE	(1 << 20)
+
+/* The value of one field; text, if not NULL, holds an exact integer. */
+typedef struct output_value {
+	const char   *text;      /* a label, or the digits of a number */
+	uint64        count;
+	double        number;
+} output_value;
+
+/*
+-- Public interface of the module:
+--
+--  output_init() chooses the format and the decimals of text numbers;
+--  output_format() parses a format name, returning -1 if it is unknown.
+--  output_add_field() appends a field to a row: its heading, its kind,
+--  its width in text (negative to align left) and the index of its value
+--  in the array passed to output_row(). output_break() separates two
+--  tables in the text and tsv formats. output_set_fd() sends what is
+--  flushed from then on to another descriptor; a failed write to
+--  anything but standard output only drops the rows. output_set_sink()
+--  passes it to fn instead, such as to queue it for a client socket,
+--  until output_set_fd() is called again.
+*/
+typedef void (*output_sink)(void *arg, const char *p, size_t n);
+
+extern int          output_format(const char *name);
+extern void         output_init(int format, int decimals);
+extern void         output_add_field(const char *heading, int kind,
+                                     int width, int source);
+extern int          output_field_count(void);
+extern void         output_headings(void);
+extern void         output_break(void);
+extern void         output_row(const output_value *values);
+extern void         output_flush(void);
+extern void         output_set_fd(int fd);
+extern void         output_set_sink(output_sink fn, void *arg);
+
+#endif /* __OUTPUT_H */
@@ -0,0 +1,123 @@
+/*
+-- Stage timing for statgen (--profile)
+*/
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "profile.h"
+
+#define MAX_THREAD_LINES	16
+
+int profile_enabled;
+
+static const char *stageNames[PROFILE_STAGES] = {
+	"read", "parse", "accumulate", "merge", "output"
+};
+
+static uint64 started;
+static profile_counters *threads;    /* every thread that timed a stage */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread profile_counters *mine;
+
+
+static uint64 now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* The counters of the calling thread, registered on first use. */
+static profile_counters *counters(void) {
+	if (mine == NULL) {
+		if ((mine = calloc(1, sizeof(*mine))) == NULL) {
+			fputs("-- Error: out of memory allocating profile counters.\n",
+					stderr);
+			exit(1);
+		}
+		pthread_mutex_lock(&lock);
+		mine->next = threads;
+		threads = mine;
+		pthread_mutex_unlock(&lock);
+	}
+	return mine;
+}
+
+void profile_init(void) {
+	profile_enabled = 1;
+	started = now_ns();
+}
+
+void profile_begin(profile_mark *mark) {
+	profile_counters *c = counters();
+
+	mark->outer = c->inner;
+	c->inner = 0;
+	mark->start = now_ns();
+}
+
+void profile_end(int stage, profile_mark *mark) {
+	profile_counters *c = counters();
+	uint64 elapsed = now_ns() - mark->start;
+
+	c->ns[stage] += elapsed - c->inner;
+	c->inner = mark->outer + elapsed;
+}
+
+void profile_count(uint64 bytes, uint64 values) {
+	profile_counters *c = counters();
+
+	c->bytes += bytes;
+	c->values += values;
+}
+
+void profile_report(FILE *out) {
+	profile_counters total, *c;
+	double elapsed = (now_ns() - started) * 1e-9, busy = 0.0, s;
+	int i, n = 0;
+
+	pthread_mutex_lock(&lock);
+	memset(&total, 0, sizeof(total));
+	for (c = threads; c != NULL; c = c->next, n++) {
+		for (i = 0; i < PROFILE_STAGES; i++)
+			total.ns[i] += c->ns[i];
+		total.bytes += c->bytes;
+		total.values += c->values;
+	}
+	for (i = 0; i < PROFILE_STAGES; i++)
+		busy += total.ns[i] * 1e-9;
+
+	fprintf(out, "-- Profile: %.3f s elapsed, %d thread%s, %llu bytes "
+			"(%.1f MB/s), %llu values (%.3g/s)\n", elapsed, n, n == 1 ? "" : "s",
+			total.bytes, total.bytes / elapsed / 1e6, total.values,
+			total.values / elapsed);
+	fprintf(out, "--   %-12s %10s %7s %10s %12s\n", "stage", "seconds", "share",
+			"MB/s", "values/s");
+	for (i = 0; i < PROFILE_STAGES; i++) {
+		s = total.ns[i] * 1e-9;
+		fprintf(out, "--   %-12s %10.3f %6.1f%%", stageNames[i], s,
+				busy > 0.0 ? 100.0 * s / busy : 0.0);
+		if (i <= PROFILE_ACCUMULATE && s >= 0.001)
+			fprintf(out, " %10.1f %12.4g", total.bytes / s / 1e6,
+					total.values / s);
+		fputc('\n', out);
+	}
+
+	/* Threads in the order they started (the list is newest first). */
+	if (n > 1 && n <= MAX_THREAD_LINES) {
+		profile_counters *order[MAX_THREAD_LINES];
+		int t = n;
+
+		for (c = threads; c != NULL; c = c->next)
+			order[--t] = c;
+		for (t = 0; t < n; t++) {
+			fprintf(out, "--   thread %-5d", t);
+			for (i = 0; i < PROFILE_STAGES; i++)
+				fprintf(out, " %s %.3f", stageNames[i], order[t]->ns[i] * 1e-9);
+			fputc('\n', out);
+		}
+	}
+	pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,63 @@
+/*
+-- Stage timing for statgen (--profile)
+--
+-- The time of a run is divided among the stages below. Each thread adds
+-- its own time to counters of its own, so timing takes no locks and
+-- touches no shared cache lines. Stages nest: the time of a stage that
+-- runs inside another (accumulating inside parsing, say) is taken out of
+-- the outer one. Nothing is timed unless profile_enabled is set, and the
+-- PROFILE_ macros then cost a single predictable branch.
+*/
+
+#ifndef __PROFILE_H
+#define __PROFILE_H
+
+#include <stdio.h>
+#include "stats.h"
+
+#define PROFILE_READ			0
+#define PROFILE_PARSE			1
+#define PROFILE_ACCUMULATE	2
+#define PROFILE_MERGE			3
+#define PROFILE_OUTPUT		4
+#define PROFILE_STAGES		5
+
+typedef struct profile_counters {
+	uint64        ns[PROFILE_STAGES];
+	uint64        inner;     /* ns of the stages nested in the current one */
+	uint64        bytes;
+	uint64        values;
+	struct profile_counters *next;
+} profile_counters;
+
+/* Where a stage started, and what it was nested in. */
+typedef struct profile_mark {
+	uint64        start;
+	uint64        outer;
+} profile_mark;
+
+/*
+-- Public interface of the module:
+--
+--  profile_init() turns timing on and starts the clock of the run.
+--  profile_begin() and profile_end() bracket a stage in one thread;
+--  profile_count() adds to the bytes and values the run has processed.
+--  profile_report() prints the time, share and throughput of each
+--  stage, and of each thread if there were several.
+*/
+extern int          profile_enabled;
+
+extern void         profile_init(void);
+extern void         profile_begin(profile_mark *mark);
+extern void         profile_end(int stage, profile_mark *mark);
+extern void         profile_count(uint64 bytes, uint64 values);
+extern void         profile_report(FILE *out);
+
+#define PROFILE_BEGIN(mark) \
+	do { if (profile_enabled) profile_begin(&(mark)); } while (0)
+#define PROFILE_END(stage, mark) \
+	do { if (profile_enabled) profile_end(stage, &(mark)); } while (0)
+#define PROFILE_COUNT(bytes, values) \
+	do { if (profile_enabled) profile_count(bytes, values); } while (0)
+
+#endif /* __PROFILE_H */
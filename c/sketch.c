@@ -0,0 +1,942 @@
+/*
+-- Quantile sketch for statgen
+*/
+
+#include <float.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "sketch.h"
+
+#define SHIFT			(52 - SKETCH_SUB_BITS)
+#define MIN_BUCKETS		16
+#define FIRST_BITS		10		/* the first chunk of values holds 2^10 */
+#define FIRST_CHUNK		(1 << FIRST_BITS)
+#define MAX_CHUNKS		48
+#define RUN_BUFFER		4096	/* values read or written at once */
+#define PARALLEL_MIN	(1 << 20)	/* values held before selection is shared */
+#define MIN_SAMPLE		(1 << 16)
+
+#define MIN(x,y) ((x) < (y) ? (x) : (y))
+#define MAX(x,y) ((x) > (y) ? (x) : (y))
+
+
+/* Bytes of exact values in memory, for all sketches, and their limit. */
+static size_t limit;
+static size_t held_bytes;
+
+/* Threads that may share the selection of exact quantiles. */
+static int threads = 1;
+
+/* The runs of every exact sketch go to one unlinked temporary file. */
+static pthread_once_t spill_once = PTHREAD_ONCE_INIT;
+static int spill_fd = -1;
+static uint64 spill_end;
+
+
+static void *xrealloc(void *p, size_t size) {
+	if ((p = realloc(p, size)) == NULL) {
+		fputs("-- Error: out of memory growing quantile sketch.\n", stderr);
+		exit(1);
+	}
+	return p;
+}
+
+void sketch_set_limit(size_t bytes) {
+	limit = bytes;
+}
+
+void sketch_set_threads(int n) {
+	threads = MAX(n, 1);
+}
+
+static void spill_open(void) {
+	const char *dir = getenv("TMPDIR");
+	char path[4096];
+
+	snprintf(path, sizeof(path), "%s/statgen-XXXXXX",
+			dir != NULL && *dir ? dir : "/tmp");
+	if ((spill_fd = mkstemp(path)) < 0) {
+		fprintf(stderr, "-- Error: cannot create a spill file in %s.\n",
+				dir != NULL && *dir ? dir : "/tmp");
+		exit(1);
+	}
+	unlink(path);
+}
+
+static void spill_io(int writing, double *xs, size_t n, uint64 offset) {
+	char *p = (char *)xs;
+	size_t size = n * sizeof(double);
+	off_t at = (off_t)(offset * sizeof(double));
+	ssize_t done;
+
+	while (size > 0) {
+		done = writing ? pwrite(spill_fd, p, size, at) : pread(spill_fd, p, size, at);
+		if (done <= 0) {
+			fprintf(stderr, "-- Error: cannot %s the spill file.\n",
+					writing ? "write" : "read");
+			exit(1);
+		}
+		p += done;
+		at += done;
+		size -= done;
+	}
+}
+
+/* Chunk of the i-th value held, and its place there. */
+static int chunk_of(uint64 i, size_t *offset) {
+	uint64 j = i + FIRST_CHUNK;
+	int c = 63 - __builtin_clzll(j) - FIRST_BITS;
+
+	*offset = (size_t)(j - ((uint64)FIRST_CHUNK << c));
+	return c;
+}
+
+static size_t chunk_len(int c) {
+	return (size_t)FIRST_CHUNK << c;
+}
+
+static double *value_at(const sketch *sk, uint64 i) {
+	size_t offset;
+	int c = chunk_of(i, &offset);
+
+	return &sk->chunks[c][offset];
+}
+
+/* Values held in chunk c of a sketch holding held values. */
+static size_t chunk_used(uint64 held, int c) {
+	uint64 first = (uint64)FIRST_CHUNK * (((uint64)1 << c) - 1);
+
+	return held <= first ? 0 : (size_t)MIN(held - first, chunk_len(c));
+}
+
+static int compare_values(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+/*
+-- A sorted source of values for a k-way merge: a chunk in memory, or a
+-- run that is read from the spill file a buffer at a time.
+*/
+typedef struct run_cursor {
+	const double *next;
+	const double *end;
+	double       *buffer;
+	uint64        offset;    /* of what is still in the file */
+	uint64        left;
+} run_cursor;
+
+typedef struct run_merge {
+	run_cursor   *cursors;
+	size_t        ncursors;
+	run_cursor  **heap;      /* the cursors that are not done, least first */
+	size_t        n;
+} run_merge;
+
+static int cursor_fill(run_cursor *c) {
+	size_t n;
+
+	if (c->next < c->end)
+		return 1;
+	if (c->left == 0)
+		return 0;
+	n = (size_t)MIN(c->left, RUN_BUFFER);
+	spill_io(0, c->buffer, n, c->offset);
+	c->offset += n;
+	c->left -= n;
+	c->next = c->buffer;
+	c->end = c->buffer + n;
+	return 1;
+}
+
+static void heap_down(run_merge *m, size_t i) {
+	run_cursor *c = m->heap[i];
+	size_t child;
+
+	while ((child = 2 * i + 1) < m->n) {
+		if (child + 1 < m->n && *m->heap[child + 1]->next < *m->heap[child]->next)
+			child++;
+		if (!(*m->heap[child]->next < *c->next))
+			break;
+		m->heap[i] = m->heap[child];
+		i = child;
+	}
+	m->heap[i] = c;
+}
+
+/* Sort the chunks of sk and merge them, with its runs if runs is set. */
+static void merge_open(sketch *sk, int runs, run_merge *m) {
+	size_t i, n = 0, used;
+	int c;
+
+	m->cursors = xrealloc(NULL, (MAX_CHUNKS + sk->nruns) * sizeof(run_cursor));
+	m->heap = xrealloc(NULL, (MAX_CHUNKS + sk->nruns) * sizeof(run_cursor *));
+	for (c = 0; c < MAX_CHUNKS && (used = chunk_used(sk->held, c)) > 0; c++) {
+		qsort(sk->chunks[c], used, sizeof(double), compare_values);
+		m->cursors[n].next = sk->chunks[c];
+		m->cursors[n].end = sk->chunks[c] + used;
+		m->cursors[n].buffer = NULL;
+		m->cursors[n++].left = 0;
+	}
+	for (i = 0; runs && i < sk->nruns; i++) {
+		m->cursors[n].next = m->cursors[n].end = NULL;
+		m->cursors[n].buffer = xrealloc(NULL, RUN_BUFFER * sizeof(double));
+		m->cursors[n].offset = sk->runs[i].offset;
+		m->cursors[n++].left = sk->runs[i].count;
+	}
+	m->n = 0;
+	for (i = 0; i < n; i++) {
+		if (cursor_fill(&m->cursors[i]))
+			m->heap[m->n++] = &m->cursors[i];
+	}
+	for (i = m->n / 2; i-- > 0; )
+		heap_down(m, i);
+	m->ncursors = n;
+}
+
+static int merge_next(run_merge *m, double *x) {
+	run_cursor *c;
+
+	if (m->n == 0)
+		return 0;
+	c = m->heap[0];
+	*x = *c->next++;
+	if (!cursor_fill(c))
+		m->heap[0] = m->heap[--m->n];
+	if (m->n > 0)
+		heap_down(m, 0);
+	return 1;
+}
+
+static void merge_close(run_merge *m) {
+	size_t i;
+
+	for (i = 0; i < m->ncursors; i++)
+		free(m->cursors[i].buffer);
+	free(m->cursors);
+	free(m->heap);
+}
+
+/* Bucket of a positive, normal magnitude; monotone in its argument. */
+int32 sketch_index(double magnitude) {
+	uint64 bits;
+
+	memcpy(&bits, &magnitude, sizeof(bits));
+	return (int32)(bits >> SHIFT);
+}
+
+/* Midpoint of the values that fall into a bucket. */
+double sketch_bucket_value(int32 index) {
+	uint64 lo = (uint64)index << SHIFT, hi = (uint64)(index + 1) << SHIFT;
+	double a, b;
+
+	memcpy(&a, &lo, sizeof(a));
+	memcpy(&b, &hi, sizeof(b));
+	return isinf(b) ? a : a + (b - a) / 2;
+}
+
+/* Free the chunks of an exact sketch, keeping its runs. */
+static void exact_drop(sketch *sk) {
+	size_t bytes = 0;
+	int c;
+
+	for (c = 0; c < MAX_CHUNKS && chunk_used(sk->held, c) > 0; c++) {
+		free(sk->chunks[c]);
+		bytes += chunk_len(c) * sizeof(double);
+	}
+	__atomic_sub_fetch(&held_bytes, bytes, __ATOMIC_RELAXED);
+	sk->held = 0;
+}
+
+/* Write the values held as one sorted run, and free their chunks. */
+static void exact_spill(sketch *sk) {
+	double *buffer = xrealloc(NULL, RUN_BUFFER * sizeof(double));
+	uint64 offset;
+	run_merge m;
+	size_t n = 0;
+
+	pthread_once(&spill_once, spill_open);
+	offset = __atomic_fetch_add(&spill_end, sk->held, __ATOMIC_RELAXED);
+	sk->runs = xrealloc(sk->runs, (sk->nruns + 1) * sizeof(sketch_run));
+	sk->runs[sk->nruns].offset = offset;
+	sk->runs[sk->nruns++].count = sk->held;
+	merge_open(sk, 0, &m);
+	while (merge_next(&m, &buffer[n])) {
+		if (++n == RUN_BUFFER) {
+			spill_io(1, buffer, n, offset);
+			offset += n;
+			n = 0;
+		}
+	}
+	if (n > 0)
+		spill_io(1, buffer, n, offset);
+	merge_close(&m);
+	free(buffer);
+	exact_drop(sk);
+}
+
+/* Keep x, spilling first if a new chunk would go past the limit. */
+static void exact_store(sketch *sk, double x) {
+	size_t offset, bytes;
+	int c = chunk_of(sk->held, &offset);
+
+	if (offset == 0) {
+		bytes = chunk_len(c) * sizeof(double);
+		if (limit > 0 && sk->held > 0 &&
+				__atomic_load_n(&held_bytes, __ATOMIC_RELAXED) + bytes > limit) {
+			exact_spill(sk);
+			c = 0;
+			bytes = chunk_len(0) * sizeof(double);
+		}
+		if (sk->chunks == NULL) {
+			sk->chunks = xrealloc(NULL, MAX_CHUNKS * sizeof(double *));
+			memset(sk->chunks, 0, MAX_CHUNKS * sizeof(double *));
+		}
+		sk->chunks[c] = xrealloc(NULL, bytes);
+		__atomic_add_fetch(&held_bytes, bytes, __ATOMIC_RELAXED);
+	}
+	sk->chunks[c][offset] = x;
+	sk->held++;
+}
+
+static void exact_store_block(void *arg, const double *xs, size_t n) {
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		exact_store(arg, xs[i]);
+}
+
+/* Widen the store to cover idx, collapsing the lowest buckets if needed. */
+static void store_grow(sketch_store *s, int32 idx) {
+	int32 lo, hi, len, offset, i, j;
+	uint64 *counts;
+
+	if (s->counts == NULL) {
+		lo = idx;
+		hi = idx + 1;
+	} else {
+		lo = MIN(s->offset, idx);
+		hi = MAX(s->offset + s->len, idx + 1);
+	}
+	if (hi - lo > SKETCH_MAX_BUCKETS) {
+		lo = hi - SKETCH_MAX_BUCKETS;
+		s->floor = MAX(s->floor, lo);
+	}
+
+	/* Leave room to grow further in the same direction. */
+	len = MIN(MAX(2 * (hi - lo), MIN_BUCKETS), SKETCH_MAX_BUCKETS);
+	if (s->counts == NULL)
+		offset = idx - len / 2;
+	else if (idx < s->offset)
+		offset = hi - len;
+	else
+		offset = lo;
+	offset = MAX(offset, s->floor);
+
+	counts = xrealloc(NULL, len * sizeof(uint64));
+	memset(counts, 0, len * sizeof(uint64));
+	for (i = 0; i < s->len; i++) {
+		j = MAX(s->offset + i, s->floor) - offset;
+		counts[j] += s->counts[i];
+	}
+	free(s->counts);
+	s->counts = counts;
+	s->offset = offset;
+	s->len = len;
+}
+
+static void store_add(sketch_store *s, int32 idx, uint64 n) {
+	if (idx < s->floor)
+		idx = s->floor;
+	if (s->counts == NULL || idx < s->offset || idx >= s->offset + s->len) {
+		store_grow(s, idx);
+		if (idx < s->floor)
+			idx = s->floor;
+	}
+	s->counts[idx - s->offset] += n;
+}
+
+void sketch_init(sketch *sk, int exact) {
+	memset(sk, 0, sizeof(*sk));
+	sk->exact = exact;
+	sk->min = DBL_MAX;
+	sk->max = -DBL_MAX;
+}
+
+void sketch_add(sketch *sk, double x) {
+	if (x != x)
+		return;
+	sk->count++;
+	sk->min = MIN(sk->min, x);
+	sk->max = MAX(sk->max, x);
+	if (sk->exact) {
+		exact_store(sk, x);
+	} else if (x >= DBL_MIN) {
+		store_add(&sk->pos, sketch_index(x), 1);
+	} else if (x <= -DBL_MIN) {
+		store_add(&sk->neg, sketch_index(-x), 1);
+	} else {
+		sk->zero++;
+	}
+}
+
+/* Take back an approximate sketch_add(); min and max are left alone. */
+void sketch_remove(sketch *sk, double x) {
+	sketch_store *s = NULL;
+	int32 idx = 0;
+
+	if (x != x || sk->exact || sk->count == 0)
+		return;
+	if (x >= DBL_MIN)
+		s = &sk->pos, idx = sketch_index(x);
+	else if (x <= -DBL_MIN)
+		s = &sk->neg, idx = sketch_index(-x);
+	else if (sk->zero > 0)
+		sk->zero--;
+	if (s != NULL) {
+		idx = MAX(idx, s->floor);
+		if (idx >= s->offset && idx < s->offset + s->len && s->counts[idx - s->offset])
+			s->counts[idx - s->offset]--;
+	}
+	sk->count--;
+}
+
+void sketch_add_batch(sketch *sk, const double *xs, size_t n) {
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		sketch_add(sk, xs[i]);
+}
+
+void sketch_merge(sketch *dst, const sketch *src) {
+	int32 i;
+
+	if (src->count == 0)
+		return;
+	if (dst->exact) {
+		sketch_each(src, exact_store_block, dst);
+	} else {
+		for (i = 0; i < src->pos.len; i++) {
+			if (src->pos.counts[i])
+				store_add(&dst->pos, src->pos.offset + i, src->pos.counts[i]);
+		}
+		for (i = 0; i < src->neg.len; i++) {
+			if (src->neg.counts[i])
+				store_add(&dst->neg, src->neg.offset + i, src->neg.counts[i]);
+		}
+		dst->zero += src->zero;
+	}
+	dst->count += src->count;
+	dst->min = MIN(dst->min, src->min);
+	dst->max = MAX(dst->max, src->max);
+}
+
+#define V(i)	(*value_at(sk, (uint64)(i)))
+#define SWAP(a, b)	do { double *pa = value_at(sk, (uint64)(a)), \
+		*pb = value_at(sk, (uint64)(b)), t = *pa; *pa = *pb; *pb = t; } while (0)
+
+/* Pointer to the i-th value held, and the bounds of its chunk. */
+static double *span_of(const sketch *sk, long i, double **first, double **end) {
+	size_t offset;
+	int c = chunk_of((uint64)i, &offset);
+
+	*first = sk->chunks[c];
+	*end = sk->chunks[c] + chunk_len(c);
+	return *first + offset;
+}
+
+/* Step i up and j down along with pointers to their values. */
+#define UP()	do { i++; if (++pi == iend && i <= hi) \
+		pi = span_of(sk, i, &ifirst, &iend); } while (0)
+#define DOWN()	do { j--; if (pj == jfirst) { if (j >= lo) \
+		pj = span_of(sk, j, &jfirst, &jend); } else pj--; } while (0)
+
+/* Place the k-th smallest value held at k, smaller ones before it. */
+static void select_kth(sketch *sk, size_t from, size_t k) {
+	long lo = (long)from, hi = (long)sk->held - 1, kk = (long)k;
+	double *pi, *pj, *ifirst, *iend, *jfirst, *jend;
+
+	while (hi > lo) {
+		long i = lo, j = hi, mid = lo + (hi - lo) / 2;
+		double pivot, t;
+
+		/* Median of three as the pivot. */
+		if (V(mid) < V(lo))  SWAP(mid, lo);
+		if (V(hi) < V(lo))   SWAP(hi, lo);
+		if (V(hi) < V(mid))  SWAP(hi, mid);
+		pivot = V(mid);
+
+		/* The scans move through a chunk at a time. */
+		pi = span_of(sk, i, &ifirst, &iend);
+		pj = span_of(sk, j, &jfirst, &jend);
+		while (i <= j) {
+			while (*pi < pivot)
+				UP();
+			while (*pj > pivot)
+				DOWN();
+			if (i <= j) {
+				t = *pi; *pi = *pj; *pj = t;
+				UP();
+				DOWN();
+			}
+		}
+		if (kk <= j)
+			hi = j;
+		else if (kk >= i)
+			lo = i;
+		else
+			return;
+	}
+}
+
+#undef UP
+#undef DOWN
+
+static double exact_quantile(sketch *sk, double q, size_t *from) {
+	double pos = q * (sk->count - 1), x, next;
+	size_t k = (size_t)pos, i;
+
+	/* Everything left of *from is already known to be smaller. */
+	select_kth(sk, *from, k);
+	x = V(k);
+	*from = k;
+	if (pos == k || k + 1 >= sk->count)
+		return x;
+	for (next = V(k + 1), i = k + 2; i < sk->count; i++)
+		next = MIN(next, V(i));
+	return x + (pos - k) * (next - x);
+}
+
+#undef V
+#undef SWAP
+
+/* Once values are spilled, walk the merge of every run up to each rank. */
+static void merged_quantiles(sketch *sk, const double *qs, int n, double *out) {
+	double pos, x, prev = 0, cur = 0;
+	uint64 rank = 0, k;
+	run_merge m;
+	int i;
+
+	merge_open(sk, 1, &m);
+	merge_next(&m, &cur);
+	for (i = 0; i < n; i++) {
+		pos = qs[i] * (sk->count - 1);
+		k = (uint64)pos;
+		while (rank < k) {
+			prev = cur;
+			merge_next(&m, &cur);
+			rank++;
+		}
+		x = k + 1 == rank ? prev : cur;
+		if (pos == k || k + 1 >= sk->count) {
+			out[i] = x;
+			continue;
+		}
+		if (rank == k) {
+			prev = cur;
+			merge_next(&m, &cur);
+			rank++;
+		}
+		out[i] = x + (pos - k) * (cur - x);
+	}
+	merge_close(&m);
+}
+
+static double approx_quantile(const sketch *sk, double q) {
+	double rank = floor(q * (sk->count - 1)), seen = 0, x;
+	int32 i;
+
+	for (i = sk->neg.len - 1; i >= 0; i--) {
+		if ((seen += sk->neg.counts[i]) > rank)
+			return MAX(-sketch_bucket_value(sk->neg.offset + i), sk->min);
+	}
+	if ((seen += sk->zero) > rank)
+		return 0.0;
+	for (i = 0; i < sk->pos.len; i++) {
+		if ((seen += sk->pos.counts[i]) > rank) {
+			x = sketch_bucket_value(sk->pos.offset + i);
+			return MIN(MAX(x, sk->min), sk->max);
+		}
+	}
+	return sk->max;
+}
+
+/* Place the k-th smallest of xs[0..n) at xs[k], smaller ones before it. */
+static void select_array(double *xs, size_t n, size_t k) {
+	long lo = 0, hi = (long)n - 1, kk = (long)k;
+
+	while (hi > lo) {
+		long i = lo, j = hi, mid = lo + (hi - lo) / 2;
+		double pivot, t;
+
+		if (xs[mid] < xs[lo]) { t = xs[mid]; xs[mid] = xs[lo]; xs[lo] = t; }
+		if (xs[hi] < xs[lo])  { t = xs[hi];  xs[hi] = xs[lo];  xs[lo] = t; }
+		if (xs[hi] < xs[mid]) { t = xs[hi];  xs[hi] = xs[mid]; xs[mid] = t; }
+		pivot = xs[mid];
+
+		while (i <= j) {
+			while (xs[i] < pivot)
+				i++;
+			while (xs[j] > pivot)
+				j--;
+			if (i <= j) {
+				t = xs[i]; xs[i] = xs[j]; xs[j] = t;
+				i++;
+				j--;
+			}
+		}
+		if (kk <= j)
+			hi = j;
+		else if (kk >= i)
+			lo = i;
+		else
+			return;
+	}
+}
+
+/*
+-- Parallel selection, in the manner of sample sort. A sorted sample
+-- brackets each wanted rank with splitters [lo, hi] that hold it with
+-- near certainty; overlapping brackets are joined into groups. Each
+-- thread then scans a share of the values once, counting those below
+-- each group and copying those inside it. The ranks are selected among
+-- the few copies, or by the sequential sweep if a bracket missed.
+*/
+typedef struct select_group {
+	double        lo;
+	double        hi;
+	uint64        below;     /* values less than lo */
+	size_t        n;         /* values in [lo, hi], copied by the threads */
+	double       *values;
+	size_t        from;      /* values before it are known to be smaller */
+} select_group;
+
+typedef struct select_share {
+	const sketch *sk;
+	uint64        first;
+	uint64        last;
+	const select_group *groups;
+	int           ngroups;
+	uint64       *below;     /* per group, values between it and the last */
+	size_t       *n;
+	size_t       *capacity;
+	double      **values;
+} select_share;
+
+static void *select_scan(void *arg) {
+	select_share *sh = arg;
+	double *p, *first, *end, x;
+	uint64 i = sh->first;
+	int lo, hi, mid;
+	size_t n, j;
+
+	while (i < sh->last) {
+		p = span_of(sh->sk, (long)i, &first, &end);
+		n = (size_t)MIN((uint64)(end - p), sh->last - i);
+		for (j = 0; j < n; j++) {
+			x = p[j];
+			for (lo = 0, hi = sh->ngroups; lo < hi; ) {
+				mid = (lo + hi) / 2;
+				if (sh->groups[mid].hi < x)
+					lo = mid + 1;
+				else
+					hi = mid;
+			}
+			if (lo == sh->ngroups)
+				continue;
+			if (x < sh->groups[lo].lo) {
+				sh->below[lo]++;
+			} else {
+				if (sh->n[lo] == sh->capacity[lo]) {
+					sh->capacity[lo] = sh->capacity[lo] ? 2 * sh->capacity[lo] : 1024;
+					sh->values[lo] = xrealloc(sh->values[lo],
+							sh->capacity[lo] * sizeof(double));
+				}
+				sh->values[lo][sh->n[lo]++] = x;
+			}
+		}
+		i += n;
+	}
+	return NULL;
+}
+
+static double group_select(select_group *g, uint64 rank) {
+	size_t k = (size_t)(rank - g->below);
+
+	select_array(g->values + g->from, g->n - g->from, k - g->from);
+	g->from = k;
+	return g->values[k];
+}
+
+/* The ranks wanted, each quantile's and the next one to interpolate. */
+static int quantile_ranks(const sketch *sk, const double *qs, int n,
+		uint64 *ranks) {
+	double pos;
+	int i, m = 0;
+
+	for (i = 0; i < n; i++) {
+		pos = qs[i] * (sk->count - 1);
+		ranks[m++] = (uint64)pos;
+		if (pos != (uint64)pos && (uint64)pos + 1 < sk->count)
+			ranks[m++] = (uint64)pos + 1;
+	}
+	return m;
+}
+
+static int parallel_quantiles(sketch *sk, const double *qs, int n,
+		double *out) {
+	int nthreads = threads, nranks, ngroups = 0, i, t, g, ok = 1;
+	uint64 *ranks, seed = 0x9e3779b97f4a7c15ULL, below, sofar = 0;
+	size_t nsample, margin, r, lo, hi, j;
+	select_share *shares;
+	select_group *groups;
+	pthread_t *ids;
+	double *sample, *xs, pos, x, next;
+	int *group_of, *started;
+
+	/* Brackets from a sorted random sample, some 8 sigma wide. */
+	nsample = (size_t)MIN(sk->held, MAX(MIN_SAMPLE, sk->held >> 10));
+	margin = (size_t)(4 * sqrt((double)nsample)) + 8;
+	sample = xrealloc(NULL, nsample * sizeof(double));
+	for (j = 0; j < nsample; j++) {
+		seed ^= seed << 13;
+		seed ^= seed >> 7;
+		seed ^= seed << 17;
+		sample[j] = *value_at(sk, seed % sk->held);
+	}
+	qsort(sample, nsample, sizeof(double), compare_values);
+
+	ranks = xrealloc(NULL, 2 * n * sizeof(uint64));
+	group_of = xrealloc(NULL, 2 * n * sizeof(int));
+	groups = xrealloc(NULL, 2 * n * sizeof(select_group));
+	nranks = quantile_ranks(sk, qs, n, ranks);
+	for (i = 0; i < nranks; i++) {
+		r = (size_t)((double)ranks[i] / (sk->count - 1) * (nsample - 1));
+		lo = r > margin ? r - margin : 0;
+		hi = r + margin < nsample - 1 ? r + margin : nsample - 1;
+		if (ngroups > 0 && sample[lo] <= groups[ngroups - 1].hi) {
+			groups[ngroups - 1].hi = MAX(groups[ngroups - 1].hi, sample[hi]);
+		} else {
+			groups[ngroups].lo = sample[lo];
+			groups[ngroups++].hi = sample[hi];
+		}
+		if (lo == 0)
+			groups[ngroups - 1].lo = -DBL_MAX;
+		if (hi == nsample - 1)
+			groups[ngroups - 1].hi = DBL_MAX;
+		group_of[i] = ngroups - 1;
+	}
+	free(sample);
+
+	/* One scan of the values, shared out. */
+	shares = xrealloc(NULL, nthreads * sizeof(select_share));
+	ids = xrealloc(NULL, nthreads * sizeof(pthread_t));
+	started = xrealloc(NULL, nthreads * sizeof(int));
+	for (t = 0; t < nthreads; t++) {
+		shares[t].sk = sk;
+		shares[t].first = sk->held / nthreads * t;
+		shares[t].last = t + 1 < nthreads ? sk->held / nthreads * (t + 1) :
+			sk->held;
+		shares[t].groups = groups;
+		shares[t].ngroups = ngroups;
+		shares[t].below = xrealloc(NULL, ngroups * sizeof(uint64));
+		shares[t].n = xrealloc(NULL, ngroups * sizeof(size_t));
+		shares[t].capacity = xrealloc(NULL, ngroups * sizeof(size_t));
+		shares[t].values = xrealloc(NULL, ngroups * sizeof(double *));
+		memset(shares[t].below, 0, ngroups * sizeof(uint64));
+		memset(shares[t].n, 0, ngroups * sizeof(size_t));
+		memset(shares[t].capacity, 0, ngroups * sizeof(size_t));
+		memset(shares[t].values, 0, ngroups * sizeof(double *));
+		started[t] = t > 0 && pthread_create(&ids[t], NULL, select_scan,
+				&shares[t]) == 0;
+	}
+	for (t = 0; t < nthreads; t++) {
+		if (t > 0 && started[t])
+			pthread_join(ids[t], NULL);
+		else
+			select_scan(&shares[t]);
+	}
+
+	/* Gather each group's copies, and select within them. */
+	for (g = 0; g < ngroups; g++) {
+		below = sofar;
+		groups[g].n = 0;
+		for (t = 0; t < nthreads; t++) {
+			below += shares[t].below[g];
+			groups[g].n += shares[t].n[g];
+		}
+		groups[g].below = below;
+		groups[g].from = 0;
+		sofar = below + groups[g].n;
+		groups[g].values = xs = xrealloc(NULL,
+				MAX(groups[g].n, 1) * sizeof(double));
+		for (t = 0; t < nthreads; t++) {
+			memcpy(xs, shares[t].values[g], shares[t].n[g] * sizeof(double));
+			xs += shares[t].n[g];
+		}
+	}
+	for (i = 0; i < nranks && ok; i++) {
+		select_group *gr = &groups[group_of[i]];
+		ok = ranks[i] >= gr->below && ranks[i] - gr->below < gr->n;
+	}
+	for (i = 0, j = 0; i < n && ok; i++, j++) {
+		pos = qs[i] * (sk->count - 1);
+		out[i] = x = group_select(&groups[group_of[j]], ranks[j]);
+		if (pos != (uint64)pos && (uint64)pos + 1 < sk->count) {
+			j++;
+			next = group_select(&groups[group_of[j]], ranks[j]);
+			out[i] = x + (pos - (uint64)pos) * (next - x);
+		}
+	}
+
+	for (t = 0; t < nthreads; t++) {
+		for (g = 0; g < ngroups; g++)
+			free(shares[t].values[g]);
+		free(shares[t].below);
+		free(shares[t].n);
+		free(shares[t].capacity);
+		free(shares[t].values);
+	}
+	for (g = 0; g < ngroups; g++)
+		free(groups[g].values);
+	free(shares);
+	free(ids);
+	free(started);
+	free(groups);
+	free(group_of);
+	free(ranks);
+	return ok;
+}
+
+void sketch_quantiles(sketch *sk, const double *qs, int n, double *out) {
+	size_t from = 0;
+	int i;
+
+	if (sk->exact && sk->nruns > 0) {
+		merged_quantiles(sk, qs, n, out);
+		return;
+	}
+	if (sk->exact && threads > 1 && sk->held >= PARALLEL_MIN &&
+			parallel_quantiles(sk, qs, n, out))
+		return;
+	for (i = 0; i < n; i++) {
+		if (sk->count == 0)
+			out[i] = NAN;
+		else if (sk->exact)
+			out[i] = exact_quantile(sk, qs[i], &from);
+		else
+			out[i] = approx_quantile(sk, qs[i]);
+	}
+}
+
+/* Lowest value of a bucket (by index of its finest sub-bucket). */
+static double bucket_bound(int32 index) {
+	uint64 bits = (uint64)index << SHIFT;
+	double x;
+
+	memcpy(&x, &bits, sizeof(x));
+	return x;
+}
+
+/* Append the buckets of a store, coarsened by shift, to out[*n]. */
+static void store_histogram(const sketch_store *s, int shift, int negative,
+		sketch_bucket *out, size_t *n) {
+	int32 i, first, last, coarse;
+	size_t start = *n;
+	sketch_bucket *b;
+	double lo, hi;
+
+	for (first = 0; first < s->len && s->counts[first] == 0; first++)
+		;
+	for (last = s->len - 1; last >= first && s->counts[last] == 0; last--)
+		;
+	for (i = negative ? last : first; negative ? i >= first : i <= last;
+			i += negative ? -1 : 1) {
+		coarse = (s->offset + i) >> shift;
+		lo = bucket_bound(coarse << shift);
+		hi = bucket_bound((coarse + 1) << shift);
+		if (s->floor > 0 && coarse == s->floor >> shift)
+			lo = 0.0;  /* everything below was collapsed into it */
+		if (*n > start && out[*n - 1].low == (negative ? -hi : lo)) {
+			b = &out[*n - 1];
+		} else {
+			b = &out[(*n)++];
+			b->low = negative ? -hi : lo;
+			b->high = negative ? -lo : hi;
+			b->count = 0;
+		}
+		b->count += s->counts[i];
+	}
+}
+
+static void approx_add_block(void *arg, const double *xs, size_t n) {
+	sketch_add_batch(arg, xs, n);
+}
+
+/*
+-- Bucket counts with 2^sub_bits buckets per power of two (0 <= sub_bits
+-- <= SKETCH_SUB_BITS), in ascending order of value; zeros (and values
+-- too small to be normal) have a bucket of their own. Negative buckets
+-- mirror positive ones, so include their high bound and not their low.
+-- Empty buckets are left out. The caller frees *out.
+*/
+size_t sketch_histogram(const sketch *sk, int sub_bits, sketch_bucket **out) {
+	int shift = SKETCH_SUB_BITS - sub_bits;
+	size_t n = 0;
+	sketch approx;
+
+	if (sk->exact) {
+		sketch_init(&approx, 0);
+		sketch_each(sk, approx_add_block, &approx);
+		n = sketch_histogram(&approx, sub_bits, out);
+		sketch_free(&approx);
+		return n;
+	}
+	*out = xrealloc(NULL, (sk->neg.len + sk->pos.len + 1) *
+			sizeof(sketch_bucket));
+	store_histogram(&sk->neg, shift, 1, *out, &n);
+	if (sk->zero > 0) {
+		(*out)[n].low = (*out)[n].high = 0.0;
+		(*out)[n++].count = sk->zero;
+	}
+	store_histogram(&sk->pos, shift, 0, *out, &n);
+	return n;
+}
+
+void sketch_each(const sketch *sk,
+		void (*fn)(void *arg, const double *xs, size_t n), void *arg) {
+	double *buffer;
+	uint64 offset, left;
+	size_t i, n;
+	int c;
+
+	for (c = 0; c < MAX_CHUNKS && (n = chunk_used(sk->held, c)) > 0; c++)
+		fn(arg, sk->chunks[c], n);
+	if (sk->nruns == 0)
+		return;
+	buffer = xrealloc(NULL, RUN_BUFFER * sizeof(double));
+	for (i = 0; i < sk->nruns; i++) {
+		offset = sk->runs[i].offset;
+		for (left = sk->runs[i].count; left > 0; left -= n, offset += n) {
+			n = (size_t)MIN(left, RUN_BUFFER);
+			spill_io(0, buffer, n, offset);
+			fn(arg, buffer, n);
+		}
+	}
+	free(buffer);
+}
+
+/* The space of spilled runs in the file is not reused. */
+void sketch_free(sketch *sk) {
+	free(sk->pos.counts);
+	free(sk->neg.counts);
+	if (sk->exact)
+		exact_drop(sk);
+	free(sk->chunks);
+	free(sk->runs);
+	sketch_init(sk, sk->exact);
+}
@@ -0,0 +1,109 @@
+/*
+-- Quantile sketch for statgen
+--
+-- A mergeable, bounded-memory summary of a distribution. Values are
+-- counted in log-linear buckets (as in HDR histograms): the bucket index
+-- of a double is its exponent and the top SKETCH_SUB_BITS bits of its
+-- significand, read straight from the bit pattern, so every bucket is
+-- at most 2^-SKETCH_SUB_BITS wide relative to the values it holds.
+-- Only the range of buckets in use is stored, and once it exceeds
+-- SKETCH_MAX_BUCKETS the lowest buckets are collapsed, trading accuracy
+-- of the smallest magnitudes for a hard memory bound.
+--
+-- An exact sketch instead keeps every value and answers by selection.
+-- The values are held in chunks that double in size and are never
+-- moved. Past the memory limit set by sketch_set_limit(), shared by all
+-- exact sketches, a sketch sorts its chunks and spills them as one run
+-- to a temporary file; quantiles then come from a k-way merge of the
+-- runs and whatever is still in memory. Otherwise, with the threads
+-- of sketch_set_threads(), the values of a large sketch are bracketed
+-- by splitters from a sample and selected in one parallel sweep.
+*/
+
+#ifndef __SKETCH_H
+#define __SKETCH_H
+
+#include <stddef.h>
+#include "stats.h"
+
+#define SKETCH_SUB_BITS		7		/* relative error below 0.4% */
+#define SKETCH_MAX_BUCKETS	4096	/* per sign, 32 KiB of counts at most */
+
+#define SKETCH_NONE			0
+#define SKETCH_APPROX		1
+#define SKETCH_EXACT		2
+
+typedef struct sketch_store {
+	int32         offset;    /* bucket index of counts[0] */
+	int32         len;
+	int32         floor;     /* lower indexes are collapsed into this one */
+	uint64       *counts;
+} sketch_store;
+
+/* Sorted values spilled by an exact sketch, as a range of the file. */
+typedef struct sketch_run {
+	uint64        offset;    /* in values */
+	uint64        count;
+} sketch_run;
+
+typedef struct sketch {
+	int           exact;
+	uint64        count;
+	double        min;
+	double        max;
+
+	/* Approximate sketches: magnitudes of positive and negative values. */
+	sketch_store  pos;
+	sketch_store  neg;
+	uint64        zero;
+
+	/* Exact sketches: chunk c holds up to 2^c times as many as the first. */
+	double      **chunks;
+	uint64        held;      /* values in chunks, the rest are in runs */
+	sketch_run   *runs;
+	size_t        nruns;
+} sketch;
+
+/*
+-- A bucket of sketch_histogram(), holding values in [low, high), or in
+-- (low, high] below zero: buckets are of magnitudes, so -2 shares the
+-- bucket of -3 rather than that of -1.
+*/
+typedef struct sketch_bucket {
+	double        low;
+	double        high;
+	uint64        count;
+} sketch_bucket;
+
+/*
+-- Public interface of the module:
+--
+--  sketch_quantiles() answers several quantiles (0 <= q <= 1, in
+--  ascending order) at once, which lets exact sketches share one
+--  partitioning sweep. NaNs are ignored. sketch_histogram() counts the
+--  values in coarser buckets of the same kind, for display.
+--  sketch_each() passes the values of an exact sketch to fn in blocks,
+--  in no particular order. sketch_set_limit() bounds the bytes that all
+--  exact sketches together hold in memory (0, the default, for none).
+*/
+extern void         sketch_init(sketch *sk, int exact);
+extern void         sketch_add(sketch *sk, double x);
+extern void         sketch_remove(sketch *sk, double x);
+extern void         sketch_add_batch(sketch *sk, const double *xs, size_t n);
+extern void         sketch_merge(sketch *dst, const sketch *src);
+extern void         sketch_quantiles(sketch *sk, const double *qs, int n,
+                                     double *out);
+extern size_t       sketch_histogram(const sketch *sk, int sub_bits,
+                                     sketch_bucket **out);
+extern void         sketch_each(const sketch *sk,
+                                void (*fn)(void *arg, const double *xs,
+                                           size_t n),
+                                void *arg);
+extern void         sketch_free(sketch *sk);
+extern void         sketch_set_limit(size_t bytes);
+extern void         sketch_set_threads(int n);
+
+extern int32        sketch_index(double magnitude);
+extern double       sketch_bucket_value(int32 index);
+
+#endif /* __SKETCH_H */
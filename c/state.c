@@ -0,0 +1,508 @@
+/*
+-- Saved state for statgen
+*/
+
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define  INLINE  /* open-code stats routines */
+#include "stats.h"
+#include "state.h"
+
+#define MAX_LABEL		(1 << 20)
+#define STATE_WHY_SIZE	128   /* of the reason a state cannot be read */
+
+static const char magic[8] = { 'S', 'T', 'G', 'S', 'T', 'A', 'T', 'E' };
+
+
+static void *xrealloc(void *p, size_t size) {
+	if ((p = realloc(p, size)) == NULL) {
+		fputs("-- Error: out of memory reading saved state.\n", stderr);
+		exit(1);
+	}
+	return p;
+}
+
+void state_init(state_set *set, int kind, int quantiles) {
+	memset(set, 0, sizeof(*set));
+	set->kind = kind;
+	set->quantiles = quantiles;
+	keytab_init(&set->labels);
+}
+
+static state_record *record_for(state_set *set, const char *label,
+		size_t len) {
+	size_t n = keytab_count(&set->labels), i;
+	state_record *rec;
+
+	i = keytab_lookup(&set->labels, label, len);
+	if (i == n) {
+		if (n == set->capacity) {
+			set->capacity = set->capacity ? 2 * set->capacity : 16;
+			set->records = xrealloc(set->records,
+					set->capacity * sizeof(state_record));
+		}
+		rec = &set->records[i];
+		stats_init(&rec->stats);
+		sketch_init(&rec->sketch, set->quantiles == SKETCH_EXACT);
+	}
+	return &set->records[i];
+}
+
+void state_merge_record(state_set *set, const char *label,
+		const stats_data *stats, const sketch *sk) {
+	state_record *rec = record_for(set, label, strlen(label));
+
+	stats_merge(&rec->stats, stats);
+	if (sk != NULL && set->quantiles != SKETCH_NONE)
+		sketch_merge(&rec->sketch, sk);
+}
+
+static const char *kind_name(int kind) {
+	return kind == STATE_SINGLE ? "a single stream" :
+		kind == STATE_COLUMNS ? "columns" : "groups";
+}
+
+/*
+-- Check that a state of the given layout can be merged into set, or
+-- say why not in why[]. States with different kinds of percentiles, or
+-- none, merge into a set without them, whatever order they come in.
+*/
+static int check_layout(state_set *set, int kind, int quantiles, char *why,
+		size_t size) {
+	size_t i, n = state_count(set);
+
+	if (set->kind == STATE_EMPTY && n == 0) {
+		set->kind = kind;
+		set->quantiles = quantiles;
+	}
+	if (set->kind != kind) {
+		snprintf(why, size, "holds %s, not %s", kind_name(kind),
+				kind_name(set->kind));
+		return -1;
+	}
+	if (set->quantiles != SKETCH_NONE && set->quantiles != quantiles) {
+		for (i = 0; i < n; i++) {
+			sketch_free(&set->records[i].sketch);
+			sketch_init(&set->records[i].sketch, 0);
+		}
+		set->quantiles = SKETCH_NONE;
+	}
+	return 0;
+}
+
+void state_merge(state_set *dst, const state_set *src) {
+	size_t i, n = keytab_count(&src->labels);
+	char why[STATE_WHY_SIZE];
+
+	if (src->kind == STATE_EMPTY)
+		return;
+	if (check_layout(dst, src->kind, src->quantiles, why, sizeof(why)) != 0) {
+		fprintf(stderr, "-- Error: state %s.\n", why);
+		exit(1);
+	}
+	for (i = 0; i < n; i++)
+		state_merge_record(dst, keytab_key_at(&src->labels, i, NULL),
+				&src->records[i].stats, &src->records[i].sketch);
+}
+
+size_t state_count(const state_set *set) {
+	return keytab_count(&set->labels);
+}
+
+const char *state_label_at(const state_set *set, size_t index) {
+	return keytab_key_at(&set->labels, index, NULL);
+}
+
+/* Little endian encoding, one field at a time. */
+
+typedef struct state_file {
+	FILE         *fp;
+	const char   *name;
+	int           damaged;   /* once set, what is read is zero */
+} state_file;
+
+static void corrupt(state_file *f) {
+	f->damaged = 1;
+}
+
+static void put_u32(state_file *f, uint32 v) {
+	unsigned char b[4];
+	int i;
+
+	for (i = 0; i < 4; i++)
+		b[i] = (unsigned char)(v >> (8 * i));
+	fwrite(b, 1, 4, f->fp);
+}
+
+static void put_u64(state_file *f, uint64 v) {
+	unsigned char b[8];
+	int i;
+
+	for (i = 0; i < 8; i++)
+		b[i] = (unsigned char)(v >> (8 * i));
+	fwrite(b, 1, 8, f->fp);
+}
+
+static void put_f64(state_file *f, double x) {
+	uint64 v;
+
+	memcpy(&v, &x, sizeof(v));
+	put_u64(f, v);
+}
+
+static uint32 get_u32(state_file *f) {
+	unsigned char b[4];
+	uint32 v = 0;
+	int i;
+
+	if (f->damaged || fread(b, 1, 4, f->fp) != 4) {
+		corrupt(f);
+		return 0;
+	}
+	for (i = 3; i >= 0; i--)
+		v = (v << 8) | b[i];
+	return v;
+}
+
+static uint64 get_u64(state_file *f) {
+	unsigned char b[8];
+	uint64 v = 0;
+	int i;
+
+	if (f->damaged || fread(b, 1, 8, f->fp) != 8) {
+		corrupt(f);
+		return 0;
+	}
+	for (i = 7; i >= 0; i--)
+		v = (v << 8) | b[i];
+	return v;
+}
+
+static double get_f64(state_file *f) {
+	uint64 v = get_u64(f);
+	double x;
+
+	memcpy(&x, &v, sizeof(x));
+	return x;
+}
+
+/* Write only the span of a store that holds counts. */
+static void put_store(state_file *f, const sketch_store *s) {
+	int32 lo = 0, hi = s->len;
+
+	while (lo < hi && s->counts[lo] == 0)
+		lo++;
+	while (hi > lo && s->counts[hi - 1] == 0)
+		hi--;
+	put_u32(f, (uint32)(s->offset + lo));
+	put_u32(f, (uint32)s->floor);
+	put_u32(f, (uint32)(hi - lo));
+	for (; lo < hi; lo++)
+		put_u64(f, s->counts[lo]);
+}
+
+/*
+-- The bucket indexes of a store must be ones sketch_index() gives, from
+-- 0 to that of infinity, so that merging it cannot overflow; the offset
+-- of an empty store is not used.
+*/
+static uint64 get_store(state_file *f, sketch_store *s) {
+	int32 top = sketch_index(HUGE_VAL) + 1;
+	uint64 total = 0;
+	int32 i;
+
+	s->offset = (int32)get_u32(f);
+	s->floor = (int32)get_u32(f);
+	s->len = (int32)get_u32(f);
+	if (s->len < 0 || s->len > SKETCH_MAX_BUCKETS || s->floor < 0 ||
+			s->floor >= top || (s->len > 0 && (s->offset < 0 ||
+			s->offset > top - s->len))) {
+		corrupt(f);
+		s->offset = s->floor = s->len = 0;
+	}
+	s->counts = s->len ? xrealloc(NULL, s->len * sizeof(uint64)) : NULL;
+	for (i = 0; i < s->len; i++)
+		total += (s->counts[i] = get_u64(f));
+	return total;
+}
+
+static void put_values(void *arg, const double *xs, size_t n) {
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		put_f64(arg, xs[i]);
+}
+
+static void put_sketch(state_file *f, const sketch *sk) {
+	put_u64(f, sk->count);
+	put_f64(f, sk->min);
+	put_f64(f, sk->max);
+	if (sk->exact) {
+		sketch_each(sk, put_values, f);
+	} else {
+		put_u64(f, sk->zero);
+		put_store(f, &sk->pos);
+		put_store(f, &sk->neg);
+	}
+}
+
+static void get_sketch(state_file *f, sketch *sk, int exact) {
+	uint64 i, total;
+	double min, max;
+
+	sketch_init(sk, exact);
+	total = get_u64(f);
+	min = get_f64(f);
+	max = get_f64(f);
+	if (exact) {
+		for (i = 0; i < total && !f->damaged; i++)
+			sketch_add(sk, get_f64(f));
+	} else {
+		sk->count = sk->zero = get_u64(f);
+		sk->count += get_store(f, &sk->pos);
+		sk->count += get_store(f, &sk->neg);
+	}
+	if (sk->count != total)
+		corrupt(f);
+	sk->min = min;
+	sk->max = max;
+}
+
+/*
+-- Read the next state of f into set: 1 if one was read, 0 at the end of
+-- the stream, or -1 with the reason in why[] if it could not be.
+*/
+static int read_state(state_set *set, state_file *f, char *why, size_t size) {
+	char head[sizeof(magic)], *label = NULL;
+	uint32 kind, quantiles, len;
+	uint64 n;
+	stats_data stats;
+	sketch sk;
+	size_t got;
+
+	if ((got = fread(head, 1, sizeof(head), f->fp)) == 0 && feof(f->fp))
+		return 0;
+	if (got != sizeof(head) || memcmp(head, magic, sizeof(magic)) != 0) {
+		snprintf(why, size, "is not a statgen state");
+		return -1;
+	}
+	if (get_u32(f) != STATE_VERSION) {
+		snprintf(why, size, "has an unknown version");
+		return -1;
+	}
+	kind = get_u32(f);
+	quantiles = get_u32(f);
+	(void)get_u32(f);
+	if (kind < STATE_SINGLE || kind > STATE_GROUPS || quantiles > SKETCH_EXACT)
+		corrupt(f);
+	else if (check_layout(set, kind, quantiles, why, size) != 0)
+		return -1;
+
+	for (n = get_u64(f); n > 0 && !f->damaged; n--) {
+		len = get_u32(f);
+		if (len >= MAX_LABEL)
+			corrupt(f);
+		if (f->damaged)
+			break;
+		label = xrealloc(label, len + 1);
+		if (fread(label, 1, len, f->fp) != len)
+			corrupt(f);
+		label[len] = '\0';
+
+		stats_init(&stats);
+		stats.count = get_u64(f);
+		stats.min = get_f64(f);
+		stats.max = get_f64(f);
+		stats.mean = get_f64(f);
+		stats.variance = get_f64(f);
+
+		if (quantiles != SKETCH_NONE) {
+			get_sketch(f, &sk, quantiles == SKETCH_EXACT);
+			if (!f->damaged)
+				state_merge_record(set, label, &stats, &sk);
+			sketch_free(&sk);
+		} else if (!f->damaged) {
+			state_merge_record(set, label, &stats, NULL);
+		}
+	}
+	free(label);
+	if (f->damaged) {
+		snprintf(why, size, "is truncated or damaged");
+		return -1;
+	}
+	return 1;
+}
+
+int state_read(state_set *set, FILE *in, const char *name) {
+	state_file f = { in, name, 0 };
+	char why[STATE_WHY_SIZE];
+	int r;
+
+	if ((r = read_state(set, &f, why, sizeof(why))) < 0) {
+		fprintf(stderr, "-- Error: state file '%s' %s.\n", name, why);
+		exit(1);
+	}
+	return r;
+}
+
+int state_try_read(state_set *set, FILE *in, const char *name) {
+	state_file f = { in, name, 0 };
+	char why[STATE_WHY_SIZE];
+	int r;
+
+	if ((r = read_state(set, &f, why, sizeof(why))) < 0)
+		fprintf(stderr, "-- Warning: dropped a state from '%s', which %s.\n",
+				name, why);
+	return r;
+}
+
+void state_load(state_set *set, const char *path) {
+	FILE *in;
+
+	if (strcmp(path, "-") == 0) {
+		while (state_read(set, stdin, "stdin"))
+			;
+		return;
+	}
+	if ((in = fopen(path, "rb")) == NULL) {
+		fprintf(stderr, "-- Error: could not open state file '%s' for "
+				"reading.\n", path);
+		exit(1);
+	}
+	while (state_read(set, in, path))
+		;
+	fclose(in);
+}
+
+void state_write(const state_set *set, FILE *out, const char *name) {
+	state_file f = { out, name, 0 };
+	size_t i, n = state_count(set), len;
+	const char *label;
+	const state_record *rec;
+
+	fwrite(magic, 1, sizeof(magic), out);
+	put_u32(&f, STATE_VERSION);
+	put_u32(&f, (uint32)set->kind);
+	put_u32(&f, (uint32)set->quantiles);
+	put_u32(&f, 0);
+	put_u64(&f, n);
+	for (i = 0; i < n; i++) {
+		rec = &set->records[i];
+		label = keytab_key_at(&set->labels, i, &len);
+		put_u32(&f, (uint32)len);
+		fwrite(label, 1, len, out);
+		put_u64(&f, rec->stats.count);
+		put_f64(&f, rec->stats.min);
+		put_f64(&f, rec->stats.max);
+		put_f64(&f, rec->stats.mean);
+		put_f64(&f, rec->stats.variance);
+		if (set->quantiles != SKETCH_NONE)
+			put_sketch(&f, &rec->sketch);
+	}
+	if (fflush(out) != 0 || ferror(out)) {
+		fprintf(stderr, "-- Error: could not write state file '%s'.\n", name);
+		exit(1);
+	}
+}
+
+/* Make a rename in the directory of path survive a system crash. */
+static void sync_directory(const char *path) {
+	const char *slash = strrchr(path, '/');
+	char *dir;
+	int fd;
+
+	if (slash == NULL) {
+		dir = xrealloc(NULL, 2);
+		strcpy(dir, ".");
+	} else {
+		dir = xrealloc(NULL, slash - path + 2);
+		memcpy(dir, path, slash - path + 1);  /* keeps "/" for the root */
+		dir[slash - path + 1] = '\0';
+	}
+	if ((fd = open(dir, O_RDONLY)) >= 0) {
+		fsync(fd);
+		close(fd);
+	}
+	free(dir);
+}
+
+/* The state reaches the disk before it replaces the previous one. */
+void state_save(const state_set *set, const char *path) {
+	char *tmp;
+	FILE *out;
+
+	if (strcmp(path, "-") == 0) {
+		state_write(set, stdout, "stdout");
+		return;
+	}
+	tmp = xrealloc(NULL, strlen(path) + 5);
+	sprintf(tmp, "%s.tmp", path);
+	if ((out = fopen(tmp, "wb")) == NULL) {
+		fprintf(stderr, "-- Error: could not open state file '%s' for "
+				"writing.\n", tmp);
+		exit(1);
+	}
+	state_write(set, out, tmp);
+	if (fflush(out) != 0 || fsync(fileno(out)) != 0 || fclose(out) != 0 ||
+			rename(tmp, path) != 0) {
+		fprintf(stderr, "-- Error: could not write state file '%s'.\n", path);
+		exit(1);
+	}
+	sync_directory(path);
+	free(tmp);
+}
+
+void state_free(state_set *set) {
+	size_t i, n = state_count(set);
+
+	for (i = 0; i < n; i++)
+		sketch_free(&set->records[i].sketch);
+	free(set->records);
+	keytab_free(&set->labels);
+	memset(set, 0, sizeof(*set));
+}
+
+void state_tree_init(state_tree *tree) {
+	memset(tree, 0, sizeof(*tree));
+}
+
+/* Earlier states are always the destination, which keeps labels in order. */
+void state_tree_add(state_tree *tree, state_set *set) {
+	state_set carry = *set;
+	int i;
+
+	for (i = 0; tree->used[i]; i++) {
+		state_merge(&tree->level[i], &carry);
+		state_free(&carry);
+		carry = tree->level[i];
+		tree->used[i] = 0;
+	}
+	tree->level[i] = carry;
+	tree->used[i] = 1;
+	tree->count++;
+	memset(set, 0, sizeof(*set));
+}
+
+void state_tree_finish(state_tree *tree, state_set *out) {
+	int i, top;
+
+	state_init(out, STATE_EMPTY, SKETCH_NONE);
+	for (top = STATE_TREE_LEVELS - 1; top >= 0 && !tree->used[top]; top--)
+		;
+	if (top < 0)
+		return;
+	state_free(out);
+	*out = tree->level[top];
+	for (i = top - 1; i >= 0; i--) {
+		if (tree->used[i]) {
+			state_merge(out, &tree->level[i]);
+			state_free(&tree->level[i]);
+		}
+	}
+	state_tree_init(tree);
+}
@@ -0,0 +1,102 @@
+/*
+-- Saved state for statgen
+--
+-- A state is a list of labelled summaries (stats_data plus an optional
+-- quantile sketch) in one of the layouts statgen accumulates: a single
+-- stream, columns or groups. States can be written to a file and read
+-- back later, and reading merges records with the same label, so a run
+-- can be resumed or partial results from many runs combined without
+-- revisiting their input.
+--
+-- The file format is little endian regardless of the host:
+--
+--   "STGSTATE", uint32 version, uint32 kind, uint32 quantiles,
+--   uint32 reserved, uint64 records, then for each record
+--   uint32 label length, label, uint64 count, double min, max, mean,
+--   variance and, if quantiles is not SKETCH_NONE, the sketch:
+--   uint64 count, double min, max, then either count doubles (exact)
+--   or uint64 zero and two stores, each int32 offset, floor, length
+--   and length uint64 counts (approximate).
+*/
+
+#ifndef __STATE_H
+#define __STATE_H
+
+#include <stdio.h>
+#include "stats.h"
+#include "keytab.h"
+#include "sketch.h"
+
+#define STATE_VERSION		1
+
+#define STATE_EMPTY			0    /* nothing read or merged yet */
+#define STATE_SINGLE		1
+#define STATE_COLUMNS		2
+#define STATE_GROUPS		3
+
+typedef struct state_record {
+	stats_data    stats;
+	sketch        sketch;    /* empty unless the state keeps quantiles */
+} state_record;
+
+typedef struct state_set {
+	int           kind;
+	int           quantiles; /* kind of sketch kept per record (sketch.h) */
+	keytab        labels;
+	size_t        capacity;
+	state_record *records;   /* indexed like labels */
+} state_set;
+
+#define STATE_TREE_LEVELS	64
+
+/* Pairwise reduction of many states: level i holds 2^i of them merged. */
+typedef struct state_tree {
+	int           used[STATE_TREE_LEVELS];
+	state_set     level[STATE_TREE_LEVELS];
+	uint64        count;
+} state_tree;
+
+/*
+-- Public interface of the module:
+--
+--  state_merge_record() folds a summary into the record with the given
+--  label, adding it if it is new; sk may be NULL. state_read() does the
+--  same for every record of the next state in a stream, returning 0 at
+--  the end of the stream, and exits with a message if the state is
+--  damaged or its kind differs from that of set. If its quantiles differ
+--  from those of set, set keeps none from then on.
+--  state_try_read() warns and returns -1 instead, for states received
+--  from peers; set may then hold part of the state. A set
+--  initialized as STATE_EMPTY takes on those of the first state merged
+--  into it. state_load() reads every state in a file ("-" is stdin).
+--  state_save() replaces a file atomically, syncing the new one before
+--  the rename and its directory after, so a crash of the process or of
+--  the system while saving leaves the previous state intact.
+--
+--  state_tree_add() takes over a state and merges it with the others
+--  like a binary counter, so N states are combined in a balanced tree
+--  of depth log2(N) and no more than log2(N) are held at once.
+--  state_tree_finish() yields the result, labels in the order the
+--  states were added.
+*/
+extern void         state_init(state_set *set, int kind, int quantiles);
+extern void         state_merge_record(state_set *set, const char *label,
+                                       const stats_data *stats,
+                                       const sketch *sk);
+extern void         state_merge(state_set *dst, const state_set *src);
+extern size_t       state_count(const state_set *set);
+extern const char  *state_label_at(const state_set *set, size_t index);
+extern int          state_read(state_set *set, FILE *in, const char *name);
+extern int          state_try_read(state_set *set, FILE *in,
+                                   const char *name);
+extern void         state_load(state_set *set, const char *path);
+extern void         state_write(const state_set *set, FILE *out,
+                                const char *name);
+extern void         state_save(const state_set *set, const char *path);
+extern void         state_free(state_set *set);
+
+extern void         state_tree_init(state_tree *tree);
+extern void         state_tree_add(state_tree *tree, state_set *set);
+extern void         state_tree_finish(state_tree *tree, state_set *out);
+
+#endif /* __STATE_H */
@@ -2,138 +2,2204 @@
 --	StatGen - inspiration from Matt Storch's Variance.cpp
 */
 
+#include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
 
+#include "aread.h"
+#include "input.h"
 #define  INLINE  /* open-code stats routines */
 #include "stats.h"
+#include "stats_basic.h"
+#include "columns.h"
+#include "sketch.h"
+#include "window.h"
+#include "state.h"
+#include "net.h"
+#include "output.h"
+#include "profile.h"
 
 #define BOOL	int
 #define TRUE	1
 #define FALSE	0
 
-#define INITIAL_SIZE	100000
-#define	SIZE_INC			100000
+#define MIN_CHUNK_SIZE	(1 << 20)
+#define SAMPLE_BLOCK		(1 << 18)  /* bytes read at once with --target-hwidth */
+#define TARGET_MIN			1000       /* values before the target is believed */
+#define TARGET_BLOCKS		16         /* blocks, likewise, of a mapped input */
+#define CHECKPOINT_BLOCK	(1 << 23)  /* bytes of a mapped input between checks */
+#define MAX_QUANTILES		16
+#define MAX_LEVELS			8
+#define MAX_STATE_FILES	64
+#define MAX_SERVE_ADDRS	8
 
+/* Specialized accumulators kept for a single stream (stats_basic.h). */
+#define BASIC_NONE			0
+#define BASIC_F64				1
+#define BASIC_F32				2
+#define BASIC_I64				3
+#define BASIC_U64				4
+
+/* Values of a displayed row, indexed as declared by SetupOutput(). */
+#define FIELD_LABEL			0
+#define FIELD_COUNT			1
+#define FIELD_SUM				2
+#define FIELD_MIN				3
+#define FIELD_MAX				4
+#define FIELD_AVG				5
+#define FIELD_VAR				6
+#define FIELD_STDDEV		7
+#define FIELD_STDERR		8
+#define FIELD_HWIDTH		9    /* and FIELD_PHWIDTH, for each level in turn */
+#define FIELD_PHWIDTH		10
+#define FIELD_QUANTILE	(FIELD_HWIDTH + 2 * MAX_LEVELS)
+#define NUM_FIELDS			(FIELD_QUANTILE + MAX_QUANTILES)
+
+/* The fields of a histogram row reuse the same array. */
+#define FIELD_LOW				FIELD_SUM
+#define FIELD_HIGH			FIELD_MIN
+#define FIELD_CUMULATIVE	FIELD_MAX
+
+/* So do those of a comparison with --compare, with FIELD_HWIDTH. */
+#define FIELD_DIFF			FIELD_AVG
+#define FIELD_PDIFF			FIELD_SUM
+#define FIELD_DF				FIELD_MIN
+#define FIELD_SPEEDUP		FIELD_MAX
+
+#define LABEL_WIDTH			8
 #define INT_WIDTH				5
 #define FLOAT_WIDTH			11
 #define DECIMAL_PLACES	4
+#define GROUP_BLOCK			256  /* keys whose results are gathered at once */
+
+#define MIN(x,y)	((x) < (y) ? (x) : (y))
+#define MAX(x,y)	((x) > (y) ? (x) : (y))
+
+const char helpString[] = {
+	"--- Usage: %s [options] [files]\n"
+	"\n"
+	"  General options:\n"
+	"    -b\tread raw native doubles (same as --input-format=f64)\n"
+	"    -h\thelp (default off)\n"
+	"    -f F\tformat to use for displaying output: text, tsv, json\n"
+	"       \t(an object per line) or binary records (default text)\n"
+	"    -k#\tsummarize each of the listed fields of a line, for\n"
+	"       \texample -k 1,3-5 (a non-numeric first line names them)\n"
+	"    -j#\tnumber of threads used on regular files, or on several\n"
+	"       \tfiles at once (default # = 1, 0 = one per processor)\n"
+	"    -l#\tset confidence level (default # = 0.95); several levels,\n"
+	"       \tas in -l 0.9,0.95 or repeated -l, are displayed together\n"
+	"    -t\tuse the T distribution to compute standard error (default < 30)\n"
+	"    -z\tuse the Z distribution to compute standard error (default >= 30)"
+	"\n"
+	"    --input-format=F[,le|be][,z]\n"
+	"       \tinput encoding: text, or packed binary f64, f32, i32, i64\n"
+	"       \tor u64 values in little/big endian order (default text,\n"
+	"       \tnative order); binary input is only taken to be gzip or\n"
+	"       \tzstd data if ,z is given\n"
+	"    --percentiles=#\n"
+	"       \tdisplay the listed percentiles, estimated to within 0.4%%\n"
+	"       \tfrom a bounded-memory sketch\n"
+	"    --exact\tkeep every value so percentiles are exact (selected\n"
+	"       \ton -j threads)\n"
+	"    --mem-limit=#[K|M|G]\n"
+	"       \tbytes of values --exact keeps in memory before spilling\n"
+	"       \tsorted runs to $TMPDIR (default no limit)\n"
+	"    --histogram[=#]\n"
+	"       \talso display bucket counts, # buckets per power of two\n"
+	"       \t(1, 2, 4 ... 128, default 4); a bucket holds\n"
+	"       \tLow <= x < High, or Low < x <= High below zero\n"
+	"    --profile\tprint the time spent reading, parsing, accumulating,\n"
+	"       \tmerging and displaying to stderr at exit\n"
+	"    --batch-means=#\n"
+	"       \tbase the standard error and half-widths of a single\n"
+	"       \tstream on the means of # to 2# consecutive batches,\n"
+	"       \twhich double in size as values arrive, for correlated\n"
+	"       \tvalues such as simulation output (# = 2 to 256)\n"
+	"    --target-hwidth=#\n"
+	"       \tstop reading once the half-width is within # percent of\n"
+	"       \tthe mean; regular files are read in blocks spread across\n"
+	"       \tthem, so that any prefix is a sample of the whole\n"
+	"    --precise\tkeep the mean and variance of a single stream with\n"
+	"       \tcompensated sums, which do not drift over billions of\n"
+	"       \tvalues\n"
+	"    --window=#\n"
+	"       \tsummarize a sliding window of the last # values, after\n"
+	"       \tevery value unless --every or --interval is given\n"
+	"    --every=#\n"
+	"       \tdisplay a row every # values (of them alone, unless\n"
+	"       \t--window is given)\n"
+	"    --interval=#\n"
+	"       \tdisplay a row every # seconds, as --every does\n"
+	"    --save-state=FILE\n"
+	"       \tsave the summaries of all inputs to FILE instead of\n"
+	"       \tdisplaying them separately\n"
+	"    --load-state=FILE\n"
+	"       \tstart from the summaries in FILE (may be repeated)\n"
+	"    --checkpoint=#\n"
+	"       \talso save the state every # seconds while reading\n"
+	"    --all\talso display the summary of all files together, last\n"
+	"       \t(files are then labelled when there are no columns)\n"
+	"    --compare\tcompare the mean of each file with the first's: the\n"
+	"       \tdifference, its half-width (Welch's t-test) and the\n"
+	"       \tspeedup; the files are read -j at a time, or two when\n"
+	"       \t-j is 1\n"
+	"    --merge\tthe files are saved states to combine rather than\n"
+	"       \tvalues; unix:PATH or tcp:[HOST:]PORT listens for them\n"
+	"       \t(as does --save-state send to such an address)\n"
+	"    --expect=#\n"
+	"       \tstop listening once # states have been received\n"
+	"    --serve=ADDR\n"
+	"       \tsummarize \"key value\" lines sent to unix:PATH, udp:PORT\n"
+	"       \tor tcp:PORT per key (may be repeated) until SIGTERM; a\n"
+	"       \tline \"?snapshot\", \"?reset\" or \"?drain\" (both) asks for\n"
+	"       \tthe summary so far. Binary input is a key length byte, the\n"
+	"       \tkey and a value; an empty key asks for query # (1, 2, 3)\n"
+	"    --group-by=#\n"
+	"       \tsummarize the value field (-k, default the first other\n"
+	"       \tfield) separately for each distinct key in field #\n"
+	"    --compact\tkeep the summary of each key in single precision,\n"
+	"       \tfor millions of keys (about 6 significant digits)\n"
+	"    --delimiter=C\n"
+	"       \tfields are separated by C rather than blanks; implies all\n"
+	"       \tfields unless -k is given"
+	"\n\n"
+	"  Display options:\n"
+	"    -a\taverage (default on)\n"
+	"    -c\tcount (default on)\n"
+	"    -d\tstandard deviation (default on)\n"
+	"    -e\tstandard error (default off)\n"
+	"    -m\tmaximum (default on)\n"
+	"    -n\tminimum (default on)\n"
+	"    -p\tconfidence interval half-width in percent (default on)"
+	"\n"
+	"    -q\tpercentiles 50, 90, 99 and 99.9 (default off)\n"
+	"    -s\tsum (default off)\n"
+	"    -v\tvariance (default on)\n"
+	"    -w\tconfidence interval half-width (default on)\n"
+	"    -x\tdo not display column headings (default off)\n"
+	"\n"
+	"  If files are not specified, input with be from stdin.\n"
+	"\n"
+	"  Choosing specific display options supresses the automatic\n"
+	"  display of values (by default, headings are displayed).\n"
+	"\n"
+	"  By Matt Storch and Mark Gardner {storch,mkgardne}@cs.uiuc.edu."
+	"\n\n"
+};
+
+void ComputeStats(FILE *in);
+void ComputeFiles(int nfiles, char *const paths[]);
+void DisplaySavedState(void);
+void DisplayState(state_set *set, const char *label);
+void MergeStates(int argc, char *const argv[]);
+void ComputeWindowStats(FILE *in);
+void ServeStats(void);
+double Z(double p);
+double T(double p, int ndf);
+void GetOptions(int argc, char *const argv[]);
+void SetupOutput(int format);
+void DisplayHeadings(void);
+void DisplayComparison(void);
+void FinishProfile(void);
+void DisplayStats(const char *label, stats_data *stats, sketch *sk);
+void DisplayMoments(const char *label, stats_data *stats, stats_data *err,
+   sketch *sk);
+void DisplayValues(const char *label, uint64 cnt, double sum, double min,
+   double max, double avg, double var, double stddev, double stderror,
+   const double *hwidth, const double *pct, const char *const *exact);
+
+BOOL bit_mode, displayAll, displayAverage, displayCount;
+BOOL displayStdDev, displayStdErr, displayHeading;
+BOOL displayMax, displayMin, displayPercentHalfWidth;
+BOOL displaySum, displayVariance, displayHalfWidth, useT, useZ;
+BOOL columnMode, groupMode, displayLabel;
+const char *labelHeading;
+int numLevels;
+stats_critical criticalValues[MAX_LEVELS];  /* of each confidence level */
+int numThreads;
+input_format inputFormat;
+column_layout columnLayout;
+int quantileMode, numQuantiles;
+double quantiles[MAX_QUANTILES];
+int basicKind;
+BOOL needMoments;
+BOOL windowMode;
+size_t windowSize;
+uint64 windowEvery;
+double windowInterval;
+BOOL stateMode;
+const char *saveStatePath;
+const char *loadStatePaths[MAX_STATE_FILES];
+int numLoadStates;
+double checkpointInterval;
+double memLimit;
+double targetHWidth;
+int batchMeans;
+state_set savedState;
+BOOL mergeMode;
+uint64 expectStates;
+BOOL allMode, headingsOnce;
+BOOL preciseMode;
+BOOL serveMode;
+BOOL compactMode;
+BOOL compareMode;
+const char *serveAddrs[MAX_SERVE_ADDRS];
+int numServeAddrs;
+int outputFormat;
+int histogramBits;   /* log2 of the buckets per power of two, or -1 */
+const char *currentLabel = "-";
+state_set allState;
+
+int debug = 0;
+
+int main(int argc, char *const argv[]) {
+	int i;
+
+	GetOptions(argc, argv);
+	if (serveMode) {
+		ServeStats();
+		FinishProfile();
+		return 0;
+	}
+	if (mergeMode) {
+		MergeStates(argc, argv);
+		FinishProfile();
+		return 0;
+	}
+	if (stateMode) {
+		state_init(&savedState, groupMode ? STATE_GROUPS :
+				columnMode ? STATE_COLUMNS : STATE_SINGLE, quantileMode);
+		for (i = 0; i < numLoadStates; i++)
+			state_load(&savedState, loadStatePaths[i]);
+	} else if (allMode) {
+		state_init(&allState, groupMode ? STATE_GROUPS :
+				columnMode ? STATE_COLUMNS : STATE_SINGLE, quantileMode);
+	}
+	if (optind == argc) {
+		ComputeStats(stdin);
+	} else if (numThreads > 1 && argc - optind > 1 && !windowMode) {
+		ComputeFiles(argc - optind, argv + optind);
+  } else {
+		int saw_stdin = 0;
+		for (i = optind; i < argc; i++) {
+			currentLabel = argv[i];
+			if (!saw_stdin && strcmp(argv[i], "-") == 0) {
+				saw_stdin = 1;
+				ComputeStats(stdin);
+			} else {
+				FILE *in = fopen(argv[i], "r");
+				if (in == NULL) {
+					fprintf(stderr, "-- Error: could not open file '%s' for reading.\n",
+							argv[i]);
+					exit(-1);
+				}
+				ComputeStats(in);
+				fclose(in);
+			}
+		}
+  }
+	if (stateMode || allMode) {
+		profile_mark mark;
+
+		PROFILE_BEGIN(mark);
+		if (stateMode)
+			DisplaySavedState();
+		else
+			DisplayState(&allState, "ALL");
+		PROFILE_END(PROFILE_OUTPUT, mark);
+	}
+	if (compareMode)
+		DisplayComparison();
+	FinishProfile();
+
+  return 0;
+}
+
+/* Everything an input is accumulated into; which part depends on the mode. */
+typedef struct accumulator {
+	stats_data     stats;
+	stats_precise  precise;  /* instead of stats, with --precise */
+	stats_batch_means batches;  /* besides, with --batch-means */
+	sketch         sketch;
+	column_accum   columns;
+	group_accum    groups;
+	column_layout *layout;   /* of the file being read, in column mode */
+	union {
+		stats_basic_f64  f64;
+		stats_basic_f32  f32;
+		stats_basic_i64  i64;
+		stats_basic_u64  u64;
+	}              basic;    /* the exact count, sum, min and max, if kept */
+	window         window;
+	uint64         pending;  /* values since the last windowed row */
+	BOOL           emitted;
+} accumulator;
+
+static void AccumWindowed(accumulator *acc, const double *xs, size_t n);
+
+static void AccumValues(accumulator *acc, const double *xs, size_t n) {
+	profile_mark mark;
+
+	if (windowMode) {
+		AccumWindowed(acc, xs, n);
+		return;
+	}
+	PROFILE_BEGIN(mark);
+	if (preciseMode)
+		stats_precise_update_batch(&acc->precise, xs, n);
+	else if (needMoments)
+		stats_update_batch(&acc->stats, xs, n);
+	if (batchMeans > 0)
+		stats_batch_means_update_batch(&acc->batches, xs, n);
+	if (basicKind == BASIC_F64)
+		stats_basic_f64_update_batch(&acc->basic.f64, xs, n);
+	if (quantileMode != SKETCH_NONE)
+		sketch_add_batch(&acc->sketch, xs, n);
+	PROFILE_END(PROFILE_ACCUMULATE, mark);
+}
+
+/* Accumulate every number in a region that ends on a token boundary. */
+static void AccumulateText(accumulator *acc, const char *p, 
+		const char *end) {
+	double batch[STATS_BATCH_BLOCK];
+	size_t n = 0;
+	const char *q;
+
+	while ((p = input_skip_space(p, end)) < end) {
+		q = input_parse_double(p, end, &batch[n]);
+		if (q == NULL || (q < end && !INPUT_IS_SPACE(*q)))
+			input_bad_token(p, end);
+		if (++n == STATS_BATCH_BLOCK) {
+			AccumValues(acc, batch, n);
+			n = 0;
+		}
+		p = q;
+	}
+	AccumValues(acc, batch, n);
+}
+
+/* Accumulate the packed binary records in a region. */
+static void AccumulateBinary(accumulator *acc, const char *p,
+		const char *end) {
+	double batch[STATS_BATCH_BLOCK];
+	long long ibatch[STATS_BATCH_BLOCK];
+	float fbatch[STATS_BATCH_BLOCK];
+	size_t recsize = input_record_size(&inputFormat);
+	size_t n = (end - p) / recsize, len;
+	profile_mark mark;
+
+	if ((end - p) % recsize != 0) {
+		fprintf(stderr, "-- Error: input ends with a partial %d byte record.\n",
+				(int)recsize);
+		exit(1);
+	}
+
+	/* Native doubles (or floats) in the (page aligned) mapping are used in place. */
+	if (!inputFormat.swap && (uintptr_t)p % recsize == 0) {
+		if (inputFormat.type == INPUT_F64) {
+			AccumValues(acc, (const double *)p, n);
+			return;
+		}
+		if (basicKind == BASIC_F32) {
+			PROFILE_BEGIN(mark);
+			stats_basic_f32_update_batch(&acc->basic.f32, (const float *)p, n);
+			PROFILE_END(PROFILE_ACCUMULATE, mark);
+			return;
+		}
+	}
+	for (; n > 0; n -= len, p += len * recsize) {
+		len = MIN(n, STATS_BATCH_BLOCK);
+		if (basicKind == BASIC_F32) {
+			memcpy(fbatch, p, len * sizeof(float));
+			PROFILE_BEGIN(mark);
+			stats_basic_f32_update_batch(&acc->basic.f32, fbatch, len);
+			PROFILE_END(PROFILE_ACCUMULATE, mark);
+			continue;
+		}
+
+		/* Integers are summed exactly, and converted only if need be. */
+		if (basicKind == BASIC_I64 || basicKind == BASIC_U64) {
+			input_decode_int(&inputFormat, p, len, ibatch);
+			PROFILE_BEGIN(mark);
+			if (basicKind == BASIC_I64)
+				stats_basic_i64_update_batch(&acc->basic.i64, (int64 *)ibatch, len);
+			else
+				stats_basic_u64_update_batch(&acc->basic.u64, (uint64 *)ibatch, len);
+			PROFILE_END(PROFILE_ACCUMULATE, mark);
+			if (!needMoments && quantileMode == SKETCH_NONE)
+				continue;
+		}
+		input_decode(&inputFormat, p, len, batch);
+		AccumValues(acc, batch, len);
+	}
+}
+
+static void AccumInit(accumulator *acc, column_layout *layout) {
+	acc->layout = layout;
+	if (groupMode) {
+		columns_group_init(&acc->groups, quantileMode, compactMode);
+	} else if (columnMode) {
+		columns_accum_init(&acc->columns, layout);
+	} else {
+		stats_init(&acc->stats);
+		stats_precise_init(&acc->precise);
+		stats_batch_means_init(&acc->batches, batchMeans);
+		sketch_init(&acc->sketch, quantileMode == SKETCH_EXACT);
+		switch (basicKind) {
+		 case BASIC_F64: stats_basic_f64_init(&acc->basic.f64); break;
+		 case BASIC_F32: stats_basic_f32_init(&acc->basic.f32); break;
+		 case BASIC_I64: stats_basic_i64_init(&acc->basic.i64); break;
+		 case BASIC_U64: stats_basic_u64_init(&acc->basic.u64); break;
+		}
+	}
+}
+
+/* Parsing in column and group mode includes accumulating the fields. */
+static void AccumRegion(accumulator *acc, const char *p, const char *end) {
+	profile_mark mark;
+
+	PROFILE_BEGIN(mark);
+	if (groupMode)
+		columns_group_accumulate(acc->layout, &acc->groups, p, end);
+	else if (columnMode)
+		columns_accumulate(acc->layout, &acc->columns, p, end);
+	else if (inputFormat.type == INPUT_TEXT)
+		AccumulateText(acc, p, end);
+	else
+		AccumulateBinary(acc, p, end);
+	PROFILE_END(PROFILE_PARSE, mark);
+}
+
+/* Fold src (which is released) into dst. */
+static void AccumMerge(accumulator *dst, accumulator *src) {
+	profile_mark mark;
+
+	PROFILE_BEGIN(mark);
+	if (groupMode) {
+		columns_group_merge(&dst->groups, &src->groups);
+		columns_group_free(&src->groups);
+	} else if (columnMode) {
+		columns_merge(&dst->columns, &src->columns);
+		columns_accum_free(&src->columns);
+	} else {
+		stats_merge(&dst->stats, &src->stats);
+		stats_precise_merge(&dst->precise, &src->precise);
+		sketch_merge(&dst->sketch, &src->sketch);
+		sketch_free(&src->sketch);
+		switch (basicKind) {
+		 case BASIC_F64: stats_basic_f64_merge(&dst->basic.f64, &src->basic.f64); break;
+		 case BASIC_F32: stats_basic_f32_merge(&dst->basic.f32, &src->basic.f32); break;
+		 case BASIC_I64: stats_basic_i64_merge(&dst->basic.i64, &src->basic.i64); break;
+		 case BASIC_U64: stats_basic_u64_merge(&dst->basic.u64, &src->basic.u64); break;
+		}
+	}
+	PROFILE_END(PROFILE_MERGE, mark);
+}
+
+static void AccumFree(accumulator *acc) {
+	if (groupMode)
+		columns_group_free(&acc->groups);
+	else if (columnMode)
+		columns_accum_free(&acc->columns);
+	else
+		sketch_free(&acc->sketch);
+}
+
+typedef struct chunk_job {
+	const char    *begin;
+	const char    *end;
+	accumulator    acc;
+} chunk_job;
+
+static void *ChunkWorker(void *arg) {
+	chunk_job *job = arg;
+
+	AccumInit(&job->acc, job->acc.layout);
+	AccumRegion(&job->acc, job->begin, job->end);
+	return NULL;
+}
+
+/*
+-- Cut a mapped file into one chunk per thread at line (or record)
+-- boundaries, accumulate the chunks concurrently and merge the partial
+-- results into acc in file order.
+*/
+static void AccumulateParallel(accumulator *acc, const char *base,
+		size_t len, int nthreads) {
+	const char *p = base, *end = base + len;
+	size_t recsize = input_record_size(&inputFormat);
+	chunk_job *jobs;
+	pthread_t *threads;
+	int i, *started;
+
+	if ((size_t)nthreads > len / MIN_CHUNK_SIZE + 1)
+		nthreads = len / MIN_CHUNK_SIZE + 1;
+	jobs = calloc(nthreads, sizeof(*jobs));
+	threads = calloc(nthreads, sizeof(*threads));
+	started = calloc(nthreads, sizeof(*started));
+	if (jobs == NULL || threads == NULL || started == NULL) {
+		fputs("-- Error: out of memory allocating threads.\n", stderr);
+		exit(1);
+	}
+
+	for (i = 0; i < nthreads; i++) {
+		const char *cut = end;
+		if (i < nthreads - 1) {
+			cut = base + len / nthreads * (i + 1);
+			if (cut < p)
+				cut = p;
+			if (recsize > 0) {
+				cut -= (cut - base) % recsize;
+			} else {
+				cut = memchr(cut, '\n', end - cut);
+				cut = (cut == NULL) ? end : cut + 1;
+			}
+		}
+		jobs[i].begin = p;
+		jobs[i].end = cut;
+		jobs[i].acc.layout = acc->layout;
+		p = cut;
+	}
+	for (i = 1; i < nthreads; i++)
+		started[i] = pthread_create(&threads[i], NULL, ChunkWorker, &jobs[i]) == 0;
+	ChunkWorker(&jobs[0]);
+	for (i = 1; i < nthreads; i++) {
+		if (started[i])
+			pthread_join(threads[i], NULL);
+		else
+			ChunkWorker(&jobs[i]);
+	}
+
+	for (i = 0; i < nthreads; i++)
+		AccumMerge(acc, &jobs[i].acc);
+	free(started);
+	free(threads);
+	free(jobs);
+}
+
+#ifdef __SIZEOF_INT128__
+/* Format an integer sum, minimum or maximum without rounding it. */
+static const char *FormatExact(char *buf, size_t size, BOOL negative,
+		stats_uint128 magnitude) {
+	char *p = buf + size;
+
+	*--p = '\0';
+	do {
+		*--p = '0' + (int)(magnitude % 10);
+		magnitude /= 10;
+	} while (magnitude > 0);
+	if (negative)
+		*--p = '-';
+	return p;
+}
+
+static const char *FormatExactSigned(char *buf, size_t size,
+		stats_int128 value) {
+	return FormatExact(buf, size, value < 0,
+			value < 0 ? -(stats_uint128)value : (stats_uint128)value);
+}
+#endif /* __SIZEOF_INT128__ */
+
+/* The confidence interval half-widths of stats at each level, if any. */
+static void HalfWidths(stats_data *stats, double *hwidth) {
+	int i;
+
+	for (i = 0; i < numLevels; i++)
+		hwidth[i] = stats_count(stats) < 2 ? NAN :
+				stats_confidence_at(stats, &criticalValues[i]);
+}
+
+/*
+-- What the standard error of a single stream is worked out from: its
+-- values, or with --batch-means the means of its batches (in *means).
+*/
+static stats_data *ErrorStats(accumulator *acc, stats_data *means) {
+	double r;
+
+	if (batchMeans == 0)
+		return &acc->stats;
+	stats_batch_means_result(&acc->batches, means);
+	r = stats_batch_means_lag1(&acc->batches);
+	if (r > 2.0 / sqrt((double)acc->batches.full))
+		fprintf(stderr, "-- Warning: the batch means are correlated (lag 1, "
+				"%.2f); the half-width may be too small.\n", r);
+	return means;
+}
+
+/*
+-- Display a single stream whose count, sum, minimum and maximum come
+-- from a specialized accumulator; the rest, if shown, from acc->stats.
+-- Integer sums, minima and maxima are shown exactly.
+*/
+static void DisplayBasic(const char *label, accumulator *acc) {
+	stats_data *stats = &acc->stats, means, *err;
+	double avg, var = 0.0, stddev = 0.0, stderror = 0.0;
+	double hwidth[MAX_LEVELS] = { 0.0 }, pct[MAX_QUANTILES];
+#ifdef __SIZEOF_INT128__
+	char digits[3][48];
+	const char *exact[3];
+#endif
+	uint64 count;
+
+	switch (basicKind) {
+	 case BASIC_F64:
+		count = acc->basic.f64.count;
+		avg = acc->basic.f64.sum / count;
+		break;
+	 case BASIC_F32:
+		count = acc->basic.f32.count;
+		avg = acc->basic.f32.sum / count;
+		break;
+	 case BASIC_I64:
+		count = acc->basic.i64.count;
+		avg = (double)((long double)acc->basic.i64.sum / count);
+		break;
+	 default:
+		count = acc->basic.u64.count;
+		avg = (double)((long double)acc->basic.u64.sum / count);
+		break;
+	}
+	if (needMoments) {
+		var = stats_variance(stats);
+		stddev = stats_stdev(stats);
+		err = ErrorStats(acc, &means);
+		stderror = stats_stderr(err);
+		HalfWidths(err, hwidth);
+	}
+	if (numQuantiles > 0)
+		sketch_quantiles(&acc->sketch, quantiles, numQuantiles, pct);
+
+	switch (basicKind) {
+	 case BASIC_F64:
+		DisplayValues(label, count, acc->basic.f64.sum, acc->basic.f64.min,
+				acc->basic.f64.max, avg, var, stddev, stderror, hwidth, pct,
+				NULL);
+		break;
+	 case BASIC_F32:
+		DisplayValues(label, count, acc->basic.f32.sum, acc->basic.f32.min,
+				acc->basic.f32.max, avg, var, stddev, stderror, hwidth, pct,
+				NULL);
+		break;
+#ifdef __SIZEOF_INT128__
+	 case BASIC_I64:
+		exact[0] = FormatExactSigned(digits[0], 48, acc->basic.i64.sum);
+		exact[1] = FormatExactSigned(digits[1], 48, acc->basic.i64.min);
+		exact[2] = FormatExactSigned(digits[2], 48, acc->basic.i64.max);
+		DisplayValues(label, count, 0.0, 0.0, 0.0, avg, var, stddev, stderror,
+				hwidth, pct, exact);
+		break;
+	 default:
+		exact[0] = FormatExact(digits[0], 48, FALSE, acc->basic.u64.sum);
+		exact[1] = FormatExact(digits[1], 48, FALSE, acc->basic.u64.min);
+		exact[2] = FormatExact(digits[2], 48, FALSE, acc->basic.u64.max);
+		DisplayValues(label, count, 0.0, 0.0, 0.0, avg, var, stddev, stderror,
+				hwidth, pct, exact);
+		break;
+#else
+	 case BASIC_I64:
+		DisplayValues(label, count, acc->basic.i64.sum, acc->basic.i64.min,
+				acc->basic.i64.max, avg, var, stddev, stderror, hwidth, pct,
+				NULL);
+		break;
+	 default:
+		DisplayValues(label, count, acc->basic.u64.sum, acc->basic.u64.min,
+				acc->basic.u64.max, avg, var, stddev, stderror, hwidth, pct,
+				NULL);
+		break;
+#endif
+	}
+}
+
+/* Values in a single stream, whichever accumulator counted them. */
+static uint64 AccumCount(accumulator *acc) {
+	switch (basicKind) {
+	 case BASIC_F64: return acc->basic.f64.count;
+	 case BASIC_F32: return acc->basic.f32.count;
+	 case BASIC_I64: return acc->basic.i64.count;
+	 case BASIC_U64: return acc->basic.u64.count;
+	}
+	return stats_count(&acc->stats);
+}
+
+/* Values accumulated in any mode, once they are flushed to the stats. */
+static uint64 AccumTotal(accumulator *acc) {
+	uint64 total = 0;
+	size_t i;
+
+	if (groupMode) {
+		for (i = 0; i < keytab_count(&acc->groups.keys); i++)
+			total += columns_group_count(&acc->groups, i);
+	} else if (columnMode) {
+		for (i = 0; i < (size_t)acc->columns.ncols; i++)
+			total += stats_count(&acc->columns.stats[i]);
+	} else {
+		total = AccumCount(acc);
+	}
+	return total;
+}
+
+/* The histograms follow the summaries as a table of their own. */
+static void BeginHistograms(void) {
+	output_init(outputFormat, DECIMAL_PLACES);
+	if (displayLabel)
+		output_add_field(labelHeading, OUTPUT_LABEL, -LABEL_WIDTH, FIELD_LABEL);
+	output_add_field("Low", OUTPUT_NUMBER, FLOAT_WIDTH, FIELD_LOW);
+	output_add_field("High", OUTPUT_NUMBER, FLOAT_WIDTH, FIELD_HIGH);
+	output_add_field("Count", OUTPUT_COUNT, FLOAT_WIDTH, FIELD_COUNT);
+	output_add_field("%Cum", OUTPUT_NUMBER, FLOAT_WIDTH, FIELD_CUMULATIVE);
+	output_break();
+	if (displayHeading)
+		output_headings();
+}
+
+/* The mean of each file, recorded with --compare as it is displayed. */
+typedef struct compared {
+	const char *label;
+	double      mean;
+	double      se2;     /* squared standard error of the mean */
+	double      df;      /* its degrees of freedom */
+} compared;
+
+static compared *comparedFiles;
+static size_t numCompared;
+
+static void CompareRecord(accumulator *acc, const char *label) {
+	stats_data means, *err = &acc->stats;
+	compared *c;
+
+	if (batchMeans > 0) {
+		stats_batch_means_result(&acc->batches, &means);
+		err = &means;
+	}
+	comparedFiles = realloc(comparedFiles,
+			(numCompared + 1) * sizeof(*comparedFiles));
+	if (comparedFiles == NULL) {
+		fputs("-- Error:  out of memory comparing files.\n", stderr);
+		exit(1);
+	}
+	c = &comparedFiles[numCompared++];
+	c->label = label;
+	c->mean = stats_mean(&acc->stats);
+	c->se2 = stats_stderr(err) * stats_stderr(err);
+	c->df = (double)(stats_count(err) - 1);
+}
+
+/*
+-- Each file after the first against the first, in a table of its own:
+-- the difference of the means, its half-width by Welch's t-test, whose
+-- degrees of freedom (Welch-Satterthwaite) are usually not a whole
+-- number and are rounded down for T(), and the speedup if the values
+-- are times, the first mean over the other.
+*/
+void DisplayComparison(void) {
+	static char levelHeadings[MAX_LEVELS][32];
+	output_value v[NUM_FIELDS];
+	const compared *base = &comparedFiles[0], *c;
+	double se2, df, diff;
+	size_t j;
+	int i;
+
+	output_init(outputFormat, DECIMAL_PLACES);
+	output_add_field(labelHeading, OUTPUT_LABEL, -LABEL_WIDTH, FIELD_LABEL);
+	output_add_field("Diff", OUTPUT_NUMBER, FLOAT_WIDTH, FIELD_DIFF);
+	output_add_field("%Diff", OUTPUT_NUMBER, FLOAT_WIDTH, FIELD_PDIFF);
+	for (i = 0; i < numLevels; i++) {
+		if (numLevels > 1)
+			snprintf(levelHeadings[i], sizeof(levelHeadings[i]), "HWidth%g",
+					100 * criticalValues[i].level);
+		else
+			strcpy(levelHeadings[i], "HWidth");
+		output_add_field(levelHeadings[i], OUTPUT_NUMBER, FLOAT_WIDTH,
+				FIELD_HWIDTH + 2 * i);
+	}
+	output_add_field("DF", OUTPUT_NUMBER, FLOAT_WIDTH, FIELD_DF);
+	output_add_field("Speedup", OUTPUT_NUMBER, FLOAT_WIDTH, FIELD_SPEEDUP);
+	output_break();
+	if (displayHeading)
+		output_headings();
+
+	memset(v, 0, sizeof(v));
+	for (j = 1; j < numCompared; j++) {
+		c = &comparedFiles[j];
+		diff = c->mean - base->mean;
+		se2 = base->se2 + c->se2;
+		df = base->se2 * base->se2 / base->df + c->se2 * c->se2 / c->df;
+		df = df > 0.0 ? se2 * se2 / df : base->df + c->df;
+		df = MIN(df, 1e9);
+		v[FIELD_LABEL].text = c->label;
+		v[FIELD_DIFF].number = diff;
+		v[FIELD_PDIFF].number = 100.0 * diff / base->mean;
+		for (i = 0; i < numLevels; i++)
+			v[FIELD_HWIDTH + 2 * i].number = sqrt(se2) *
+					T((1.0 - criticalValues[i].level) / 2, MAX(1, (int)df));
+		v[FIELD_DF].number = df;
+		v[FIELD_SPEEDUP].number = base->mean / c->mean;
+		output_row(v);
+	}
+	free(comparedFiles);
+	comparedFiles = NULL;
+	numCompared = 0;
+}
+
+static void EndHistograms(void) {
+	SetupOutput(outputFormat);
+}
+
+static void DisplayHistogram(const char *label, sketch *sk) {
+	output_value v[NUM_FIELDS];
+	sketch_bucket *buckets;
+	size_t i, n = sketch_histogram(sk, histogramBits, &buckets);
+	uint64 seen = 0;
+
+	memset(v, 0, sizeof(v));
+	v[FIELD_LABEL].text = label != NULL ? label : "";
+	for (i = 0; i < n; i++) {
+		seen += buckets[i].count;
+		v[FIELD_LOW].number = buckets[i].low;
+		v[FIELD_HIGH].number = buckets[i].high;
+		v[FIELD_COUNT].count = buckets[i].count;
+		v[FIELD_CUMULATIVE].number = 100.0 * seen / sk->count;
+		output_row(v);
+	}
+	free(buckets);
+}
+
+/* Display the summary of one input; label names it if there are no columns. */
+static void DisplayAccum(accumulator *acc, const char *label) {
+	column_layout *layout = acc->layout;
+	size_t i, n, omitted = 0;
+	stats_data means;
+
+	if (groupMode) {
+		stats_data block[GROUP_BLOCK];
+		size_t j, m;
+
+		n = keytab_count(&acc->groups.keys);
+		DisplayHeadings();
+		for (i = 0; i < n; i += m) {
+			m = MIN(n - i, GROUP_BLOCK);
+			columns_group_results(&acc->groups, i, m, block);
+			for (j = 0; j < m; j++) {
+				if (stats_count(&block[j]) < 2)
+					omitted++;
+				else
+					DisplayStats(keytab_key_at(&acc->groups.keys, i + j, NULL),
+							&block[j], acc->groups.sketches ?
+							&acc->groups.sketches[i + j] : NULL);
+			}
+		}
+		if (omitted > 0)
+			fprintf(stderr, "-- Warning: omitted %lu keys with less than two "
+					"numbers.\n", (unsigned long)omitted);
+		if (histogramBits >= 0) {
+			BeginHistograms();
+			for (i = 0; i < n; i++) {
+				if (columns_group_count(&acc->groups, i) >= 2)
+					DisplayHistogram(keytab_key_at(&acc->groups.keys, i, NULL),
+							&acc->groups.sketches[i]);
+			}
+			EndHistograms();
+		}
+	} else if (columnMode) {
+		columns_flush(&acc->columns);
+		DisplayHeadings();
+		for (i = 0; i < (size_t)acc->columns.ncols; i++) {
+			if (stats_count(&acc->columns.stats[i]) < 2) {
+				fprintf(stderr, "-- Warning: column '%s' has less than two numbers.\n",
+						layout->labels[i]);
+				continue;
+			}
+			DisplayStats(layout->labels[i], &acc->columns.stats[i],
+					acc->columns.sketches ? &acc->columns.sketches[i] : NULL);
+		}
+		if (histogramBits >= 0) {
+			BeginHistograms();
+			for (i = 0; i < (size_t)acc->columns.ncols; i++) {
+				if (stats_count(&acc->columns.stats[i]) >= 2)
+					DisplayHistogram(layout->labels[i], &acc->columns.sketches[i]);
+			}
+			EndHistograms();
+		}
+	} else {
+		if (preciseMode)
+			stats_precise_result(&acc->precise, &acc->stats);
+		if (AccumCount(acc) < 2) {
+			fputs("-- Error: need at least two numbers as input.\n", stderr);
+			exit(1);
+		}
+		DisplayHeadings();
+		if (basicKind != BASIC_NONE)
+			DisplayBasic(label, acc);
+		else
+			DisplayMoments(label, &acc->stats, ErrorStats(acc, &means),
+					&acc->sketch);
+		if (histogramBits >= 0) {
+			BeginHistograms();
+			DisplayHistogram(label, &acc->sketch);
+			EndHistograms();
+		}
+	}
+}
+
+/* Fold everything in acc into set, labelled as it would be displayed. */
+static void AccumToState(accumulator *acc, state_set *set) {
+	profile_mark mark;
+	size_t i, n;
+
+	PROFILE_BEGIN(mark);
+	if (groupMode) {
+		stats_data s;
+
+		n = keytab_count(&acc->groups.keys);
+		for (i = 0; i < n; i++) {
+			columns_group_stats(&acc->groups, i, &s);
+			state_merge_record(set, keytab_key_at(&acc->groups.keys, i, NULL), &s,
+					acc->groups.sketches ? &acc->groups.sketches[i] : NULL);
+		}
+	} else if (columnMode) {
+		columns_flush(&acc->columns);
+		for (i = 0; i < (size_t)acc->columns.ncols; i++)
+			state_merge_record(set, acc->layout->labels[i], &acc->columns.stats[i],
+					acc->columns.sketches ? &acc->columns.sketches[i] : NULL);
+	} else {
+		if (preciseMode)
+			stats_precise_result(&acc->precise, &acc->stats);
+		state_merge_record(set, "", &acc->stats, &acc->sketch);
+	}
+	PROFILE_END(PROFILE_MERGE, mark);
+}
+
+/* Save a state to a file or send it to a socket address. */
+static void SaveState(const state_set *set, const char *path) {
+	FILE *out;
+
+	if (!net_is_address(path)) {
+		state_save(set, path);
+		return;
+	}
+	if ((out = fdopen(net_connect(path), "wb")) == NULL) {
+		fprintf(stderr, "-- Error: could not send state to '%s'.\n", path);
+		exit(1);
+	}
+	state_write(set, out, path);
+	fclose(out);
+}
+
+/* Save what has been accumulated so far without disturbing it. */
+static void Checkpoint(accumulator *acc) {
+	state_set snapshot;
+
+	state_init(&snapshot, savedState.kind, savedState.quantiles);
+	state_merge(&snapshot, &savedState);
+	AccumToState(acc, &snapshot);
+	SaveState(&snapshot, saveStatePath);
+	state_free(&snapshot);
+}
+
+/* Display (and save) the summaries of every input and loaded state. */
+void DisplaySavedState(void) {
+	if (saveStatePath != NULL)
+		SaveState(&savedState, saveStatePath);
+	if (saveStatePath != NULL && (strcmp(saveStatePath, "-") == 0 ||
+			net_is_address(saveStatePath)))
+		return;
+	if ((numQuantiles > 0 || histogramBits >= 0) &&
+			savedState.quantiles == SKETCH_NONE) {
+		fputs("-- Error: the saved states have no percentiles or histograms.\n",
+				stderr);
+		exit(1);
+	}
+	DisplayState(&savedState, NULL);
+}
+
+/* Display a state like an input; label names a single stream. */
+void DisplayState(state_set *set, const char *label) {
+	size_t i, n = state_count(set), omitted = 0;
+	state_record *rec;
+
+	if (set->kind == STATE_SINGLE &&
+			(n == 0 || stats_count(&set->records[0].stats) < 2)) {
+		fputs("-- Error: need at least two numbers as input.\n", stderr);
+		exit(1);
+	}
+	DisplayHeadings();
+	for (i = 0; i < n; i++) {
+		rec = &set->records[i];
+		if (stats_count(&rec->stats) < 2) {
+			if (set->kind == STATE_COLUMNS)
+				fprintf(stderr, "-- Warning: column '%s' has less than two "
+						"numbers.\n", state_label_at(set, i));
+			else
+				omitted++;
+			continue;
+		}
+		DisplayStats(set->kind == STATE_SINGLE ? label : state_label_at(set, i),
+				&rec->stats, &rec->sketch);
+	}
+	if (omitted > 0)
+		fprintf(stderr, "-- Warning: omitted %lu keys with less than two "
+				"numbers.\n", (unsigned long)omitted);
+	if (histogramBits < 0)
+		return;
+	BeginHistograms();
+	for (i = 0; i < n; i++) {
+		rec = &set->records[i];
+		if (stats_count(&rec->stats) >= 2)
+			DisplayHistogram(set->kind == STATE_SINGLE ? label :
+					state_label_at(set, i), &rec->sketch);
+	}
+	EndHistograms();
+}
+
+/*
+-- Read the states in a stream into the tree; returns how many. Each is
+-- checked against the layout of the first so errors name their file.
+*/
+static uint64 ReadStates(state_tree *tree, FILE *in, const char *name,
+		uint64 limit, BOOL peer) {
+	static int kind = STATE_EMPTY, quantiles = SKETCH_NONE;
+	state_set part;
+	profile_mark mark;
+	uint64 n;
+
+	PROFILE_BEGIN(mark);
+	for (n = 0; n < limit; n++) {
+		state_init(&part, kind, quantiles);
+		/* A damaged state from a peer ends its connection, not the merge. */
+		if ((peer ? state_try_read(&part, in, name) :
+				state_read(&part, in, name)) <= 0) {
+			state_free(&part);
+			break;
+		}
+		if (kind == STATE_EMPTY) {
+			kind = part.kind;
+			quantiles = part.quantiles;
+		}
+		state_tree_add(tree, &part);
+	}
+	PROFILE_END(PROFILE_READ, mark);
+	return n;
+}
+
+/*
+-- Combine saved states (--merge) from files, stdin and sockets. A
+-- socket is listened on until --expect states have arrived, taking
+-- one connection at a time; each may carry several states.
+*/
+void MergeStates(int argc, char *const argv[]) {
+	static char *const stdinOnly[] = { "-" };
+	char *const *paths = argv + optind;
+	int npaths = argc - optind, i, listener;
+	uint64 received = 0;
+	state_tree tree;
+	profile_mark mark;
+	FILE *in;
+
+	if (npaths == 0) {
+		paths = stdinOnly;
+		npaths = 1;
+	}
+	state_tree_init(&tree);
+	for (i = 0; i < numLoadStates; i++) {
+		if ((in = fopen(loadStatePaths[i], "rb")) == NULL) {
+			fprintf(stderr, "-- Error: could not open state file '%s' for "
+					"reading.\n", loadStatePaths[i]);
+			exit(1);
+		}
+		ReadStates(&tree, in, loadStatePaths[i], (uint64)-1, FALSE);
+		fclose(in);
+	}
+	for (i = 0; i < npaths; i++) {
+		if (net_is_address(paths[i])) {
+			if (expectStates == 0) {
+				fprintf(stderr, "-- Error: --expect is needed to know when to stop "
+						"listening on '%s'.\n", paths[i]);
+				exit(1);
+			}
+			listener = net_listen(paths[i]);
+			for (received = 0; received < expectStates; ) {
+				if ((in = fdopen(net_accept(listener), "rb")) == NULL) {
+					fputs("-- Error: out of memory accepting a state.\n", stderr);
+					exit(1);
+				}
+				received += ReadStates(&tree, in, paths[i], expectStates - received,
+						TRUE);
+				fclose(in);
+			}
+			close(listener);
+			if (strncmp(paths[i], "unix:", 5) == 0)
+				unlink(paths[i] + 5);
+		} else if (strcmp(paths[i], "-") == 0) {
+			ReadStates(&tree, stdin, "stdin", (uint64)-1, FALSE);
+		} else {
+			if ((in = fopen(paths[i], "rb")) == NULL) {
+				fprintf(stderr, "-- Error: could not open state file '%s' for "
+						"reading.\n", paths[i]);
+				exit(1);
+			}
+			ReadStates(&tree, in, paths[i], (uint64)-1, FALSE);
+			fclose(in);
+		}
+	}
+	if (tree.count == 0) {
+		fputs("-- Error: no saved states to merge.\n", stderr);
+		exit(1);
+	}
+	PROFILE_BEGIN(mark);
+	state_tree_finish(&tree, &savedState);
+	PROFILE_END(PROFILE_MERGE, mark);
+	displayLabel = savedState.kind != STATE_SINGLE;
+	labelHeading = savedState.kind == STATE_GROUPS ? "Key" : "Column";
+	SetupOutput(outputFormat);
+	PROFILE_BEGIN(mark);
+	DisplaySavedState();
+	PROFILE_END(PROFILE_OUTPUT, mark);
+	state_free(&savedState);
+}
+
+/*
+-- statgen --serve: a long-lived process that summarizes keyed values
+-- sent to it over sockets, without a process per batch. Each of the
+-- numThreads workers waits on its own epoll set and accumulates into a
+-- table of its own, so recording takes only a lock that no one else
+-- wants. A query merges the tables, and may reset them.
+*/
+#define SERVE_LISTENER		0    /* kinds of serve_socket */
+#define SERVE_DATAGRAM		1
+#define SERVE_CONNECTION	2
+
+#define SERVE_READ_SIZE		(64 << 10)
+#define SERVE_MAX_PENDING	(1 << 20)   /* bytes of a line or record, at most */
+#define SERVE_EVENTS			64
+
+#define QUERY_SNAPSHOT		1    /* in binary input, the value of a query */
+#define QUERY_RESET				2
+#define QUERY_DRAIN				3    /* a snapshot, then a reset */
+
+#ifndef EPOLLEXCLUSIVE
+#define EPOLLEXCLUSIVE		0
+#endif
+
+typedef struct serve_socket {
+	int            fd;
+	int            kind;
+	unsigned       events;   /* watched for */
+	char          *buf;      /* of a connection, what is not yet handled */
+	size_t         len;
+	size_t         size;
+	char          *out;      /* replies, of which sent bytes are gone */
+	size_t         sent;
+	size_t         outlen;
+	size_t         outsize;
+	BOOL           ended;    /* closed by the client, once replies are sent */
+} serve_socket;
+
+typedef struct serve_shard {
+	pthread_mutex_t lock;    /* held by the owner while accumulating */
+	group_accum    groups;
+	column_layout  layout;   /* set up from the first line received */
+	uint64         skipped;  /* malformed lines and records */
+	int            epoll;
+	char          *datagram;
+} serve_shard;
+
+typedef struct serve_pool {
+	serve_shard   *shards;
+	int            nshards;
+	pthread_mutex_t query;   /* one query at a time uses the output */
+} serve_pool;
+
+typedef struct serve_worker {
+	serve_pool    *pool;
+	serve_shard   *shard;
+} serve_worker;
+
+/* Queue n bytes of replies on a connection; also an output_sink. */
+static void ServeQueue(void *arg, const char *p, size_t n) {
+	serve_socket *conn = arg;
+
+	if (conn->outsize - conn->outlen < n) {
+		while (conn->outsize - conn->outlen < n)
+			conn->outsize = conn->outsize ? 2 * conn->outsize : SERVE_READ_SIZE;
+		if ((conn->out = realloc(conn->out, conn->outsize)) == NULL) {
+			fputs("-- Error: out of memory replying to a connection.\n", stderr);
+			exit(1);
+		}
+	}
+	memcpy(conn->out + conn->outlen, p, n);
+	conn->outlen += n;
+}
+
+/*
+-- Take a snapshot of every shard into one table, resetting the shards
+-- if asked, and display it if asked: queued as a reply on conn, or on
+-- standard output if conn is NULL. A reply ends with an empty line so
+-- that a client can tell where it stops. Nothing here waits for a
+-- client, which is sent its reply by its own worker.
+*/
+static void ServeSnapshot(serve_pool *pool, serve_socket *conn, BOOL show,
+		BOOL reset) {
+	accumulator snap;
+	profile_mark mark;
+	int i;
+
+	pthread_mutex_lock(&pool->query);
+	memset(&snap, 0, sizeof(snap));
+	columns_group_init(&snap.groups, quantileMode, compactMode);
+	PROFILE_BEGIN(mark);
+	for (i = 0; i < pool->nshards; i++) {
+		serve_shard *shard = &pool->shards[i];
+
+		pthread_mutex_lock(&shard->lock);
+		columns_group_merge(&snap.groups, &shard->groups);
+		if (reset) {
+			columns_group_free(&shard->groups);
+			columns_group_init(&shard->groups, quantileMode, compactMode);
+		}
+		pthread_mutex_unlock(&shard->lock);
+	}
+	PROFILE_END(PROFILE_MERGE, mark);
+
+	if (show) {
+		PROFILE_BEGIN(mark);
+		if (conn != NULL)
+			output_set_sink(ServeQueue, conn);
+		DisplayAccum(&snap, NULL);
+		output_flush();
+		if (conn != NULL) {
+			ServeQueue(conn, "\n", 1);
+			output_set_fd(STDOUT_FILENO);
+		}
+		PROFILE_END(PROFILE_OUTPUT, mark);
+	}
+	columns_group_free(&snap.groups);
+	pthread_mutex_unlock(&pool->query);
+}
+
+/* Answer a query line such as "?snapshot" from a connection. */
+static void ServeQuery(serve_pool *pool, serve_socket *conn, const char *p,
+		const char *end) {
+	static const char *const names[] = { NULL, "snapshot", "reset", "drain" };
+	char error[80];
+	size_t len;
+	int i;
+
+	for (p++; p < end && INPUT_IS_SPACE(*p); p++)
+		;
+	for (len = 0; p + len < end && !INPUT_IS_SPACE(p[len]); len++)
+		;
+	for (i = QUERY_SNAPSHOT; i <= QUERY_DRAIN; i++) {
+		if (strlen(names[i]) == len && strncmp(p, names[i], len) == 0)
+			break;
+	}
+	if (i > QUERY_DRAIN) {
+		snprintf(error, sizeof(error), "-- Error: unknown query '%.*s'.\n\n",
+				(int)MIN(len, 40), p);
+		ServeQueue(conn, error, strlen(error));
+		return;
+	}
+	ServeSnapshot(pool, conn, i != QUERY_RESET, i != QUERY_SNAPSHOT);
+	if (i == QUERY_RESET)
+		ServeQueue(conn, "\n", 1);
+}
+
+/* Where the next line starting with '?' begins, or end. */
+static const char *NextQuery(const char *p, const char *end) {
+	const char *q = p;
+
+	while ((q = memchr(q, '?', end - q)) != NULL) {
+		if (q == p || q[-1] == '\n')
+			return q;
+		q++;
+	}
+	return end;
+}
+
+/* Accumulate whole "key value" lines; conn, if not NULL, may query. */
+static void ServeText(serve_pool *pool, serve_shard *shard,
+		serve_socket *conn, const char *p, const char *end) {
+	const char *q, *eol;
+	profile_mark mark;
+
+	while (p < end) {
+		q = NextQuery(p, end);
+		if (q > p) {
+			PROFILE_BEGIN(mark);
+			pthread_mutex_lock(&shard->lock);
+			if (!shard->layout.ready && (p = columns_setup(&shard->layout, p, q))
+					== NULL)
+				p = q;
+			shard->skipped += columns_group_accept(&shard->layout, &shard->groups,
+					p, q);
+			pthread_mutex_unlock(&shard->lock);
+			PROFILE_END(PROFILE_PARSE, mark);
+		}
+		if (q == end)
+			break;
+		if ((eol = memchr(q, '\n', end - q)) == NULL)
+			eol = end;
+		if (conn != NULL)
+			ServeQuery(pool, conn, q, eol);
+		p = eol < end ? eol + 1 : end;
+	}
+}
+
+/*
+-- Accumulate whole binary records: a key length byte, the key and a
+-- value in the input format. A record with an empty key is a query.
+-- Returns the bytes used.
+*/
+static size_t ServeBinary(serve_pool *pool, serve_shard *shard,
+		serve_socket *conn, const char *p, const char *end) {
+	size_t recsize = input_record_size(&inputFormat), klen;
+	const char *start = p;
+	profile_mark mark;
+	double x;
+
+	PROFILE_BEGIN(mark);
+	pthread_mutex_lock(&shard->lock);
+	while (end - p >= 1 && (size_t)(end - p) >= 1 + (klen =
+			(unsigned char)*p) + recsize) {
+		input_decode(&inputFormat, p + 1 + klen, 1, &x);
+		if (klen > 0) {
+			columns_group_add(&shard->groups, p + 1, klen, x);
+		} else if (conn != NULL && x >= QUERY_SNAPSHOT && x <= QUERY_DRAIN) {
+			columns_group_flush(&shard->groups);
+			pthread_mutex_unlock(&shard->lock);
+			ServeSnapshot(pool, conn, x != QUERY_RESET, x != QUERY_SNAPSHOT);
+			if (x == QUERY_RESET)
+				ServeQueue(conn, "\n", 1);
+			pthread_mutex_lock(&shard->lock);
+		} else {
+			shard->skipped++;
+		}
+		p += 1 + klen + recsize;
+	}
+	columns_group_flush(&shard->groups);
+	pthread_mutex_unlock(&shard->lock);
+	PROFILE_END(PROFILE_PARSE, mark);
+	return p - start;
+}
+
+/*
+-- Handle the whole lines or records at the start of conn->buf, keeping
+-- an unfinished one for the next read; when last, a final line without
+-- a newline is handled as well.
+*/
+static void ServeConsume(serve_pool *pool, serve_shard *shard,
+		serve_socket *conn, BOOL last) {
+	size_t used;
+
+	if (inputFormat.type != INPUT_TEXT) {
+		used = ServeBinary(pool, shard, conn, conn->buf, conn->buf + conn->len);
+	} else {
+		used = conn->len;
+		while (!last && used > 0 && conn->buf[used - 1] != '\n')
+			used--;
+		ServeText(pool, shard, conn, conn->buf, conn->buf + used);
+	}
+	memmove(conn->buf, conn->buf + used, conn->len - used);
+	conn->len -= used;
+}
+
+/*
+-- Handle what has arrived on a connection; FALSE once it is closed.
+-- Lines are handled after every read, so only one that has not ended
+-- yet is kept, and the buffer of SERVE_MAX_PENDING bytes at most
+-- limits it alone. Replies are sent before any more is read.
+*/
+static BOOL ServeRead(serve_pool *pool, serve_shard *shard,
+		serve_socket *conn) {
+	ssize_t n;
+
+	for (;;) {
+		if (conn->size - conn->len < SERVE_READ_SIZE &&
+				conn->size < SERVE_MAX_PENDING) {
+			conn->size = conn->size ? 2 * conn->size : 2 * SERVE_READ_SIZE;
+			if ((conn->buf = realloc(conn->buf, conn->size)) == NULL) {
+				fputs("-- Error: out of memory reading a connection.\n", stderr);
+				exit(1);
+			}
+		}
+		if (conn->len == conn->size) {
+			fputs("-- Warning: closed a connection whose line or record "
+					"is too long.\n", stderr);
+			return FALSE;
+		}
+		n = read(conn->fd, conn->buf + conn->len, conn->size - conn->len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return TRUE;
+		if (n <= 0)
+			break;
+		PROFILE_COUNT(n, 0);
+		conn->len += n;
+		ServeConsume(pool, shard, conn, FALSE);
+		if (conn->outlen > conn->sent)
+			return TRUE;
+	}
+	ServeConsume(pool, shard, conn, TRUE);
+	return FALSE;
+}
+
+static void ServeWatch(serve_shard *shard, serve_socket *s, int op,
+		unsigned events) {
+	struct epoll_event ev;
+
+	ev.events = events;
+	ev.data.ptr = s;
+	if (epoll_ctl(shard->epoll, op, s->fd, &ev) != 0) {
+		perror("-- Error: could not watch a socket");
+		exit(1);
+	}
+	s->events = events;
+}
+
+/*
+-- Send the replies queued on a connection as far as it takes them
+-- without blocking, and watch it for room rather than input until they
+-- are all sent. FALSE once the connection is to be closed.
+*/
+static BOOL ServeSend(serve_shard *shard, serve_socket *conn) {
+	unsigned events;
+	ssize_t n;
+
+	while (conn->sent < conn->outlen) {
+		n = write(conn->fd, conn->out + conn->sent, conn->outlen - conn->sent);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (n < 0)
+			return FALSE;  /* the client went away */
+		conn->sent += n;
+	}
+	if (conn->sent == conn->outlen) {
+		conn->sent = conn->outlen = 0;
+		if (conn->ended)
+			return FALSE;
+	}
+	events = conn->outlen > 0 ? EPOLLOUT : EPOLLIN;
+	if (events != conn->events)
+		ServeWatch(shard, conn, EPOLL_CTL_MOD, events);
+	return TRUE;
+}
+
+static void *ServeWorker(void *arg) {
+	serve_worker *w = arg;
+	serve_shard *shard = w->shard;
+	struct epoll_event events[SERVE_EVENTS];
+	serve_socket *s, *conn;
+	int i, n, fd;
+	ssize_t len;
+
+	for (;;) {
+		n = epoll_wait(shard->epoll, events, SERVE_EVENTS, -1);
+		for (i = 0; i < n; i++) {
+			s = events[i].data.ptr;
+			switch (s->kind) {
+			 case SERVE_LISTENER:
+				while ((fd = accept(s->fd, NULL, NULL)) >= 0) {
+					fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+					if ((conn = calloc(1, sizeof(*conn))) == NULL) {
+						fputs("-- Error: out of memory accepting a connection.\n",
+								stderr);
+						exit(1);
+					}
+					conn->fd = fd;
+					conn->kind = SERVE_CONNECTION;
+					ServeWatch(shard, conn, EPOLL_CTL_ADD, EPOLLIN);
+				}
+				break;
+
+			 case SERVE_DATAGRAM:
+				while ((len = recv(s->fd, shard->datagram, SERVE_READ_SIZE,
+						MSG_DONTWAIT)) >= 0) {
+					PROFILE_COUNT(len, 0);
+					if (inputFormat.type != INPUT_TEXT)
+						ServeBinary(w->pool, shard, NULL, shard->datagram,
+								shard->datagram + len);
+					else
+						ServeText(w->pool, shard, NULL, shard->datagram,
+								shard->datagram + len);
+				}
+				break;
+
+			 default:
+				if (s->events == EPOLLIN && !ServeRead(w->pool, shard, s))
+					s->ended = TRUE;
+				if (!ServeSend(shard, s)) {
+					close(s->fd);  /* which also stops watching it */
+					free(s->buf);
+					free(s->out);
+					free(s);
+				}
+				break;
+			}
+		}
+	}
+	return NULL;
+}
+
+/*
+-- Serve until SIGINT or SIGTERM, then display what was received since
+-- the last reset. Listening sockets are shared by every worker's epoll
+-- set, and EPOLLEXCLUSIVE wakes only one worker per connection.
+*/
+void ServeStats(void) {
+	serve_pool pool;
+	serve_worker *workers;
+	serve_socket *listeners;
+	pthread_t thread;
+	sigset_t stop;
+	uint64 skipped = 0;
+	int i, j, sig;
+
+	pool.nshards = numThreads;
+	pool.shards = calloc(pool.nshards, sizeof(serve_shard));
+	workers = calloc(pool.nshards, sizeof(serve_worker));
+	listeners = calloc(numServeAddrs, sizeof(serve_socket));
+	if (pool.shards == NULL || workers == NULL || listeners == NULL) {
+		fputs("-- Error: out of memory starting the server.\n", stderr);
+		exit(1);
+	}
+	pthread_mutex_init(&pool.query, NULL);
+	for (i = 0; i < numServeAddrs; i++) {
+		if (net_is_datagram(serveAddrs[i])) {
+			listeners[i].fd = net_bind(serveAddrs[i]);
+			listeners[i].kind = SERVE_DATAGRAM;
+		} else {
+			listeners[i].fd = net_listen(serveAddrs[i]);
+			listeners[i].kind = SERVE_LISTENER;
+		}
+		fcntl(listeners[i].fd, F_SETFL, fcntl(listeners[i].fd, F_GETFL) |
+				O_NONBLOCK);
+	}
+
+	/* Only the main thread takes the signals to stop. */
+	signal(SIGPIPE, SIG_IGN);
+	sigemptyset(&stop);
+	sigaddset(&stop, SIGINT);
+	sigaddset(&stop, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &stop, NULL);
+	for (i = 0; i < pool.nshards; i++) {
+		serve_shard *shard = &pool.shards[i];
+
+		pthread_mutex_init(&shard->lock, NULL);
+		columns_group_init(&shard->groups, quantileMode, compactMode);
+		columns_copy_options(&shard->layout, &columnLayout);
+		if ((shard->epoll = epoll_create1(0)) < 0) {
+			perror("-- Error: could not create an epoll set");
+			exit(1);
+		}
+		if ((shard->datagram = malloc(SERVE_READ_SIZE)) == NULL) {
+			fputs("-- Error: out of memory starting the server.\n", stderr);
+			exit(1);
+		}
+		for (j = 0; j < numServeAddrs; j++)
+			ServeWatch(shard, &listeners[j], EPOLL_CTL_ADD,
+					EPOLLIN | EPOLLEXCLUSIVE);
+		workers[i].pool = &pool;
+		workers[i].shard = shard;
+		if (pthread_create(&thread, NULL, ServeWorker, &workers[i]) != 0) {
+			fputs("-- Error: could not start a server thread.\n", stderr);
+			exit(1);
+		}
+		pthread_detach(thread);
+	}
+
+	while (sigwait(&stop, &sig) != 0)
+		;
+	for (i = 0; i < numServeAddrs; i++) {
+		close(listeners[i].fd);
+		if (strncmp(serveAddrs[i], "unix:", 5) == 0)
+			unlink(serveAddrs[i] + 5);
+	}
+	ServeSnapshot(&pool, NULL, TRUE, FALSE);
+	for (i = 0; i < pool.nshards; i++) {
+		pthread_mutex_lock(&pool.shards[i].lock);
+		skipped += pool.shards[i].skipped;
+		pthread_mutex_unlock(&pool.shards[i].lock);
+	}
+	if (skipped > 0)
+		fprintf(stderr, "-- Warning: skipped %llu malformed lines or records.\n",
+				(unsigned long long)skipped);
+}
+
+/* Display the current window, then start the next tumbling window. */
+static void EmitWindow(accumulator *acc) {
+	stats_data *stats = &acc->stats;
+	profile_mark mark;
+
+	if (windowSize > 0) {
+		if (!window_full(&acc->window) && acc->pending > 0)
+			return;
+		stats = window_stats(&acc->window);
+	}
+	/* A row of one value, as with --every=1, has no spread. */
+	if (stats_count(stats) > 0) {
+		PROFILE_BEGIN(mark);
+		DisplayStats(NULL, stats, &acc->sketch);
+		PROFILE_END(PROFILE_OUTPUT, mark);
+		acc->emitted = TRUE;
+	}
+	acc->pending = 0;
+	if (windowSize == 0) {
+		stats_init(&acc->stats);
+		sketch_free(&acc->sketch);
+	}
+}
+
+static void AccumWindowed(accumulator *acc, const double *xs, size_t n) {
+	profile_mark mark;
+	size_t i;
+
+	PROFILE_BEGIN(mark);
+	PROFILE_COUNT(0, n);
+	for (i = 0; i < n; i++) {
+		if (windowSize > 0) {
+			window_add(&acc->window, xs[i]);
+		} else {
+			stats_update(&acc->stats, xs[i]);
+			if (quantileMode != SKETCH_NONE)
+				sketch_add(&acc->sketch, xs[i]);
+		}
+		acc->pending++;
+		if (windowEvery > 0 ? acc->pending >= windowEvery :
+				windowInterval == 0.0 && window_full(&acc->window))
+			EmitWindow(acc);
+	}
+	PROFILE_END(PROFILE_ACCUMULATE, mark);
+}
+
+static double Now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+/*
+-- Summarize a stream window by window. With --interval, waiting for
+-- input is bounded so rows still appear on time when the input stalls.
+*/
+void ComputeWindowStats(FILE *in) {
+	accumulator   acc;
+	input_stream  input;
+	const char    *p, *end;
+	double        deadline = Now() + windowInterval, now;
+	profile_mark  mark;
+
+	memset(&acc, 0, sizeof(acc));
+	stats_init(&acc.stats);
+	sketch_init(&acc.sketch, quantileMode == SKETCH_EXACT);
+	if (windowSize > 0)
+		window_init(&acc.window, windowSize,
+				quantileMode != SKETCH_NONE ? &acc.sketch : NULL);
+
+	if (input_open(&input, in, inputFormat.compressed) != 0)
+		exit(1);
+	input_set_record_size(&input, input_record_size(&inputFormat));
+	DisplayHeadings();
+	for (;;) {
+		/* Rows are written out whenever the input makes us wait. */
+		if (!input_poll(&input, 0))
+			output_flush();
+		if (windowInterval > 0.0) {
+			now = Now();
+			if (now >= deadline ||
+					!input_poll(&input, (int)(1000 * (deadline - now)) + 1)) {
+				EmitWindow(&acc);
+				while (deadline <= Now())
+					deadline += windowInterval;
+				continue;
+			}
+		}
+		PROFILE_BEGIN(mark);
+		if (!input_next(&input, &p, &end))
+			break;
+		PROFILE_END(PROFILE_READ, mark);
+		PROFILE_COUNT(end - p, 0);
+		PROFILE_BEGIN(mark);
+		if (inputFormat.type == INPUT_TEXT)
+			AccumulateText(&acc, p, end);
+		else
+			AccumulateBinary(&acc, p, end);
+		PROFILE_END(PROFILE_PARSE, mark);
+	}
+	PROFILE_END(PROFILE_READ, mark);
+	input_close(&input);
+
+	/* Show what is left over, or the only window of a short input. */
+	if (acc.pending > 0 && (windowSize == 0 || !acc.emitted)) {
+		acc.pending = 0;
+		EmitWindow(&acc);
+	}
+	if (!acc.emitted) {
+		fputs("-- Error: need at least two numbers as input.\n", stderr);
+		exit(1);
+	}
+	if (windowSize > 0)
+		window_free(&acc.window);
+	sketch_free(&acc.sketch);
+}
 
-#define MIN(x,y)	((x) < (y) ? (x) : (y))
-#define MAX(x,y)	((x) > (y) ? (x) : (y))
+/* Whether the mean is known to within targetHWidth percent, at every level. */
+static BOOL TargetReached(accumulator *acc) {
+	double hwidth[MAX_LEVELS], mean;
+	stats_data stats;
+	int i;
 
-const char helpString[] = {
-	"--- Usage: %s [options] [files]\n"
-	"\n"
-	"  General options:\n"
-	"    -b\tset bit-mode (default off)\n"
-	"    -h\thelp (default off)\n"
-	"    -f\tformat to use for displaying output\n"
-	"    -l#\tset confidence level (default # = 0.95)\n"
-	"    -t\tuse the T distribution to compute standard error (default < 30)\n"
-	"    -z\tuse the Z distribution to compute standard error (default >= 30)"
-	"\n\n"
-	"  Display options:\n"
-	"    -a\taverage (default on)\n"
-	"    -c\tcount (default on)\n"
-	"    -d\tstandard deviation (default on)\n"
-	"    -e\tstandard error (default off)\n"
-	"    -m\tmaximum (default on)\n"
-	"    -n\tminimum (default on)\n"
-	"    -p\tconfidence interval half-width in percent (default on)"
-	"\n"
-	"    -s\tsum (default off)\n"
-	"    -v\tvariance (default on)\n"
-	"    -w\tconfidence interval half-width (default on)\n"
-	"    -x\tdo not display column headings (default off)\n"
-	"\n"
-	"  If files are not specified, input with be from stdin.\n"
-	"\n"
-	"  Choosing specific display options supresses the automatic\n"
-	"  display of values (by default, headings are displayed).\n"
-	"\n"
-	"  By Matt Storch and Mark Gardner {storch,mkgardne}@cs.uiuc.edu."
-	"\n\n"
-};
+	if (preciseMode)
+		stats_precise_result(&acc->precise, &stats);
+	else
+		stats = acc->stats;
+	mean = stats_mean(&stats);
+	if (stats_count(&stats) < TARGET_MIN || mean == 0.0)
+		return FALSE;
+	HalfWidths(&stats, hwidth);
+	for (i = 0; i < numLevels; i++) {
+		if (100.0 * hwidth[i] / fabs(mean) > targetHWidth)
+			return FALSE;
+	}
+	return TRUE;
+}
 
-void ComputeStats(FILE *in);
-double Z(double p);
-double T(double p, int ndf);
-void GetOptions(int argc, char *const argv[]);
-void DisplayHeadings(void);
-void DisplayValues(long cnt, double sum, double min, double max, double avg, 
-   double var, double stddev, double stderror, double hwidth, double phwidth);
+static size_t BitReverse(size_t i, int bits) {
+	size_t r = 0;
+	int j;
 
-BOOL bit_mode, displayAll, displayAverage, displayCount;
-BOOL displayStdDev, displayStdErr, displayHeading;
-BOOL displayMax, displayMin, displayPercentHalfWidth;
-BOOL displaySum, displayVariance, displayHalfWidth, useT, useZ;
-double confidenceLevel;
+	for (j = 0; j < bits; j++)
+		r |= ((i >> j) & 1) << (bits - 1 - j);
+	return r;
+}
 
-int debug = 0;
+/* Start of the first record or line at or after offset. */
+static const char *BlockStart(const char *base, size_t len, size_t offset,
+		size_t recsize) {
+	const char *p;
 
-int main(int argc, char *const argv[]) {
-	GetOptions(argc, argv);
-	if (optind == argc) {
-		ComputeStats(stdin);
-  } else {
-		int i, saw_stdin = 0;
-		for (i = optind; i < argc; i++) {
-			if (!saw_stdin && strncmp(argv[i], "-", 1) == 0) {
-				saw_stdin = 1;
-				ComputeStats(stdin);
-			} else {
-				FILE *in = fopen(argv[i], "r");
-				if (in == NULL) {
-					fprintf(stderr, "-- Error: could not open file '%s' for reading.\n",
-							argv[optind]);
-					exit(-1);
+	if (offset == 0 || offset >= len)
+		return base + MIN(offset, len);
+	if (recsize > 0)
+		return base + offset - offset % recsize;
+	p = memchr(base + offset - 1, '\n', len - offset + 1);
+	return p == NULL ? base + len : p + 1;
+}
+
+/*
+-- Accumulate a mapped input in blocks until the target is reached. The
+-- blocks are taken in bit-reversed order, which strides across the
+-- input ever more finely. It only stops after a power of two of them,
+-- at least TARGET_BLOCKS, when the blocks read are evenly spaced over
+-- all of the input rather than being its beginning. Returns the bytes
+-- that were read.
+*/
+static size_t AccumulateSampled(accumulator *acc, const char *base,
+		size_t len) {
+	size_t recsize = input_record_size(&inputFormat);
+	size_t nblocks = len / SAMPLE_BLOCK + 1, span = 1, i, b, done = 0;
+	size_t page = (size_t)getpagesize(), ahead;
+	const char *p, *end;
+	uintptr_t at;
+	int bits = 0;
+
+	while (span < nblocks)
+		span <<= 1, bits++;
+	for (i = 0; i < span; i++) {
+		if ((b = BitReverse(i, bits)) < nblocks) {
+			/* Ask for the next block while this one is parsed. */
+			ahead = BitReverse(i + 1, bits) * SAMPLE_BLOCK;
+			if (i + 1 < span && ahead < len) {
+				at = (uintptr_t)(base + ahead) & ~(uintptr_t)(page - 1);
+				madvise((void *)at, MIN(SAMPLE_BLOCK, len - ahead), MADV_WILLNEED);
+			}
+			p = BlockStart(base, len, b * SAMPLE_BLOCK, recsize);
+			end = BlockStart(base, len, (b + 1) * SAMPLE_BLOCK, recsize);
+			AccumRegion(acc, p, end);
+			done += end - p;
+		}
+		if (i + 1 >= TARGET_BLOCKS && ((i + 1) & i) == 0 && TargetReached(acc))
+			break;
+	}
+	return done;
+}
+
+/*
+-- Accumulate an opened input into acc, reading columns with the given
+-- layout and using nthreads on mapped files. Returns FALSE if the input
+-- held nothing (acc is then left uninitialized). The input is closed.
+*/
+static BOOL AccumulateStream(input_stream *in, accumulator *acc,
+		column_layout *layout, int nthreads, BOOL checkpoints) {
+	const char    *p, *end, *next;
+	BOOL          started = FALSE;
+	double        checkpoint = Now() + checkpointInterval;
+	size_t        done, recsize = columnMode ? 0 : input_record_size(&inputFormat);
+	profile_mark  mark;
+
+	if (columnMode)
+		input_set_line_mode(in);
+	else
+		input_set_record_size(in, recsize);
+
+	/* In column mode nothing can be set up before the first line is seen. */
+	for (;;) {
+		PROFILE_BEGIN(mark);
+		if (!input_next(in, &p, &end))
+			break;
+		PROFILE_END(PROFILE_READ, mark);
+		PROFILE_COUNT(end - p, 0);
+		if (columnMode && !layout->ready &&
+				(p = columns_setup(layout, p, end)) == NULL)
+			continue;
+		if (!started) {
+			AccumInit(acc, layout);
+			started = TRUE;
+		}
+		if (targetHWidth > 0.0 && in->map != NULL) {
+			if ((done = AccumulateSampled(acc, p, end - p)) < (size_t)(end - p))
+				fprintf(stderr, "-- Warning: mean within %g%% after reading "
+						"%.1f%% of the input.\n", targetHWidth,
+						100.0 * done / (end - p));
+		} else if (in->map != NULL && checkpoints && checkpointInterval > 0.0) {
+			/* A mapped file is a single read; check the time between parts. */
+			for (; p < end; p = next) {
+				next = BlockStart(p, end - p, CHECKPOINT_BLOCK, recsize);
+				if (nthreads > 1 && batchMeans == 0)
+					AccumulateParallel(acc, p, next - p, nthreads);
+				else
+					AccumRegion(acc, p, next);
+				if (next < end && Now() >= checkpoint) {
+					Checkpoint(acc);
+					checkpoint = Now() + checkpointInterval;
 				}
-				ComputeStats(in);
-				fclose(in);
 			}
+		} else if (nthreads > 1 && in->map != NULL && batchMeans == 0) {
+			AccumulateParallel(acc, p, end - p, nthreads);
+		} else {
+			AccumRegion(acc, p, end);
 		}
-  }
+		if (targetHWidth > 0.0 && in->map == NULL && TargetReached(acc)) {
+			fprintf(stderr, "-- Warning: mean within %g%%, the rest of the "
+					"input was not read.\n", targetHWidth);
+			break;
+		}
+		if (checkpoints && checkpointInterval > 0.0 && Now() >= checkpoint) {
+			Checkpoint(acc);
+			checkpoint = Now() + checkpointInterval;
+		}
+	}
+	PROFILE_END(PROFILE_READ, mark);
+	input_close(in);
+	return started;
+}
 
-  return 0;
+static BOOL AccumulateInput(FILE *in, accumulator *acc,
+		column_layout *layout, int nthreads, BOOL checkpoints) {
+	input_stream  input;
+
+	if (input_open(&input, in, inputFormat.compressed) != 0)
+		exit(1);
+	return AccumulateStream(&input, acc, layout, nthreads, checkpoints);
+}
+
+/* Display an accumulated input, or fold it into the saved state. */
+static void FinishInput(accumulator *acc, column_layout *layout,
+		BOOL started, const char *label) {
+	profile_mark mark;
+
+	/* With saved state, inputs are only displayed once all are read. */
+	if (stateMode) {
+		if (started) {
+			AccumToState(acc, &savedState);
+			PROFILE_COUNT(0, AccumTotal(acc));
+			AccumFree(acc);
+		}
+		if (columnMode)
+			columns_reset(layout);
+		return;
+	}
+	if (!started) {
+		fputs("-- Error: need at least two numbers as input.\n", stderr);
+		exit(1);
+	}
+	PROFILE_BEGIN(mark);
+	DisplayAccum(acc, headingsOnce ? label : NULL);
+	PROFILE_END(PROFILE_OUTPUT, mark);
+	if (compareMode)
+		CompareRecord(acc, label);
+	if (allMode)
+		AccumToState(acc, &allState);
+	PROFILE_COUNT(0, AccumTotal(acc));
+	AccumFree(acc);
+	if (columnMode)
+		columns_reset(layout);
 }
 
 void ComputeStats(FILE *in) {
-	int i, size;
-  double n;
-  double sum, avg, var;
-  double min, max;
-	double stdev, stderror, hwidth;
+	accumulator   acc;
+	BOOL          started;
 
-	stats_data  stats;
+	if (windowMode) {
+		ComputeWindowStats(in);
+		return;
+	}
+	started = AccumulateInput(in, &acc, &columnLayout, numThreads, TRUE);
+	FinishInput(&acc, &columnLayout, started, currentLabel);
+}
 
-	stats_init(&stats);
+/* A file summarized by the pool, kept until its turn to be displayed. */
+typedef struct file_job {
+	const char    *path;
+	accumulator    acc;
+	column_layout  layout;
+	BOOL           started;
+	BOOL           missing;  /* could not be opened */
+	BOOL           done;
+} file_job;
 
-	fscanf(in, "%lf", &n);
-  while (!feof(in)) {
-		stats_update(&stats, n);
-		fscanf(in, "%lf", &n);
-  }
+typedef struct file_pool {
+	file_job      *jobs;
+	aread         *reader;   /* reads the files ahead, in any order */
+	int            nfiles;
+	int            next;     /* file to be taken next, if not read ahead */
+	int            nworkers;
+	pthread_mutex_t lock;
+	pthread_cond_t  finished;
+} file_pool;
 
-	size = stats_count(&stats);
-  if (size < 2) {
-		fputs("-- Error: need at least two numbers as input.\n", stderr);
+/* Take the next file not yet taken; -1 if none. */
+static int TakeJob(file_pool *pool) {
+	int job = -1;
+
+	pthread_mutex_lock(&pool->lock);
+	if (pool->next < pool->nfiles)
+		job = pool->next++;
+	pthread_mutex_unlock(&pool->lock);
+	return job;
+}
+
+static void *FileWorker(void *arg) {
+	file_pool *pool = arg;
+	file_job *job;
+	input_stream input;
+	profile_mark mark;
+	char *data = NULL;
+	size_t len = 0;
+	FILE *in;
+	int j;
+
+	for (;;) {
+		if (pool->reader != NULL) {
+			PROFILE_BEGIN(mark);
+			j = aread_next(pool->reader, &data, &len);
+			PROFILE_END(PROFILE_READ, mark);
+		} else {
+			j = TakeJob(pool);
+		}
+		if (j < 0)
+			break;
+
+		job = &pool->jobs[j];
+		columns_copy_options(&job->layout, &columnLayout);
+		if (data != NULL) {
+			input_open_memory(&input, data, len, inputFormat.compressed);
+			job->started = AccumulateStream(&input, &job->acc, &job->layout, 1,
+					FALSE);
+			aread_release(pool->reader, data, len);
+			data = NULL;
+		} else if ((in = strcmp(job->path, "-") == 0 ? stdin :
+				fopen(job->path, "r")) == NULL) {
+			job->missing = TRUE;
+		} else {
+			job->started = AccumulateInput(in, &job->acc, &job->layout, 1, FALSE);
+			if (in != stdin)
+				fclose(in);
+		}
+
+		pthread_mutex_lock(&pool->lock);
+		job->done = TRUE;
+		pthread_cond_broadcast(&pool->finished);
+		pthread_mutex_unlock(&pool->lock);
+	}
+	return NULL;
+}
+
+/*
+-- Summarize several files at once on a pool of numThreads workers.
+-- With no more files than workers, each takes the next file not yet
+-- taken, which is one file each unless a thread could not be started.
+-- With more, small files are read ahead (aread.h) and taken in the order
+-- their reads complete, keeping many reads in flight at once, so a few
+-- huge files do not hold up the rest. Results are displayed in the
+-- order of the files.
+*/
+void ComputeFiles(int nfiles, char *const paths[]) {
+	file_pool pool;
+	pthread_t *threads;
+	int i, *started;
+	double checkpoint = Now() + checkpointInterval;
+
+	pool.nworkers = MIN(numThreads, nfiles);
+	pool.jobs = calloc(nfiles, sizeof(file_job));
+	threads = calloc(pool.nworkers, sizeof(pthread_t));
+	started = calloc(pool.nworkers, sizeof(int));
+	if (pool.jobs == NULL || threads == NULL || started == NULL) {
+		fputs("-- Error: out of memory allocating threads.\n", stderr);
 		exit(1);
-  }
+	}
+	pthread_mutex_init(&pool.lock, NULL);
+	pthread_cond_init(&pool.finished, NULL);
+	for (i = 0; i < nfiles; i++)
+		pool.jobs[i].path = paths[i];
+	pool.nfiles = nfiles;
+	pool.next = 0;
+	pool.reader = nfiles > pool.nworkers ? aread_start(nfiles, paths) : NULL;
+	for (i = 0; i < pool.nworkers; i++)
+		started[i] = pthread_create(&threads[i], NULL, FileWorker, &pool) == 0;
+	if (!started[0])
+		FileWorker(&pool);
+
+	for (i = 0; i < nfiles; i++) {
+		pthread_mutex_lock(&pool.lock);
+		while (!pool.jobs[i].done)
+			pthread_cond_wait(&pool.finished, &pool.lock);
+		pthread_mutex_unlock(&pool.lock);
+		if (pool.jobs[i].missing) {
+			fprintf(stderr, "-- Error: could not open file '%s' for reading.\n",
+					paths[i]);
+			exit(-1);
+		}
+		FinishInput(&pool.jobs[i].acc, &pool.jobs[i].layout,
+				pool.jobs[i].started, paths[i]);
+		if (stateMode && checkpointInterval > 0.0 && Now() >= checkpoint) {
+			SaveState(&savedState, saveStatePath);
+			checkpoint = Now() + checkpointInterval;
+		}
+	}
 
-	avg = stats_mean(&stats);
-	sum = size * avg;
-	min = stats_min(&stats);
-	max = stats_max(&stats);
-	var = stats_variance(&stats);
-	stdev = stats_stdev(&stats);
-	stderror = stats_stderr(&stats);
-	hwidth = stats_confidence(&stats, confidenceLevel);
+	for (i = 0; i < pool.nworkers; i++)
+		if (started[i])
+			pthread_join(threads[i], NULL);
+	if (pool.reader != NULL)
+		aread_stop(pool.reader);
+	pthread_cond_destroy(&pool.finished);
+	pthread_mutex_destroy(&pool.lock);
+	free(started);
+	free(threads);
+	free(pool.jobs);
+}
 
-	DisplayHeadings();
-  DisplayValues(size, sum, min, max, avg, var, 
-								stdev, stderror, hwidth, 100 * hwidth / avg);
+/* Long options without a short equivalent use values beyond any char. */
+#define OPT_INPUT_FORMAT	256
+#define OPT_DELIMITER			257
+#define OPT_GROUP_BY			258
+#define OPT_PERCENTILES		259
+#define OPT_EXACT					260
+#define OPT_WINDOW				261
+#define OPT_EVERY					262
+#define OPT_INTERVAL			263
+#define OPT_SAVE_STATE		264
+#define OPT_LOAD_STATE		265
+#define OPT_CHECKPOINT		266
+#define OPT_MERGE					267
+#define OPT_EXPECT				268
+#define OPT_ALL						269
+#define OPT_PRECISE				270
+#define OPT_HISTOGRAM			271
+#define OPT_PROFILE				272
+#define OPT_SERVE					273
+#define OPT_COMPACT				274
+#define OPT_MEM_LIMIT			275
+#define OPT_TARGET_HWIDTH	276
+#define OPT_BATCH_MEANS		277
+#define OPT_COMPARE				278
+
+static const struct option longOptions[] = {
+	{ "input-format", required_argument, NULL, OPT_INPUT_FORMAT },
+	{ "delimiter",    required_argument, NULL, OPT_DELIMITER },
+	{ "group-by",     required_argument, NULL, OPT_GROUP_BY },
+	{ "percentiles",  required_argument, NULL, OPT_PERCENTILES },
+	{ "exact",        no_argument,       NULL, OPT_EXACT },
+	{ "mem-limit",    required_argument, NULL, OPT_MEM_LIMIT },
+	{ "window",       required_argument, NULL, OPT_WINDOW },
+	{ "every",        required_argument, NULL, OPT_EVERY },
+	{ "interval",     required_argument, NULL, OPT_INTERVAL },
+	{ "save-state",   required_argument, NULL, OPT_SAVE_STATE },
+	{ "load-state",   required_argument, NULL, OPT_LOAD_STATE },
+	{ "checkpoint",   required_argument, NULL, OPT_CHECKPOINT },
+	{ "merge",        no_argument,       NULL, OPT_MERGE },
+	{ "expect",       required_argument, NULL, OPT_EXPECT },
+	{ "all",          no_argument,       NULL, OPT_ALL },
+	{ "precise",      no_argument,       NULL, OPT_PRECISE },
+	{ "target-hwidth", required_argument, NULL, OPT_TARGET_HWIDTH },
+	{ "batch-means",  required_argument, NULL, OPT_BATCH_MEANS },
+	{ "compare",      no_argument,       NULL, OPT_COMPARE },
+	{ "histogram",    optional_argument, NULL, OPT_HISTOGRAM },
+	{ "profile",      no_argument,       NULL, OPT_PROFILE },
+	{ "serve",        required_argument, NULL, OPT_SERVE },
+	{ "compact",      no_argument,       NULL, OPT_COMPACT },
+	{ NULL, 0, NULL, 0 }
+};
+
+static int CompareDoubles(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+/* Parse a list of percentiles such as "50,99.9" into sorted quantiles. */
+static int ParsePercentiles(const char *list) {
+	const char *p = list;
+	char *stop;
+
+	numQuantiles = 0;
+	do {
+		double pct = strtod(p, &stop);
+		if (stop == p || pct < 0.0 || pct > 100.0 ||
+				numQuantiles == MAX_QUANTILES || (*stop != ',' && *stop != '\0'))
+			return -1;
+		quantiles[numQuantiles++] = pct / 100.0;
+		p = stop + 1;
+	} while (*stop == ',');
+	qsort(quantiles, numQuantiles, sizeof(double), CompareDoubles);
+	return 0;
+}
+
+/* Add a list of confidence levels such as "0.9,0.99" to those displayed. */
+static int ParseLevels(const char *list) {
+	const char *p = list;
+	char *stop;
+	int i;
+
+	do {
+		double level = strtod(p, &stop);
+		if (stop == p || level < 0.0 || level > 1.0 ||
+				(*stop != ',' && *stop != '\0'))
+			return -1;
+		for (i = 0; i < numLevels && criticalValues[i].level != level; i++)
+			;
+		if (i == numLevels) {
+			if (numLevels == MAX_LEVELS)
+				return -1;
+			stats_critical_init(&criticalValues[numLevels++], level);
+		}
+		p = stop + 1;
+	} while (*stop == ',');
+	return 0;
 }
 
 void ShowUsage(const char *progname) {
@@ -142,7 +2208,8 @@ void ShowUsage(const char *progname) {
 
 void GetOptions(int argc, char *const argv[]) {
   int errorCount = 0;
-  int c;
+  char *end;
+  int c, i, nstdin;
 
   bit_mode = FALSE;
   displayAll = TRUE;
@@ -157,12 +2224,44 @@ void GetOptions(int argc, char *const argv[]) {
   displaySum = FALSE;
   displayVariance = FALSE;
   displayHalfWidth = FALSE;
-  confidenceLevel = 0.95;
+  numLevels = 0;
   useT = FALSE;
   useZ = FALSE;
+  numThreads = 1;
+  inputFormat.type = INPUT_TEXT;
+  inputFormat.swap = FALSE;
+  inputFormat.compressed = TRUE;
+  columnMode = FALSE;
+  groupMode = FALSE;
+  displayLabel = FALSE;
+  quantileMode = SKETCH_NONE;
+  numQuantiles = 0;
+  windowMode = FALSE;
+  windowSize = 0;
+  windowEvery = 0;
+  windowInterval = 0.0;
+  stateMode = FALSE;
+  saveStatePath = NULL;
+  numLoadStates = 0;
+  checkpointInterval = 0.0;
+  memLimit = 0.0;
+  targetHWidth = 0.0;
+  batchMeans = 0;
+  mergeMode = FALSE;
+  expectStates = 0;
+  allMode = FALSE;
+  preciseMode = FALSE;
+  serveMode = FALSE;
+  compactMode = FALSE;
+  compareMode = FALSE;
+  numServeAddrs = 0;
+  outputFormat = OUTPUT_TEXT;
+  histogramBits = -1;
+  headingsOnce = FALSE;
 
   opterr = 0; // disable getopt generated error msg
-  while ((c = getopt(argc, argv, "abcdehl:mnpstvwxz")) != -1) {
+  while ((c = getopt_long(argc, argv, "abcdef:hj:k:l:mnpqstvwxz", longOptions,
+                          NULL)) != -1) {
 	switch (c) {
 	 case 'a':
 	  displayAverage = TRUE;
@@ -171,6 +2270,9 @@ void GetOptions(int argc, char *const argv[]) {
 
 	 case 'b':
 	  bit_mode = TRUE;
+	  inputFormat.type = INPUT_F64;
+	  inputFormat.swap = FALSE;
+	  inputFormat.compressed = FALSE;
 	  break;
 
 	 case 'c':
@@ -188,12 +2290,30 @@ void GetOptions(int argc, char *const argv[]) {
 	  displayAll = FALSE;
 	  break;
 
+	 case 'j':
+	  numThreads = atoi(optarg);
+	  if (numThreads == 0)
+			numThreads = sysconf(_SC_NPROCESSORS_ONLN);
+	  if (numThreads < 1) {
+			fprintf(stderr, "-- Error:  thread count must be positive "
+							"(not %s).\n", optarg);
+			errorCount++;
+	  }
+	  break;
+
+	 case 'k':
+	  columnMode = TRUE;
+	  if (columns_parse_list(&columnLayout, optarg) != 0) {
+			fprintf(stderr, "-- Error:  bad field list '%s'.\n", optarg);
+			errorCount++;
+	  }
+	  break;
+
 	 case 'l':
-	  confidenceLevel = atof(optarg);
-	  if (confidenceLevel < 0.0 || confidenceLevel > 1.0) {
+	  if (ParseLevels(optarg) != 0) {
 			fprintf(stderr, 
-							"-- Error:  confidence level must be between 0.0 and 1.0 "
-							"(not %d).\n", confidenceLevel);
+							"-- Error:  confidence levels must be between 0.0 and 1.0, "
+							"at most %d of them (not %s).\n", MAX_LEVELS, optarg);
 			errorCount++;
 	  }
 	  break;
@@ -213,6 +2333,11 @@ void GetOptions(int argc, char *const argv[]) {
 	  displayAll = FALSE;
 	  break;
 
+	 case 'q':
+	  if (numQuantiles == 0)
+			ParsePercentiles("50,90,99,99.9");
+	  break;
+
 	 case 's':
 	  displaySum = TRUE;
 	  displayAll = FALSE;
@@ -233,6 +2358,13 @@ void GetOptions(int argc, char *const argv[]) {
 	  displayAll = FALSE;
 	  break;
 
+	 case 'f':
+	  if ((outputFormat = output_format(optarg)) < 0) {
+			fprintf(stderr, "-- Error:  unknown output format '%s'.\n", optarg);
+			errorCount++;
+	  }
+	  break;
+
 	 case 'x':
 	  displayHeading = FALSE;
 	  break;
@@ -242,74 +2374,438 @@ void GetOptions(int argc, char *const argv[]) {
 	  useT = FALSE;
 	  break;
 
+	 case OPT_INPUT_FORMAT:
+	  if (input_parse_format(optarg, &inputFormat) != 0) {
+			fprintf(stderr, "-- Error:  unknown input format '%s'.\n", optarg);
+			errorCount++;
+	  }
+	  break;
+
+	 case OPT_DELIMITER:
+	  columnMode = TRUE;
+	  if (strcmp(optarg, "\\t") == 0 || strcmp(optarg, "tab") == 0)
+			columnLayout.delimiter = '\t';
+	  else if (strlen(optarg) == 1 && optarg[0] != '\n')
+			columnLayout.delimiter = optarg[0];
+	  else {
+			fprintf(stderr, "-- Error:  delimiter must be a single character "
+							"(not '%s').\n", optarg);
+			errorCount++;
+	  }
+	  break;
+
+	 case OPT_GROUP_BY:
+	  columnMode = groupMode = TRUE;
+	  columnLayout.keyfield = atoi(optarg);
+	  if (columnLayout.keyfield < 1) {
+			fprintf(stderr, "-- Error:  bad field number '%s'.\n", optarg);
+			errorCount++;
+	  }
+	  break;
+
+	 case OPT_PERCENTILES:
+	  if (ParsePercentiles(optarg) != 0) {
+			fprintf(stderr, "-- Error:  bad percentile list '%s'.\n", optarg);
+			errorCount++;
+	  }
+	  break;
+
+	 case OPT_EXACT:
+	  quantileMode = SKETCH_EXACT;
+	  break;
+
+	 case OPT_WINDOW:
+	 case OPT_EVERY:
+	 case OPT_INTERVAL:
+	  windowMode = TRUE;
+	  if (c == OPT_INTERVAL)
+			windowInterval = atof(optarg);
+	  else if (c == OPT_WINDOW)
+			windowSize = strtoull(optarg, NULL, 10);
+	  else
+			windowEvery = strtoull(optarg, NULL, 10);
+	  if (atof(optarg) <= 0.0) {
+			fprintf(stderr, "-- Error:  window length must be positive "
+							"(not %s).\n", optarg);
+			errorCount++;
+	  } else if (c != OPT_INTERVAL && (c == OPT_WINDOW ? windowSize :
+			windowEvery) == 0) {
+			fprintf(stderr, "-- Error:  a window holds at least one value "
+							"(not %s).\n", optarg);
+			errorCount++;
+	  }
+	  break;
+
+	 case OPT_SAVE_STATE:
+	  stateMode = TRUE;
+	  saveStatePath = optarg;
+	  break;
+
+	 case OPT_LOAD_STATE:
+	  stateMode = TRUE;
+	  if (numLoadStates == MAX_STATE_FILES) {
+			fprintf(stderr, "-- Error:  at most %d state files can be loaded.\n",
+					MAX_STATE_FILES);
+			errorCount++;
+	  } else {
+			loadStatePaths[numLoadStates++] = optarg;
+	  }
+	  break;
+
+	 case OPT_MEM_LIMIT:
+	  memLimit = strtod(optarg, &end);
+	  if (*end == 'K' || *end == 'k')
+			memLimit *= 1024, end++;
+	  else if (*end == 'M' || *end == 'm')
+			memLimit *= 1024 * 1024, end++;
+	  else if (*end == 'G' || *end == 'g')
+			memLimit *= 1024 * 1024 * 1024, end++;
+	  if (end == optarg || *end != '\0' || memLimit < 1 << 20) {
+			fprintf(stderr, "-- Error:  memory limit must be at least 1M "
+							"(not %s).\n", optarg);
+			errorCount++;
+	  }
+	  break;
+
+	 case OPT_CHECKPOINT:
+	  checkpointInterval = atof(optarg);
+	  if (checkpointInterval <= 0.0) {
+			fprintf(stderr, "-- Error:  checkpoint interval must be positive "
+							"(not %s).\n", optarg);
+			errorCount++;
+	  }
+	  break;
+
+	 case OPT_MERGE:
+	  mergeMode = TRUE;
+	  break;
+
+	 case OPT_ALL:
+	  allMode = TRUE;
+	  break;
+
+	 case OPT_PRECISE:
+	  preciseMode = TRUE;
+	  break;
+
+	 case OPT_BATCH_MEANS:
+	  batchMeans = atoi(optarg);
+	  if (batchMeans < 2 || batchMeans > STATS_MAX_BATCHES) {
+			fprintf(stderr, "-- Error:  batches must number 2 to %d (not %s).\n",
+					STATS_MAX_BATCHES, optarg);
+			errorCount++;
+	  }
+	  break;
+
+	 case OPT_TARGET_HWIDTH:
+	  targetHWidth = atof(optarg);
+	  if (targetHWidth <= 0.0) {
+			fprintf(stderr, "-- Error:  target half-width must be positive "
+							"(not %s).\n", optarg);
+			errorCount++;
+	  }
+	  break;
+
+	 case OPT_PROFILE:
+	  profile_init();
+	  break;
+
+	 case OPT_COMPACT:
+	  compactMode = TRUE;
+	  break;
+
+	 case OPT_COMPARE:
+	  compareMode = TRUE;
+	  break;
+
+	 case OPT_SERVE:
+	  serveMode = TRUE;
+	  if (!net_is_address(optarg) && !net_is_datagram(optarg)) {
+			fprintf(stderr, "-- Error:  '%s' is not a socket address.\n", optarg);
+			errorCount++;
+	  } else if (numServeAddrs == MAX_SERVE_ADDRS) {
+			fprintf(stderr, "-- Error:  at most %d addresses can be served.\n",
+					MAX_SERVE_ADDRS);
+			errorCount++;
+	  } else {
+			serveAddrs[numServeAddrs++] = optarg;
+	  }
+	  break;
+
+	 case OPT_HISTOGRAM: {
+	  long buckets = optarg != NULL ? strtol(optarg, NULL, 10) : 4;
+
+	  for (histogramBits = 0; histogramBits <= SKETCH_SUB_BITS &&
+			(1L << histogramBits) != buckets; histogramBits++)
+		;
+	  if (histogramBits > SKETCH_SUB_BITS) {
+			fprintf(stderr, "-- Error:  --histogram needs a power of two "
+							"from 1 to %d (not %s).\n", 1 << SKETCH_SUB_BITS, optarg);
+			histogramBits = -1;
+			errorCount++;
+	  }
+	  break;
+	 }
+
+	 case OPT_EXPECT:
+	  expectStates = strtoull(optarg, NULL, 10);
+	  if (expectStates == 0) {
+			fprintf(stderr, "-- Error:  --expect needs a positive count "
+							"(not %s).\n", optarg);
+			errorCount++;
+	  }
+	  break;
+
 	 default:
 	  errorCount++;
 	  break;
 	}
   }
+  if (numLevels == 0)
+	stats_critical_init(&criticalValues[numLevels++], 0.95);
+  if (numQuantiles == 0 && histogramBits < 0)
+	quantileMode = SKETCH_NONE;
+  else if (quantileMode == SKETCH_NONE)
+	quantileMode = SKETCH_APPROX;
+  columnLayout.quantiles = quantileMode;
+  if (windowMode && columnMode) {
+	fputs("-- Error:  windows apply to a single stream of values.\n", stderr);
+	errorCount++;
+  }
+  if (memLimit > 0 && quantileMode == SKETCH_APPROX) {
+	fputs("-- Error:  --mem-limit applies to --exact.\n", stderr);
+	errorCount++;
+  }
+  sketch_set_limit((size_t)memLimit);
+  sketch_set_threads(numThreads);
+  if (windowSize > 0 && quantileMode == SKETCH_EXACT) {
+	fputs("-- Error:  --exact cannot be combined with --window.\n", stderr);
+	errorCount++;
+  }
+  if (stateMode && windowMode) {
+	fputs("-- Error:  windows cannot be saved as state.\n", stderr);
+	errorCount++;
+  }
+  if (checkpointInterval > 0.0 && (saveStatePath == NULL ||
+		net_is_address(saveStatePath) || mergeMode)) {
+	fputs("-- Error:  --checkpoint needs --save-state to a file.\n", stderr);
+	errorCount++;
+  }
+  if (mergeMode && (windowMode || columnMode)) {
+	fputs("-- Error:  --merge takes its layout from the saved states.\n",
+			stderr);
+	errorCount++;
+  }
+  if (columnMode && inputFormat.type != INPUT_TEXT) {
+	fputs("-- Error:  fields can only be selected from text input.\n", stderr);
+	errorCount++;
+  }
+  if (histogramBits >= 0 && windowMode) {
+	fputs("-- Error:  --histogram cannot be combined with windows.\n", stderr);
+	errorCount++;
+  }
+  if (preciseMode && (columnMode || windowMode)) {
+	fputs("-- Error:  --precise applies to a single stream of values.\n",
+			stderr);
+	errorCount++;
+  }
+  if (targetHWidth > 0.0 && (columnMode || windowMode || mergeMode)) {
+	fputs("-- Error:  --target-hwidth applies to a single stream of values.\n",
+			stderr);
+	errorCount++;
+  }
+  if (batchMeans > 0 && (columnMode || windowMode || stateMode ||
+		mergeMode || allMode || targetHWidth > 0.0)) {
+	fputs("-- Error:  --batch-means needs a single stream, read in order.\n",
+			stderr);
+	errorCount++;
+  }
+  for (i = optind, nstdin = 0; i < argc; i++)
+	nstdin += strcmp(argv[i], "-") == 0;
+  if (nstdin > 1) {
+	fputs("-- Error:  stdin (\"-\") can only be read once.\n", stderr);
+	errorCount++;
+  }
+  if (compareMode && (columnMode || windowMode || stateMode || mergeMode ||
+		serveMode || argc - optind < 2)) {
+	fputs("-- Error:  --compare takes two or more files of single streams.\n",
+			stderr);
+	errorCount++;
+  }
+  if (serveMode && (windowMode || stateMode || mergeMode || allMode ||
+		preciseMode || optind < argc)) {
+	fputs("-- Error:  --serve takes no files, windows, states, --precise or "
+			"--all.\n", stderr);
+	errorCount++;
+  }
+  if (serveMode && outputFormat == OUTPUT_BINARY) {
+	fputs("-- Error:  --serve replies in text, tsv or json.\n", stderr);
+	errorCount++;
+  }
+  if (serveMode) {
+	/* The records are keyed values, in text or binary. */
+	columnMode = groupMode = TRUE;
+	if (columnLayout.keyfield == 0)
+		columnLayout.keyfield = 1;
+  }
+  if (compactMode && !groupMode) {
+	fputs("-- Error:  --compact applies to --group-by and --serve.\n", stderr);
+	errorCount++;
+  }
+  if (allMode && (stateMode || windowMode || mergeMode))
+	allMode = FALSE;  /* everything is summarized together anyway */
+
+  /*
+  -- A single stream needs the variance recurrence only for what is shown;
+  -- integers always get exact sums besides. Other modes keep stats_data.
+  */
+  needMoments = TRUE;
+  basicKind = BASIC_NONE;
+  if (!columnMode && !windowMode && !stateMode && !mergeMode && !allMode) {
+	needMoments = displayAll || displayVariance || displayStdDev ||
+		displayStdErr || displayHalfWidth || displayPercentHalfWidth ||
+		targetHWidth > 0.0 || batchMeans > 0 || compareMode;
+	if (inputFormat.type == INPUT_I32 || inputFormat.type == INPUT_I64)
+		basicKind = BASIC_I64;
+	else if (inputFormat.type == INPUT_U64)
+		basicKind = BASIC_U64;
+	else if (!needMoments && !preciseMode)
+		basicKind = inputFormat.type == INPUT_F32 && !inputFormat.swap &&
+			quantileMode == SKETCH_NONE ? BASIC_F32 : BASIC_F64;
+  }
+
+  /* Files are rows of one table when each is a single stream. */
+  headingsOnce = (allMode || compareMode) && !columnMode;
+  if (compareMode)
+	numThreads = MAX(numThreads, 2);  /* ComputeFiles() queues the rest */
+  displayLabel = columnMode || headingsOnce;
+  labelHeading = groupMode ? "Key" : columnMode ? "Column" : "File";
   if (errorCount != 0) {
 	ShowUsage(argv[0]);
 	exit(-1);
   }
+  SetupOutput(outputFormat);
 }
 
-void DisplayHeadings() {
-  if (displayHeading) {
-		if (displayAll || displayCount)
-			fprintf(stdout, " %*s", INT_WIDTH, "Count");
-		if (displaySum)
-			fprintf(stdout, " %*s", FLOAT_WIDTH, "Sum");
-		if (displayAll || displayMin)
-			fprintf(stdout, " %*s", FLOAT_WIDTH, "Min");
-		if (displayAll || displayMax)
-			fprintf(stdout, " %*s", FLOAT_WIDTH, "Max");
-		if (displayAll || displayAverage)
-			fprintf(stdout, " %*s", FLOAT_WIDTH, "Avg");
-		if (displayVariance)
-			fprintf(stdout, " %*s", FLOAT_WIDTH, "Var");
-		if (displayAll || displayStdDev)
-			fprintf(stdout, " %*s", FLOAT_WIDTH, "StdDev");
-		if (displayStdErr)
-			fprintf(stdout, " %*s", FLOAT_WIDTH, "StdErr");
+void DisplayStats(const char *label, stats_data *stats, sketch *sk) {
+	DisplayMoments(label, stats, stats, sk);
+}
+
+/* As DisplayStats(), with the standard error and half-widths from err. */
+void DisplayMoments(const char *label, stats_data *stats, stats_data *err,
+		sketch *sk) {
+	uint64 size = stats_count(stats);
+	double avg = stats_mean(stats);
+	double hwidth[MAX_LEVELS], pct[MAX_QUANTILES];
+
+	HalfWidths(err, hwidth);
+	if (numQuantiles > 0)
+		sketch_quantiles(sk, quantiles, numQuantiles, pct);
+	DisplayValues(label, size, size * avg, stats_min(stats), stats_max(stats),
+			avg, stats_variance(stats), stats_stdev(stats), stats_stderr(err),
+			hwidth, pct, NULL);
+}
+
+/* Declare the displayed fields, in order, to the output layer. */
+void SetupOutput(int format) {
+	static char quantileHeadings[MAX_QUANTILES][32];
+	static char levelHeadings[MAX_LEVELS][2][32];
+	int i;
+
+	output_init(format, DECIMAL_PLACES);
+	if (displayLabel)
+		output_add_field(labelHeading, OUTPUT_LABEL, -LABEL_WIDTH, FIELD_LABEL);
+	if (displayAll || displayCount)
+		output_add_field("Count", OUTPUT_COUNT, INT_WIDTH, FIELD_COUNT);
+	if (displaySum)
+		output_add_field("Sum", OUTPUT_NUMBER, FLOAT_WIDTH, FIELD_SUM);
+	if (displayAll || displayMin)
+		output_add_field("Min", OUTPUT_NUMBER, FLOAT_WIDTH, FIELD_MIN);
+	if (displayAll || displayMax)
+		output_add_field("Max", OUTPUT_NUMBER, FLOAT_WIDTH, FIELD_MAX);
+	if (displayAll || displayAverage)
+		output_add_field("Avg", OUTPUT_NUMBER, FLOAT_WIDTH, FIELD_AVG);
+	if (displayVariance)
+		output_add_field("Var", OUTPUT_NUMBER, FLOAT_WIDTH, FIELD_VAR);
+	if (displayAll || displayStdDev)
+		output_add_field("StdDev", OUTPUT_NUMBER, FLOAT_WIDTH, FIELD_STDDEV);
+	if (displayStdErr)
+		output_add_field("StdErr", OUTPUT_NUMBER, FLOAT_WIDTH, FIELD_STDERR);
+	for (i = 0; i < numLevels; i++) {
+		/* Several levels are told apart by a suffix, as in HWidth99. */
+		if (numLevels > 1) {
+			snprintf(levelHeadings[i][0], sizeof(levelHeadings[i][0]),
+					"HWidth%g", 100 * criticalValues[i].level);
+			snprintf(levelHeadings[i][1], sizeof(levelHeadings[i][1]),
+					"%%HWidth%g", 100 * criticalValues[i].level);
+		} else {
+			strcpy(levelHeadings[i][0], "HWidth");
+			strcpy(levelHeadings[i][1], "%HWidth");
+		}
 		if (displayAll || displayHalfWidth)
-			fprintf(stdout, " %*s", FLOAT_WIDTH, "HWidth");
+			output_add_field(levelHeadings[i][0], OUTPUT_NUMBER, FLOAT_WIDTH,
+					FIELD_HWIDTH + 2 * i);
 		if (displayAll || displayPercentHalfWidth)
-			fprintf(stdout, " %*s", FLOAT_WIDTH, "%HWidth");
-		if (displayAll || displayCount  || displaySum || displayMin || 
-				displayMax || displayAverage || displayVariance || 
-				displayStdDev || displayStdErr ||
-				displayHalfWidth || displayPercentHalfWidth) {
-			fputc('\n', stdout);
-		}
-  }
+			output_add_field(levelHeadings[i][1], OUTPUT_NUMBER, FLOAT_WIDTH,
+					FIELD_PHWIDTH + 2 * i);
+	}
+	for (i = 0; i < numQuantiles; i++) {
+		snprintf(quantileHeadings[i], sizeof(quantileHeadings[i]), "p%g",
+				100 * quantiles[i]);
+		output_add_field(quantileHeadings[i], OUTPUT_NUMBER, FLOAT_WIDTH,
+				FIELD_QUANTILE + i);
+	}
+}
+
+/* Write out the rows still buffered, then the profile if one was asked for. */
+void FinishProfile(void) {
+  profile_mark mark;
+
+  if (!profile_enabled)
+	return;
+  PROFILE_BEGIN(mark);
+  output_flush();
+  PROFILE_END(PROFILE_OUTPUT, mark);
+  profile_report(stderr);
+}
+
+void DisplayHeadings() {
+  static BOOL shown = FALSE;
+
+  if (headingsOnce && shown && histogramBits < 0)
+	return;
+  shown = TRUE;
+  if (displayHeading)
+	output_headings();
 }
 
-void DisplayValues(long cnt, double sum, double min, double max, double avg, 
-  double var, double stddev, double stderror, double hwidth, double phwidth) {
-  if (displayAll || displayCount)
-		fprintf(stdout, " %*d", INT_WIDTH, cnt);
-  if (displaySum)
-		fprintf(stdout, " %*.*f", FLOAT_WIDTH, DECIMAL_PLACES, sum);
-  if (displayAll || displayMin)
-		fprintf(stdout, " %*.*f", FLOAT_WIDTH, DECIMAL_PLACES, min);
-  if (displayAll || displayMax)
-		fprintf(stdout, " %*.*f", FLOAT_WIDTH, DECIMAL_PLACES, max);
-  if (displayAll || displayAverage)
-		fprintf(stdout, " %*.*f", FLOAT_WIDTH, DECIMAL_PLACES, avg);
-  if (displayVariance)
-		fprintf(stdout, " %*.*f", FLOAT_WIDTH, DECIMAL_PLACES, var);
-  if (displayAll || displayStdDev)
-		fprintf(stdout, " %*.*f", FLOAT_WIDTH, DECIMAL_PLACES, stddev);
-  if (displayStdErr)
-		fprintf(stdout, " %*.*f", FLOAT_WIDTH, DECIMAL_PLACES, stderror);
-  if (displayAll || displayHalfWidth)
-		fprintf(stdout, " %*.*f", FLOAT_WIDTH, DECIMAL_PLACES, hwidth);
-  if (displayAll || displayPercentHalfWidth)
-		fprintf(stdout, " %*.*f", FLOAT_WIDTH, DECIMAL_PLACES, phwidth);
-  if (displayAll || displayCount  || displaySum || displayMin || 
-			displayMax || displayAverage || displayVariance || 
-			displayStdDev || displayStdErr ||
-			displayHalfWidth || displayPercentHalfWidth) {
-		fputc('\n', stdout);
+/* exact, if not NULL, holds the digits of an integer sum, min and max. */
+void DisplayValues(const char *label, uint64 cnt, double sum, double min,
+  double max, double avg, double var, double stddev, double stderror,
+  const double *hwidth, const double *pct, const char *const *exact) {
+  output_value v[NUM_FIELDS];
+  int i;
+
+  memset(v, 0, sizeof(v));
+  v[FIELD_LABEL].text = label != NULL ? label : "";
+  v[FIELD_COUNT].count = cnt;
+  v[FIELD_SUM].number = sum;
+  v[FIELD_MIN].number = min;
+  v[FIELD_MAX].number = max;
+  if (exact != NULL) {
+	v[FIELD_SUM].text = exact[0];
+	v[FIELD_MIN].text = exact[1];
+	v[FIELD_MAX].text = exact[2];
+  }
+  v[FIELD_AVG].number = avg;
+  v[FIELD_VAR].number = var;
+  v[FIELD_STDDEV].number = stddev;
+  v[FIELD_STDERR].number = stderror;
+  for (i = 0; i < numLevels; i++) {
+	v[FIELD_HWIDTH + 2 * i].number = hwidth[i];
+	v[FIELD_PHWIDTH + 2 * i].number = 100 * hwidth[i] / avg;
   }
+  for (i = 0; i < numQuantiles; i++)
+	v[FIELD_QUANTILE + i].number = pct[i];
+  output_row(v);
 }
@@ -8,6 +8,8 @@
 #ifndef __STATS_H
 #define __STATS_H
 
+#include <stddef.h>
+
 /* Define some convenient types for module parameterization purposes. */
 
 #ifndef uint32
@@ -29,17 +31,65 @@ typedef long long           int64;
 /* Give a default module parameterization. */
 #ifndef STATS_DATATYPE
 #	define STATS_DATATYPE double
+#	define STATS_DATATYPE_IS_DOUBLE
 #endif /* STATS_DATATYPE */
 
-/* Data structure to hold intermediate results. */
+/* Number of values summarized at a time by stats_update_batch(). */
+#define STATS_BATCH_BLOCK	512
+
+/*
+-- Data structure to hold intermediate results. The count is 64 bits so
+-- that billions of values do not wrap; it takes the place of padding
+-- before the doubles, so the structure is no larger than with 32 bits.
+*/
 typedef struct stat_data {
-	uint32          count;
+	uint64          count;
 	STATS_DATATYPE  min;
 	STATS_DATATYPE  max;
 	double          mean;
 	double          variance;
 } stats_data;
 
+/* Below this many values, confidence intervals use the T distribution. */
+#define STATS_T_LIMIT	30
+
+/*
+-- The critical values of one confidence level, worked out once by
+-- stats_critical_init() rather than on every stats_confidence() call.
+*/
+typedef struct stats_critical {
+	double          level;
+	double          z;
+	double          t[STATS_T_LIMIT];  /* by degrees of freedom */
+} stats_critical;
+
+/* The same summary kept with compensated sums (see stats.c). */
+typedef struct stats_precise {
+	uint64          count;
+	STATS_DATATYPE  min;
+	STATS_DATATYPE  max;
+	double          sum;      /* of the values, plus sum_err */
+	double          sum_err;
+	double          m2;       /* of squared deviations, plus m2_err */
+	double          m2_err;
+} stats_precise;
+
+/* Most batches stats_batch_means_init() may be asked for. */
+#define STATS_MAX_BATCHES	256
+
+/*
+-- Sums of consecutive batches of a stream, whose means are nearly
+-- independent even when the values are not (see stats.c).
+*/
+typedef struct stats_batch_means {
+	uint64          size;     /* values per batch */
+	uint64          pending;  /* values of the batch being filled */
+	double          partial;  /* and their sum */
+	int             nbatches;
+	int             full;     /* batches in sums, nbatches to 2 * nbatches */
+	double          sums[2 * STATS_MAX_BATCHES];
+} stats_batch_means;
+
 
 /*
 -- Public interface of the module:
@@ -52,7 +102,11 @@ typedef struct stat_data {
 #	define INLINE
 	extern void            stats_init(stats_data *data);
 	extern void            stats_update(stats_data *data, STATS_DATATYPE x);
-	extern uint32          stats_count(stats_data *data);
+	extern void            stats_update_batch(stats_data *data,
+	                                          const STATS_DATATYPE *xs, size_t n);
+	extern void            stats_remove(stats_data *data, STATS_DATATYPE x);
+	extern void            stats_merge(stats_data *dst, const stats_data *src);
+	extern uint64          stats_count(stats_data *data);
 	extern STATS_DATATYPE  stats_min(stats_data *data);
 	extern STATS_DATATYPE  stats_max(stats_data *data);
 	extern double          stats_mean(stats_data *data);
@@ -60,9 +114,29 @@ typedef struct stat_data {
 	extern double          stats_stdev(stats_data *data);
 	extern double          stats_stderr(stats_data *data);
 	extern double          stats_confidence(stats_data *data, double level);
+	extern void            stats_critical_init(stats_critical *crit,
+	                                          double level);
+	extern double          stats_confidence_at(stats_data *data,
+	                                          const stats_critical *crit);
+	extern void            stats_precise_init(stats_precise *data);
+	extern void            stats_precise_update_batch(stats_precise *data,
+	                                          const STATS_DATATYPE *xs, size_t n);
+	extern void            stats_precise_merge(stats_precise *dst,
+	                                          const stats_precise *src);
+	extern void            stats_precise_result(const stats_precise *data,
+	                                          stats_data *out);
+	extern void            stats_batch_means_init(stats_batch_means *bm,
+	                                          int nbatches);
+	extern void            stats_batch_means_update_batch(
+	                                          stats_batch_means *bm,
+	                                          const STATS_DATATYPE *xs, size_t n);
+	extern void            stats_batch_means_result(
+	                                          const stats_batch_means *bm,
+	                                          stats_data *out);
+	extern double          stats_batch_means_lag1(const stats_batch_means *bm);
 #else
 #	undef  INLINE
-#	define INLINE inline
+#	define INLINE static inline
 #	include "stats.c"
 #endif /* INLINE */
 
@@ -0,0 +1,109 @@
+/*
+-- Specialized accumulators for statgen
+--
+-- When only the count, sum, minimum and maximum of a stream are wanted,
+-- the variance recurrence of stats.c is wasted work. The accumulators
+-- here keep just those four, in the type of the values themselves, and
+-- integers are summed exactly in 128 bits. Each is generated for one
+-- value type by STATS_BASIC_DEFINE(), much as stats.c is parameterized
+-- by STATS_DATATYPE.
+*/
+
+#ifndef __STATS_BASIC_H
+#define __STATS_BASIC_H
+
+#include <float.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "stats.h"
+
+#ifdef __SIZEOF_INT128__
+typedef __int128            stats_int128;
+typedef unsigned __int128   stats_uint128;
+#else
+typedef long double         stats_int128;   /* exact below 2^64 only */
+typedef long double         stats_uint128;
+#endif /* __SIZEOF_INT128__ */
+
+/*
+-- Independent partial results in the batch loop; one AVX-512 register
+-- of doubles. Like the kernels of stats.c, the loop is built for the
+-- widest instructions the processor supports, and it may reorder the
+-- additions so that it vectorizes.
+*/
+#define STATS_BASIC_LANES	8
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define STATS_BASIC_CLONES \
+	__attribute__((target_clones("avx512f", "avx2", "default"), \
+		optimize("associative-math", "no-signed-zeros", "no-trapping-math")))
+#else
+#define STATS_BASIC_CLONES
+#endif
+
+/*
+-- Define the type NAME with NAME_init(), NAME_update_batch() and
+-- NAME_merge() for values of type TYPE summed as SUM.
+*/
+#define STATS_BASIC_DEFINE(NAME, TYPE, SUM, TYPE_MIN, TYPE_MAX)            \
+typedef struct NAME {                                                      \
+	uint64        count;                                                     \
+	TYPE          min;                                                       \
+	TYPE          max;                                                       \
+	SUM           sum;                                                       \
+} NAME;                                                                    \
+                                                                           \
+static inline void NAME##_init(NAME *data) {                              \
+	data->count = 0;                                                         \
+	data->min = TYPE_MAX;                                                    \
+	data->max = TYPE_MIN;                                                    \
+	data->sum = 0;                                                           \
+}                                                                          \
+                                                                           \
+STATS_BASIC_CLONES                                                         \
+static inline void NAME##_update_batch(NAME *data, const TYPE *xs,       \
+		size_t n) {                                                            \
+	SUM s[STATS_BASIC_LANES];                                                \
+	TYPE lo[STATS_BASIC_LANES], hi[STATS_BASIC_LANES];                       \
+	size_t i, j;                                                             \
+                                                                           \
+	for (j = 0; j < STATS_BASIC_LANES; j++) {                                \
+		s[j] = 0;                                                              \
+		lo[j] = data->min;                                                     \
+		hi[j] = data->max;                                                     \
+	}                                                                        \
+	for (i = 0; i + STATS_BASIC_LANES <= n; i += STATS_BASIC_LANES)          \
+		for (j = 0; j < STATS_BASIC_LANES; j++) {                              \
+			s[j] += xs[i + j];                                                   \
+			lo[j] = xs[i + j] < lo[j] ? xs[i + j] : lo[j];                       \
+			hi[j] = xs[i + j] > hi[j] ? xs[i + j] : hi[j];                       \
+		}                                                                      \
+	for (; i < n; i++) {                                                     \
+		s[0] += xs[i];                                                         \
+		lo[0] = xs[i] < lo[0] ? xs[i] : lo[0];                                 \
+		hi[0] = xs[i] > hi[0] ? xs[i] : hi[0];                                 \
+	}                                                                        \
+	for (j = 1; j < STATS_BASIC_LANES; j++) {                                \
+		s[0] += s[j];                                                          \
+		lo[0] = lo[j] < lo[0] ? lo[j] : lo[0];                                 \
+		hi[0] = hi[j] > hi[0] ? hi[j] : hi[0];                                 \
+	}                                                                        \
+	data->sum += s[0];                                                       \
+	data->count += n;                                                        \
+	data->min = lo[0];                                                       \
+	data->max = hi[0];                                                       \
+}                                                                          \
+                                                                           \
+static inline void NAME##_merge(NAME *dst, const NAME *src) {             \
+	dst->count += src->count;                                                \
+	dst->sum += src->sum;                                                    \
+	dst->min = src->min < dst->min ? src->min : dst->min;                    \
+	dst->max = src->max > dst->max ? src->max : dst->max;                    \
+}
+
+STATS_BASIC_DEFINE(stats_basic_f64, double, double, -DBL_MAX, DBL_MAX)
+STATS_BASIC_DEFINE(stats_basic_f32, float, double, -FLT_MAX, FLT_MAX)
+STATS_BASIC_DEFINE(stats_basic_i64, int64, stats_int128, INT64_MIN, INT64_MAX)
+STATS_BASIC_DEFINE(stats_basic_u64, uint64, stats_uint128, 0, UINT64_MAX)
+
+#endif /* __STATS_BASIC_H */
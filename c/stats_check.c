@@ -0,0 +1,196 @@
+/*
+-- Checks of the statistics ADT that statgen cannot show
+--
+-- Run by "make check" before test.sh. Each SIMD block kernel the
+-- processor supports is compared with the generic one on blocks whose
+-- lengths are not multiples of the vector width, with and without a NaN
+-- at the start, in the vector part and in the tail, the compensated
+-- summary is given sums that cancel, and a sharded summary is read while
+-- threads record into it. The failures are
+-- listed and counted; the status is theirs.
+*/
+
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+
+#define  INLINE  /* open-code stats routines */
+#include "stats.h"
+#include "stats_shard.h"
+
+#define CHECK_WRITERS	4
+#define CHECK_VALUES	2000000		/* recorded by each writer */
+
+static int checks, failures;
+
+
+static void check(const char *name, int ok) {
+	checks++;
+	if (!ok) {
+		printf("FAIL %s\n", name);
+		failures++;
+	}
+}
+
+/* Equal, both NaN, or within rounding of a different summation order. */
+static int same(double x, double y) {
+	if (isnan(x) || isnan(y))
+		return isnan(x) && isnan(y);
+	return x == y || fabs(x - y) <= 1e-12 * fmax(fabs(x), fabs(y));
+}
+
+static void check_kernel(const char *name, stats_block_fn kernel) {
+	static const size_t lengths[] = { 1, 3, 7, 17, 31, 100, 511 };
+	double xs[STATS_BATCH_BLOCK];
+	stats_data want, got;
+	char what[128];
+	size_t i, k;
+	int nan;
+
+	for (k = 0; k < sizeof(lengths) / sizeof(lengths[0]); k++) {
+		for (nan = -1; nan < 3; nan++) {
+			for (i = 0; i < lengths[k]; i++)
+				xs[i] = (double)((i * 7919) % 1000) / 8.0 - 40.0;
+			if (nan >= 0)
+				xs[nan == 0 ? 0 : nan == 1 ? lengths[k] / 2 : lengths[k] - 1] = NAN;
+			stats_block_generic(xs, lengths[k], &want);
+			kernel(xs, lengths[k], &got);
+			snprintf(what, sizeof(what), "%s, %lu values, NaN %s", name,
+					(unsigned long)lengths[k], nan < 0 ? "none" : nan == 0 ?
+					"first" : nan == 1 ? "within" : "last");
+			check(what, got.count == want.count && same(got.mean, want.mean) &&
+					same(got.variance, want.variance) && same(got.min, want.min) &&
+					same(got.max, want.max));
+		}
+	}
+}
+
+static void check_kernels(void) {
+	double xs[3 * STATS_BATCH_BLOCK + 5];
+	size_t i, n = sizeof(xs) / sizeof(xs[0]);
+	stats_data batch, one;
+
+	/* The kernel in use, through stats_update_batch(), and stats_update(). */
+	for (i = 0; i < n; i++)
+		xs[i] = (double)(i % 97) - 48.0;
+	stats_init(&batch);
+	stats_update_batch(&batch, xs, n);
+	stats_init(&one);
+	for (i = 0; i < n; i++)
+		stats_update(&one, xs[i]);
+	check("stats_update_batch", batch.count == one.count &&
+			same(batch.mean, one.mean) &&
+			fabs(batch.variance - one.variance) <= 1e-9 * one.variance &&
+			batch.min == one.min && batch.max == one.max);
+
+#ifdef STATS_X86_KERNELS
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+		check_kernel("avx2", stats_block_avx2);
+	if (__builtin_cpu_supports("avx512f"))
+		check_kernel("avx512", stats_block_avx512);
+#endif
+#ifdef STATS_NEON_KERNEL
+	check_kernel("neon", stats_block_neon);
+#endif
+}
+
+/*
+-- 1e16 and -1e16 cancel, which loses the ones between them unless the sum
+-- is compensated within a block as well as across blocks, where the
+-- values come one block each.
+*/
+static void check_precise(void) {
+	double xs[1004];
+	double want = 102.0 / 1004;
+	stats_precise whole, apart;
+	stats_data out;
+	size_t i;
+
+	xs[0] = 1e16;
+	xs[1] = 1.0;
+	xs[2] = -1e16;
+	xs[3] = 1.0;
+	for (i = 4; i < 1004; i++)
+		xs[i] = 0.1;
+	stats_precise_init(&whole);
+	stats_precise_update_batch(&whole, xs, 1004);
+	stats_precise_result(&whole, &out);
+	check("precise mean, one block", fabs(out.mean - want) <= 1e-12 * want);
+	stats_precise_init(&apart);
+	for (i = 0; i < 1004; i++)
+		stats_precise_update_batch(&apart, &xs[i], 1);
+	stats_precise_result(&apart, &out);
+	check("precise mean, a block each", fabs(out.mean - want) <= 1e-12 * want);
+}
+
+/* Writers record 1, 2, 3 ... each; readers check what they see. */
+typedef struct shard_run {
+	stats_sharded    sharded;
+	int              writers;
+	int              running;
+} shard_run;
+
+static void *Record(void *arg) {
+	shard_run *run = arg;
+	stats_shard *shard = stats_sharded_join(&run->sharded);
+	long i;
+
+	for (i = 1; i <= CHECK_VALUES; i++)
+		stats_shard_update(shard, (double)i);
+	stats_sharded_leave(&run->sharded, shard);
+	__atomic_fetch_sub(&run->running, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+/*
+-- With one writer, a consistent read of count n has a maximum of n and
+-- a mean of (n + 1) / 2, which the updates keep exactly; with several,
+-- the count never goes back and the range stays within 1 ... the count.
+*/
+static void check_shards(int writers) {
+	pthread_t threads[CHECK_WRITERS];
+	shard_run run;
+	stats_data out;
+	uint64 last = 0;
+	long reads = 0;
+	int i, consistent = 1, monotonic = 1;
+	char what[64];
+
+	stats_sharded_init(&run.sharded);
+	run.writers = run.running = writers;
+	for (i = 0; i < writers; i++)
+		pthread_create(&threads[i], NULL, Record, &run);
+	while (__atomic_load_n(&run.running, __ATOMIC_ACQUIRE) > 0) {
+		stats_sharded_read(&run.sharded, &out);
+		reads++;
+		if (out.count < last)
+			monotonic = 0;
+		last = out.count;
+		if (out.count == 0)
+			continue;
+		if (writers == 1 ? out.max != (double)out.count ||
+				out.mean != (out.count + 1) / 2.0 :
+				out.min != 1.0 || out.max > (double)out.count)
+			consistent = 0;
+	}
+	for (i = 0; i < writers; i++)
+		pthread_join(threads[i], NULL);
+	stats_sharded_read(&run.sharded, &out);
+	stats_sharded_free(&run.sharded);
+
+	snprintf(what, sizeof(what), "shard reads, %d writers", writers);
+	check(what, consistent && monotonic && reads > 0);
+	snprintf(what, sizeof(what), "shard totals, %d writers", writers);
+	check(what, out.count == (uint64)writers * CHECK_VALUES &&
+			out.mean == (CHECK_VALUES + 1) / 2.0);
+}
+
+int main(void) {
+	check_kernels();
+	check_precise();
+	check_shards(1);
+	check_shards(CHECK_WRITERS);
+	printf("%d checks, %d failed\n", checks, failures);
+	return failures != 0;
+}
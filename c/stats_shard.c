@@ -0,0 +1,100 @@
+/*
+-- Sharded statistics for multithreaded programs
+--
+-- Note: the sequence number follows the seqlock of Boehm, "Can
+-- Seqlocks Get Along with Programming Language Memory Models?", MSPC
+-- 2012. The owner makes it odd, fences, updates the summary and makes
+-- it even again with a release store; a reader that sees the same even
+-- number before and after its copy has a consistent summary.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include "stats_shard.h"
+
+
+INLINE void stats_sharded_init(stats_sharded *s) {
+	s->shards = NULL;
+}
+
+INLINE stats_shard *stats_sharded_join(stats_sharded *s) {
+	stats_shard *shard;
+	int free_shard;
+	void *p;
+
+	for (shard = __atomic_load_n(&s->shards, __ATOMIC_ACQUIRE); shard != NULL;
+			shard = shard->next) {
+		free_shard = 0;
+		if (__atomic_compare_exchange_n(&shard->owned, &free_shard, 1, 0,
+				__ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			return shard;
+	}
+
+	if (posix_memalign(&p, STATS_SHARD_LINE, sizeof(stats_shard)) != 0)
+		return NULL;
+	shard = (stats_shard *)p;
+	memset(shard, 0, sizeof(*shard));
+	stats_init(&shard->data);
+	shard->owned = 1;
+	shard->next = __atomic_load_n(&s->shards, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&s->shards, &shard->next, shard, 1,
+			__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+	return shard;
+}
+
+INLINE void stats_sharded_leave(stats_sharded *s, stats_shard *shard) {
+	(void)s;
+	__atomic_store_n(&shard->owned, 0, __ATOMIC_RELEASE);
+}
+
+INLINE void stats_shard_update(stats_shard *shard, STATS_DATATYPE x) {
+	uint64 seq = shard->seq;
+
+	__atomic_store_n(&shard->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	stats_update(&shard->data, x);
+	__atomic_store_n(&shard->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/* The values are summarized first, so readers wait only for the merge. */
+INLINE void stats_shard_update_batch(stats_shard *shard,
+		const STATS_DATATYPE *xs, size_t n) {
+	stats_data part;
+	uint64 seq = shard->seq;
+
+	stats_init(&part);
+	stats_update_batch(&part, xs, n);
+	__atomic_store_n(&shard->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	stats_merge(&shard->data, &part);
+	__atomic_store_n(&shard->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+INLINE void stats_sharded_read(stats_sharded *s, stats_data *out) {
+	stats_shard *shard;
+	stats_data copy;
+	uint64 before, after;
+
+	stats_init(out);
+	for (shard = __atomic_load_n(&s->shards, __ATOMIC_ACQUIRE); shard != NULL;
+			shard = shard->next) {
+		do {
+			before = __atomic_load_n(&shard->seq, __ATOMIC_ACQUIRE);
+			memcpy(&copy, (const void *)&shard->data, sizeof(copy));
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			after = __atomic_load_n(&shard->seq, __ATOMIC_RELAXED);
+		} while ((before & 1) != 0 || before != after);
+		stats_merge(out, &copy);
+	}
+}
+
+INLINE void stats_sharded_free(stats_sharded *s) {
+	stats_shard *shard, *next;
+
+	for (shard = s->shards; shard != NULL; shard = next) {
+		next = shard->next;
+		free(shard);
+	}
+	s->shards = NULL;
+}
@@ -0,0 +1,67 @@
+/*
+-- Sharded statistics for multithreaded programs
+--
+-- A stats_data shared by many threads needs a lock around every
+-- update, and the lock and the summary bounce between the caches of
+-- the threads. A stats_sharded instead gives each thread that joins it
+-- a shard of its own, on a cache line of its own, which only that
+-- thread writes. An update is stats_update() between two stores to the
+-- shard's sequence number (a seqlock), so it takes no lock and no
+-- atomic read-modify-write. stats_sharded_read() copies each shard,
+-- trying again if its owner was in the middle of an update, and merges
+-- the copies with stats_merge().
+--
+-- Like stats.h, this module is included inline if INLINE is defined,
+-- and otherwise stats_shard.c and stats.c need to be linked in.
+*/
+
+#ifndef __STATS_SHARD_H
+#define __STATS_SHARD_H
+
+#ifdef INLINE
+#	define STATS_SHARD_INLINE
+#endif /* INLINE */
+#include "stats.h"
+
+#define STATS_SHARD_LINE	64			/* bytes of a cache line, or more */
+
+typedef struct stats_shard {
+	uint64          seq;       /* odd while the owner is updating */
+	int             owned;     /* by a thread, or free to be joined */
+	stats_data      data;
+	struct stats_shard *next;  /* every shard, newest first */
+} __attribute__((aligned(STATS_SHARD_LINE))) stats_shard;
+
+typedef struct stats_sharded {
+	stats_shard    *shards;    /* only ever added to until freed */
+} stats_sharded;
+
+/*
+-- Public interface of the module:
+--
+--  stats_sharded_join() returns a shard for the calling thread, reusing
+--  one that was left if it can, or NULL if out of memory. The thread
+--  keeps it (in a thread-local variable, say) and records values with
+--  stats_shard_update() and stats_shard_update_batch(); no other thread
+--  may update it. stats_sharded_leave() gives it up, and its values
+--  stay counted. stats_sharded_read() may be called from any thread at
+--  any time; stats_sharded_free() only once every thread has left.
+*/
+#ifndef STATS_SHARD_INLINE
+	extern void            stats_sharded_init(stats_sharded *s);
+	extern stats_shard    *stats_sharded_join(stats_sharded *s);
+	extern void            stats_sharded_leave(stats_sharded *s,
+	                                          stats_shard *shard);
+	extern void            stats_shard_update(stats_shard *shard,
+	                                          STATS_DATATYPE x);
+	extern void            stats_shard_update_batch(stats_shard *shard,
+	                                          const STATS_DATATYPE *xs,
+	                                          size_t n);
+	extern void            stats_sharded_read(stats_sharded *s,
+	                                          stats_data *out);
+	extern void            stats_sharded_free(stats_sharded *s);
+#else
+#	include "stats_shard.c"
+#endif /* STATS_SHARD_INLINE */
+
+#endif /* __STATS_SHARD_H */
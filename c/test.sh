@@ -0,0 +1,281 @@
+#!/bin/sh
+#
+# -- Regression checks of statgen, run by "make check"
+#
+# Each check runs statgen on a small input and compares what it prints
+# (tab-separated, without headings) or its exit status with what it
+# should be. The failures are listed and counted; the status is theirs.
+#
+
+STATGEN=${1:-./statgen}
+TMP=`mktemp -d` || exit 1
+trap 'rm -rf "$TMP"' 0
+checks=0
+failures=0
+
+# check NAME EXPECTED ACTUAL
+check() {
+	checks=`expr $checks + 1`
+	if [ "$2" != "$3" ]; then
+		echo "FAIL $1: expected '$2', got '$3'"
+		failures=`expr $failures + 1`
+	fi
+}
+
+# The output lines of a command, joined by spaces.
+rows() {
+	"$@" 2>/dev/null | tr '\n' ' ' | sed 's/ $//'
+}
+
+# The exit status of a command, quietly.
+status() {
+	"$@" >/dev/null 2>&1
+	echo $?
+}
+
+# Send the file $2 to the unix socket $1, once it is listening.
+send() {
+	while [ ! -S "$1" ]; do sleep 0.05; done
+	perl -MIO::Socket::UNIX -e '
+		$s = IO::Socket::UNIX->new(Peer => $ARGV[0]) or die "$!\n";
+		local $/; open(F, $ARGV[1]) or die "$!\n"; print $s <F>;' "$1" "$2"
+}
+
+# Send the file $2 to the unix socket $1 and print what it answers.
+ask() {
+	while [ ! -S "$1" ]; do sleep 0.05; done
+	perl -MIO::Socket::UNIX -e 'alarm 20;
+		$s = IO::Socket::UNIX->new(Peer => $ARGV[0]) or die "$!\n";
+		local $/; open(F, $ARGV[1]) or die "$!\n"; print $s <F>;
+		shutdown($s, 1); print <$s>;' "$1" "$2"
+}
+
+# -- Input (--input-format, compressed input)
+# 35615 begins with the bytes of the gzip magic, 1f 8b.
+check "i64 like gzip" "3	35615" "`perl -e 'print pack("q<", 35615) x 3' |
+	rows $STATGEN -x -f tsv -c -a --input-format=i64,le`"
+if command -v gzip >/dev/null; then
+	seq 1 100 | gzip >$TMP/seq.gz
+	check "gzip file" "100	50.5" "`rows $STATGEN -x -f tsv -c -a $TMP/seq.gz`"
+	check "gzip pipe" "100	50.5" "`rows $STATGEN -x -f tsv -c -a <$TMP/seq.gz`"
+	check "gzip f64,z" "3	2.5" "`perl -e 'print pack("d<", 2.5) x 3' |
+		gzip | rows $STATGEN -x -f tsv -c -a --input-format=f64,le,z`"
+	# Stopping early must not wait for the decoder to finish the input.
+	seq 1 1000000 | gzip >$TMP/million.gz
+	check "early stop, gzip file" "0" "`status timeout 20 $STATGEN -c \
+		--target-hwidth=1 $TMP/million.gz`"
+	check "early stop, gzip pipe" "0" "`status timeout 20 $STATGEN -c \
+		--target-hwidth=1 <$TMP/million.gz`"
+fi
+
+# -- Sums (stats_basic.h)
+# Four of 2^62 + 1 and -3 add up to 2^64 + 1, beyond a double or an int64.
+check "exact i64 sum" "18446744073709551617	4611686018427387905" \
+	"`perl -e 'print pack("q<", 4611686018427387905) x 4, pack("q<", -3)' |
+	rows $STATGEN -x -f tsv -s -m --input-format=i64,le`"
+check "u64 all ones" "36893488147419103230" \
+	"`perl -e 'print pack("Q<", 18446744073709551615) x 2' |
+	rows $STATGEN -x -f tsv -s --input-format=u64,le`"
+check "nan sum" "3	nan	1e+300" \
+	"`printf '1e300\\n-1e300\\nnan\\n' | rows $STATGEN -x -f tsv -c -s -m`"
+
+# -- Output (-f)
+check "tsv shortest" "0.30000000000000004" \
+	"`printf '0.1\\n0.2\\n' | rows $STATGEN -x -f tsv -s`"
+check "tsv exponents" "1e-07 123456789012" \
+	"`printf '1e-7\\n123456789012\\n' | rows $STATGEN -x -f tsv -a --every=1`"
+check "tsv headings" "Count	Avg 4	2.5" "`seq 1 4 | rows $STATGEN -f tsv -c -a`"
+check "json" '{"Count":4,"Avg":2.5}' "`seq 1 4 | rows $STATGEN -f json -c -a`"
+check "json rows" '{"Avg":1} {"Avg":2}' \
+	"`seq 1 2 | rows $STATGEN -f json -a --every=1`"
+# A record is the count as a uint64, then the doubles (little-endian here).
+check "binary" "02 00 00 00 00 00 00 00 00 00 00 00 00 00 f8 3f" \
+	"`seq 1 2 | $STATGEN -f binary -c -a | od -A n -t x1 | tr -s ' \\n' ' ' |
+	sed 's/^ //; s/ $//'`"
+
+# -- Groups (--group-by, --compact)
+# Past a few million values of a key, rounding its single precision
+# summary after each one would move the mean and deviation.
+perl -e 'srand(1); printf "k %.3f\n", 100 + rand(20) for 1..4000000' >$TMP/keyed
+check "compact" "`$STATGEN -x --group-by=1 $TMP/keyed`" \
+	"`$STATGEN -x --group-by=1 --compact $TMP/keyed`"
+
+# -- Histograms (--histogram)
+# Buckets are of magnitudes: -2 is counted with -3, in (-4, -2].
+printf -- '-3\n-2\n-1.5\n-1\n0\n1\n2\n3\n' >$TMP/signed
+check "negative buckets" "-4	-2	2 -2	-1	2 0	0	1 1	2	1 2	4	2" \
+	"`$STATGEN -x -f tsv -c --histogram=1 $TMP/signed | sed 1,2d |
+	cut -f1-3 | tr '\\n' ' ' | sed 's/ $//'`"
+seq 1 500000 >$TMP/half
+# Threads merge their buckets to the same counts, whatever the summary's
+# last digit.
+check "merged buckets" "`$STATGEN --histogram=8 -x -f tsv $TMP/half | sed 1d |
+	md5sum`" "`$STATGEN --histogram=8 -x -f tsv -j3 $TMP/half | sed 1d | md5sum`"
+
+# -- Profile (--profile)
+# seq 1 1000 is 3893 bytes; the report goes to stderr alone.
+seq 1 1000 >$TMP/thousand
+check "profile totals" "3893 bytes 1000 values 7786 bytes 2000 values" \
+	"`{ $STATGEN --profile $TMP/thousand; $STATGEN -j2 --profile $TMP/thousand \
+	$TMP/thousand; } 2>&1 >/dev/null | grep '^-- Profile' |
+	sed 's/.*, \\([0-9]* bytes\\).*, \\([0-9]* values\\).*/\\1 \\2/' |
+	tr '\\n' ' ' | sed 's/ $//'`"
+check "profile off" "" "`$STATGEN $TMP/thousand 2>&1 >/dev/null`"
+
+# -- Windows (--window, --every)
+check "every=2 counts" "2 2 1" "`seq 1 5 | rows $STATGEN -x -f tsv -c --every=2`"
+check "every=1 rows" "1 2 3" "`seq 1 3 | rows $STATGEN -x -f tsv -a --every=1`"
+check "sliding means" "2 3 4" \
+	"`seq 1 5 | rows $STATGEN -x -f tsv -a --window=3 --every=1`"
+# The first row is out before the pipe has more to give.
+limit=`date +%s`; limit=`expr $limit + 2`
+(printf '1\n2\n'; sleep 3; printf '3\n') | $STATGEN -x -f tsv -c --every=2 |
+	{ read row; echo "$row `date +%s`" >$TMP/first; cat >/dev/null; }
+set -- `cat $TMP/first`
+check "slow pipe" "2 yes" "$1 `[ $2 -lt $limit ] && echo yes`"
+check "window=0.5 rejected" "255" "`status $STATGEN --window=0.5 /dev/null`"
+check "every=0.9 rejected" "255" "`status $STATGEN --every=0.9 /dev/null`"
+
+# -- Batch means (--batch-means)
+# Seven full batches of 128 of 1 ... 1000 have means 64.5 + 128k, whose
+# standard error is 128 sqrt(2/3); of 1 ... 10, two of 4, so 2.
+check "batch means" "104.51156235874893" \
+	"`seq 1 1000 | rows $STATGEN -x -f tsv -e --batch-means=4`"
+check "two batches" "2" "`seq 1 10 | rows $STATGEN -x -f tsv -e --batch-means=2`"
+check "one batch" "255" "`status $STATGEN --batch-means=1 /dev/null`"
+check "257 batches" "255" "`status $STATGEN --batch-means=257 /dev/null`"
+
+# -- Comparison (--compare)
+seq 1 5 >$TMP/a
+seq 3 7 >$TMP/b
+printf '0\n0\n0\n0\n0\n0\n0\n0\n0\n10\n' >$TMP/c
+# Equal variances: a standard error of 1 and 8 degrees of freedom.
+check "compare" "2	66.66666666666667	8	0.6" \
+	"`$STATGEN -x -f tsv --compare $TMP/a $TMP/b | tail -1 | cut -f2,3,5,6`"
+# -6, 6 and seven zeros have a standard error of 1 on 8 degrees too.
+printf -- '-6\n6\n0\n0\n0\n0\n0\n0\n0\n' >$TMP/t8
+check "compare hwidth" "`rows $STATGEN -x -f tsv -w $TMP/t8`" \
+	"`$STATGEN -x -f tsv --compare $TMP/a $TMP/b | tail -1 | cut -f4`"
+# Unequal: 2.25 / (0.5^2 / 4 + 1 / 9) = 12.96 degrees of freedom.
+check "welch df" "-2 12.96 3" "`$STATGEN -x -f tsv --compare $TMP/a $TMP/c |
+	tail -1 | awk '{ printf \"%g %.2f %g\", $2, $5, $6 }'`"
+check "compare itself" "0	0	1" \
+	"`$STATGEN -x -f tsv --compare $TMP/a $TMP/a | tail -1 | cut -f2,3,6`"
+# Five files on two threads: the rest wait their turn, in order.
+check "compare queued" "2 -2 0 2" "`$STATGEN -x -f tsv -j2 --compare $TMP/a \
+	$TMP/b $TMP/c $TMP/a $TMP/b | tail -4 | cut -f2 | tr '\n' ' ' |
+	sed 's/ $//'`"
+
+# -- Threads (-j)
+# A file split among threads must give the same summary, to the last
+# digit, as one thread reading it whole.
+perl -e 'srand(3); printf "k%d %.4f %.3f\n", $_ % 7, exp(rand(8)), rand(100)
+	for 1..400000' >$TMP/wide
+cut -d' ' -f2 $TMP/wide >$TMP/narrow
+for args in "-k2,3 $TMP/wide" "--group-by=1 $TMP/wide" "-s -q $TMP/narrow"; do
+	check "-j4 $args" "`$STATGEN -j1 $args`" "`$STATGEN -j4 $args`"
+done
+
+# -- Files (-j)
+seq 1 4 >$TMP/four
+check "stdin once" "255" "`status $STATGEN -j2 - - </dev/null`"
+check "files and stdin" "4 4" "`seq 1 4 | rows $STATGEN -x -f tsv -c -j2 - $TMP/four`"
+# More files than threads are read ahead, all but stdin; the perturbed
+# heap shows any of its contents taken for stdin's.
+check "stdin read ahead" "4 2 4" "`seq 1 2 | MALLOC_PERTURB_=165 rows $STATGEN \
+	-x -f tsv -c -j2 $TMP/four - $TMP/four`"
+
+# Twenty files of 15 MB are more than the read-ahead budget holds at once.
+seq 1 2000000 >$TMP/ahead0
+i=1
+while [ $i -lt 20 ]; do ln $TMP/ahead0 $TMP/ahead$i; i=`expr $i + 1`; done
+check "read-ahead budget" "20" "`timeout 60 $STATGEN -x -f tsv -c -j2 \
+	$TMP/ahead* | grep -c '^2000000$'`"
+rm -f $TMP/ahead*
+
+# -- Saved state (--save-state, --checkpoint)
+# A mapped file is checkpointed in parts, which must add up to the whole.
+seq 1 2000000 >$TMP/seq
+check "checkpointed file" "2000000	1000000.5" "`rows $STATGEN -x -f tsv -c -a \
+	--save-state=$TMP/seq.st --checkpoint=0.0001 $TMP/seq`"
+check "checkpointed -j3" "2000000	1000000.5" "`rows $STATGEN -x -f tsv -c -a -j3 \
+	--save-state=$TMP/seq.st --checkpoint=0.0001 $TMP/seq`"
+
+# -- Merging states (--merge)
+seq 1 10 | $STATGEN --save-state=$TMP/ten.st >/dev/null
+head -c 30 $TMP/ten.st >$TMP/bad.st
+check "merge files" "20	5.5" "`rows $STATGEN -x -f tsv -c -a --merge \
+	$TMP/ten.st $TMP/ten.st`"
+check "damaged file" "1" "`status $STATGEN --merge $TMP/bad.st`"
+# Percentiles are kept only if every state has them, in either order.
+seq 1 10 | $STATGEN --percentiles=50 --save-state=$TMP/pct.st >/dev/null
+check "merge percentiles" "20	5.015625" "`rows $STATGEN -x -f tsv -c \
+	--percentiles=50 --merge $TMP/pct.st $TMP/pct.st`"
+# A bucket offset near 2^31 would overflow the indexes of the merge.
+perl -e 'local $/; $_ = <STDIN>; $l = unpack("V", substr($_, 32, 4));
+	substr($_, 108 + $l, 4) = pack("V", 0x7fffff00); print' \
+	<$TMP/pct.st >$TMP/hostile.st
+check "bucket offset" "1" "`status $STATGEN --merge $TMP/hostile.st`"
+for order in "$TMP/ten.st $TMP/pct.st" "$TMP/pct.st $TMP/ten.st"; do
+	check "merge without percentiles" "20" \
+		"`rows $STATGEN -x -f tsv -c --merge $order`"
+	check "no percentiles merged" "1" \
+		"`status $STATGEN --percentiles=50 --merge $order`"
+done
+: >$TMP/plain
+check "listen on a file" "1" \
+	"`status $STATGEN --merge --expect=1 unix:$TMP/plain`"
+check "file kept" "yes" "`[ -f $TMP/plain ] && echo yes`"
+if command -v perl >/dev/null; then
+	# A damaged state from a peer is dropped; the next one is merged.
+	$STATGEN -x -f tsv -c --merge --expect=1 unix:$TMP/merge.sock \
+		>$TMP/merged 2>/dev/null &
+	send $TMP/merge.sock $TMP/bad.st
+	send $TMP/merge.sock $TMP/ten.st
+	wait
+	check "damaged peer" "10" "`cat $TMP/merged`"
+	$STATGEN -x -f tsv -c --merge --expect=1 unix:$TMP/merge.sock \
+		>$TMP/merged 2>/dev/null &
+	send $TMP/merge.sock $TMP/hostile.st
+	send $TMP/merge.sock $TMP/pct.st
+	wait
+	check "bucket offset from a peer" "10" "`cat $TMP/merged`"
+fi
+
+# -- Server (--serve)
+if command -v perl >/dev/null; then
+	# Short lines are handled as they arrive, however many are sent at once.
+	perl -e 'print "a 1\n" x 3000000, "b 3\nb 5\n?snapshot\n"' >$TMP/burst
+	perl -e 'print "a ", "1" x 1100000, "\n"' >$TMP/long
+	printf 'a 1\n?drain\n?snapshot\n' >$TMP/drain
+	$STATGEN -x -f tsv -c -a --serve=unix:$TMP/serve.sock >$TMP/served \
+		2>$TMP/serve.err &
+	server=$!
+	check "burst" "a	3000000	1 b	2	4" \
+		"`ask $TMP/serve.sock $TMP/burst | tr '\\n' ' ' | sed 's/ *$//'`"
+	check "long line" "" "`ask $TMP/serve.sock $TMP/long`"
+	check "drain" "a	3000001	1 b	2	4   " \
+		"`ask $TMP/serve.sock $TMP/drain | tr '\\n' ' '`"
+	# A client that does not read its reply holds up no one else.
+	perl -e 'print "k$_ 1\nk$_ 1\n" for 1..300000; print "?snapshot\n"' >$TMP/keys
+	printf 'b 1\nb 1\n?snapshot\n' >$TMP/b
+	perl -MIO::Socket::UNIX -e '
+		$s = IO::Socket::UNIX->new(Peer => $ARGV[0]) or die "$!\n";
+		local $/; open(F, $ARGV[1]) or die "$!\n"; print $s <F>; sleep 6;' \
+		$TMP/serve.sock $TMP/keys &
+	sleeper=$!
+	sleep 1
+	limit=`date +%s`; limit=`expr $limit + 3`
+	answered=`ask $TMP/serve.sock $TMP/b | grep -c '^b	'`
+	check "unread reply" "1 yes" "$answered `[ \`date +%s\` -lt $limit ] && echo yes`"
+	wait $sleeper
+	printf '?reset\n' >$TMP/reset
+	ask $TMP/serve.sock $TMP/reset >/dev/null
+	kill -TERM $server
+	wait $server
+	check "long line warning" "1" "`grep -c 'too long' $TMP/serve.err`"
+	check "served at exit" "" "`cat $TMP/served`"
+fi
+
+echo "$checks checks, $failures failed"
+[ $failures -eq 0 ]
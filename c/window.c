@@ -0,0 +1,105 @@
+/*
+-- Sliding window statistics for statgen
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define  INLINE  /* open-code stats routines */
+#include "stats.h"
+#include "window.h"
+
+
+static void *xalloc(size_t count, size_t size) {
+	void *p = calloc(count, size);
+
+	if (p == NULL) {
+		fputs("-- Error: out of memory allocating window.\n", stderr);
+		exit(1);
+	}
+	return p;
+}
+
+#define VALUE(w, s)		((w)->ring[(s) % (w)->size])
+#define FRONT(w, q)		((q)->seq[(q)->head])
+#define BACK(w, q)		((q)->seq[((q)->head + (q)->count - 1) % (w)->size])
+
+/* Push position s, first dropping entries it makes redundant. */
+static void deque_push(window *w, window_deque *q, uint64 s, int want_min) {
+	double x = VALUE(w, s);
+
+	while (q->count > 0 && (want_min ? VALUE(w, BACK(w, q)) >= x :
+			VALUE(w, BACK(w, q)) <= x))
+		q->count--;
+	q->seq[(q->head + q->count++) % w->size] = s;
+}
+
+/* Drop entries that have slid out of the window. */
+static void deque_expire(window *w, window_deque *q) {
+	while (q->count > 0 && FRONT(w, q) + w->size < w->seen) {
+		q->head = (q->head + 1) % w->size;
+		q->count--;
+	}
+}
+
+void window_init(window *w, size_t size, sketch *sk) {
+	memset(w, 0, sizeof(*w));
+	w->size = size;
+	w->ring = xalloc(size, sizeof(double));
+	w->mins.seq = xalloc(size, sizeof(uint64));
+	w->maxs.seq = xalloc(size, sizeof(uint64));
+	w->sketch = sk;
+	stats_init(&w->stats);
+}
+
+void window_add(window *w, double x) {
+	uint64 s = w->seen++;
+
+	/* Expire first: the oldest value's slot in the ring is about to go. */
+	deque_expire(w, &w->mins);
+	deque_expire(w, &w->maxs);
+	if (s >= w->size) {
+		double old = VALUE(w, s);
+		stats_remove(&w->stats, old);
+		if (w->sketch != NULL)
+			sketch_remove(w->sketch, old);
+		w->removed++;
+	}
+	VALUE(w, s) = x;
+	stats_update(&w->stats, x);
+	if (w->sketch != NULL)
+		sketch_add(w->sketch, x);
+	deque_push(w, &w->mins, s, 1);
+	deque_push(w, &w->maxs, s, 0);
+
+	/* Re-summarize the window now and then to shed accumulated error. */
+	if (w->removed >= w->size) {
+		stats_init(&w->stats);
+		stats_update_batch(&w->stats, w->ring, w->size);
+		w->removed = 0;
+	}
+}
+
+int window_full(const window *w) {
+	return w->seen >= w->size;
+}
+
+stats_data *window_stats(window *w) {
+	if (w->mins.count > 0) {
+		w->stats.min = VALUE(w, FRONT(w, &w->mins));
+		w->stats.max = VALUE(w, FRONT(w, &w->maxs));
+		if (w->sketch != NULL) {
+			w->sketch->min = w->stats.min;
+			w->sketch->max = w->stats.max;
+		}
+	}
+	return &w->stats;
+}
+
+void window_free(window *w) {
+	free(w->ring);
+	free(w->mins.seq);
+	free(w->maxs.seq);
+	memset(w, 0, sizeof(*w));
+}
@@ -0,0 +1,49 @@
+/*
+-- Sliding window statistics for statgen
+--
+-- Summarizes the last N values of a stream in O(1) time per value: the
+-- mean and variance are maintained with stats_update() and the inverse
+-- recurrence stats_remove(), and the minimum and maximum with monotonic
+-- deques in place of rescanning the window. To keep rounding errors
+-- from accumulating, the window is re-summarized from its values once
+-- every N removals, which is still O(1) per value amortized.
+*/
+
+#ifndef __WINDOW_H
+#define __WINDOW_H
+
+#include <stddef.h>
+#include "stats.h"
+#include "sketch.h"
+
+/* A deque of positions in the window, kept in a ring of its own. */
+typedef struct window_deque {
+	uint64       *seq;
+	size_t        head;
+	size_t        count;
+} window_deque;
+
+typedef struct window {
+	size_t        size;
+	double       *ring;      /* value number i lives in ring[i % size] */
+	uint64        seen;      /* values added so far */
+	size_t        removed;   /* removals since the window was re-summarized */
+	stats_data    stats;
+	sketch       *sketch;    /* optional, updated with adds and removes */
+	window_deque  mins;      /* values increase from head to tail */
+	window_deque  maxs;      /* values decrease from head to tail */
+} window;
+
+/*
+-- Public interface of the module:
+--
+--  window_stats() returns the summary of the values in the window,
+--  including their true minimum and maximum.
+*/
+extern void         window_init(window *w, size_t size, sketch *sk);
+extern void         window_add(window *w, double x);
+extern int          window_full(const window *w);
+extern stats_data  *window_stats(window *w);
+extern void         window_free(window *w);
+
+#endif /* __WINDOW_H */
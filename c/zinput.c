@@ -0,0 +1,353 @@
+/*
+-- Compressed input for statgen
+*/
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "zinput.h"
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#define MAX_CHUNK		(1 << 30)	/* of a mapping handed to a decoder at once */
+
+#define MIN(x,y) ((x) < (y) ? (x) : (y))
+
+
+static void *xalloc(size_t size) {
+	void *p = malloc(size);
+
+	if (p == NULL) {
+		fputs("-- Error: out of memory allocating decompression buffers.\n",
+				stderr);
+		exit(1);
+	}
+	return p;
+}
+
+#if defined(HAVE_ZLIB) || defined(HAVE_ZSTD)
+static void damaged(const char *why) {
+	fprintf(stderr, "-- Error: compressed input is damaged (%s).\n", why);
+	exit(1);
+}
+
+#endif
+
+int zinput_detect(const char *p, size_t len) {
+	const unsigned char *u = (const unsigned char *)p;
+
+	if (len >= 2 && u[0] == 0x1F && u[1] == 0x8B)
+		return ZINPUT_GZIP;
+	if (len >= 4 && u[0] == 0x28 && u[1] == 0xB5 && u[2] == 0x2F && u[3] == 0xFD)
+		return ZINPUT_ZSTD;
+	return ZINPUT_NONE;
+}
+
+/* Whether len bytes at p are too few to tell, but could begin a magic. */
+int zinput_prefix(const char *p, size_t len) {
+	static const unsigned char gzip[] = { 0x1F, 0x8B };
+	static const unsigned char zstd[] = { 0x28, 0xB5, 0x2F, 0xFD };
+
+	return (len < sizeof(gzip) && memcmp(p, gzip, len) == 0) ||
+		(len < sizeof(zstd) && memcmp(p, zstd, len) == 0);
+}
+
+#if defined(HAVE_ZLIB) || defined(HAVE_ZSTD)
+/* Next run of compressed bytes for the decoder, or 0 at the end. */
+static size_t next_input(zinput *z, char *buf, const char **p) {
+	ssize_t n;
+
+	if (z->prefixlen > 0) {
+		*p = z->prefix;
+		n = z->prefixlen;
+		z->prefixlen = 0;
+		return n;
+	}
+	if (z->fd < 0) {
+		n = MIN(z->datalen, MAX_CHUNK);
+		*p = z->data;
+		z->data += n;
+		z->datalen -= n;
+		return n;
+	}
+	do {
+		n = read(z->fd, buf, ZINPUT_BLOCK_SIZE);
+	} while (n < 0 && errno == EINTR);
+	if (n < 0) {
+		perror("-- Error: read failed");
+		exit(1);
+	}
+	*p = buf;
+	return n;
+}
+
+/*
+-- Claim the next free buffer, waiting for the parser to hand one back,
+-- or NULL once decoding is cancelled.
+*/
+static zinput_buffer *claim(zinput *z) {
+	zinput_buffer *b = NULL;
+
+	pthread_mutex_lock(&z->lock);
+	while (z->count == ZINPUT_RING && !z->cancelled)
+		pthread_cond_wait(&z->drained, &z->lock);
+	if (!z->cancelled)
+		b = &z->ring[(z->head + z->count) % ZINPUT_RING];
+	pthread_mutex_unlock(&z->lock);
+	if (b != NULL)
+		b->len = 0;
+	return b;
+}
+
+static void publish(zinput *z) {
+	pthread_mutex_lock(&z->lock);
+	z->count++;
+	pthread_cond_signal(&z->filled);
+	pthread_mutex_unlock(&z->lock);
+}
+
+/*
+-- Before reading more input (and maybe waiting on a pipe), pass on what
+-- is decoded so far; NULL once decoding is cancelled.
+*/
+static zinput_buffer *pass_on(zinput *z, zinput_buffer *b) {
+	int cancelled;
+
+	pthread_mutex_lock(&z->lock);
+	cancelled = z->cancelled;
+	pthread_mutex_unlock(&z->lock);
+	if (cancelled)
+		return NULL;
+	if (b->len == 0 || z->fd < 0)
+		return b;
+	publish(z);
+	return claim(z);
+}
+#endif
+
+#ifdef HAVE_ZLIB
+/* Inflate gzip members (and zlib streams) one after another. */
+static void decode_gzip(zinput *z, char *inbuf) {
+	zinput_buffer *b = claim(z);
+	const char *p;
+	z_stream s;
+	size_t n;
+	int ret, ended = 0;
+
+	memset(&s, 0, sizeof(s));
+	if (inflateInit2(&s, 15 + 32) != Z_OK)
+		damaged("cannot initialize zlib");
+	for (;;) {
+		if (s.avail_in == 0) {
+			if ((b = pass_on(z, b)) == NULL ||
+					(n = next_input(z, inbuf, &p)) == 0)
+				break;
+			s.next_in = (Bytef *)p;
+			s.avail_in = n;
+		}
+		if (ended) {
+			inflateReset(&s);
+			ended = 0;
+		}
+		s.next_out = (Bytef *)b->data + b->len;
+		s.avail_out = ZINPUT_BLOCK_SIZE - b->len;
+		ret = inflate(&s, Z_NO_FLUSH);
+		b->len = ZINPUT_BLOCK_SIZE - s.avail_out;
+		if (ret == Z_STREAM_END)
+			ended = 1;
+		else if (ret != Z_OK && ret != Z_BUF_ERROR)
+			damaged(s.msg ? s.msg : "inflate failed");
+		if (b->len == ZINPUT_BLOCK_SIZE) {
+			publish(z);
+			if ((b = claim(z)) == NULL)
+				break;
+		}
+	}
+	if (b != NULL && !ended)
+		damaged("unexpected end");
+	inflateEnd(&s);
+	if (b != NULL && b->len > 0)
+		publish(z);
+}
+#endif /* HAVE_ZLIB */
+
+#ifdef HAVE_ZSTD
+/* Decompress zstd frames one after another. */
+static void decode_zstd(zinput *z, char *inbuf) {
+	zinput_buffer *b = claim(z);
+	ZSTD_DStream *ds = ZSTD_createDStream();
+	ZSTD_inBuffer in = { NULL, 0, 0 };
+	ZSTD_outBuffer out;
+	size_t ret = 0, n;
+	const char *p;
+
+	if (ds == NULL)
+		damaged("cannot initialize zstd");
+	ZSTD_initDStream(ds);
+	for (;;) {
+		if (in.pos == in.size) {
+			if ((b = pass_on(z, b)) == NULL ||
+					(n = next_input(z, inbuf, &p)) == 0)
+				break;
+			in.src = p;
+			in.size = n;
+			in.pos = 0;
+		}
+		out.dst = b->data;
+		out.size = ZINPUT_BLOCK_SIZE;
+		out.pos = b->len;
+		ret = ZSTD_decompressStream(ds, &out, &in);
+		if (ZSTD_isError(ret))
+			damaged(ZSTD_getErrorName(ret));
+		b->len = out.pos;
+		if (b->len == ZINPUT_BLOCK_SIZE) {
+			publish(z);
+			if ((b = claim(z)) == NULL)
+				break;
+		}
+	}
+	if (b != NULL && ret != 0)
+		damaged("unexpected end");
+	ZSTD_freeDStream(ds);
+	if (b != NULL && b->len > 0)
+		publish(z);
+}
+#endif /* HAVE_ZSTD */
+
+static void *decoder(void *arg) {
+	zinput *z = arg;
+	char *inbuf = z->fd >= 0 ? xalloc(ZINPUT_BLOCK_SIZE) : NULL;
+
+#ifdef HAVE_ZLIB
+	if (z->type == ZINPUT_GZIP)
+		decode_gzip(z, inbuf);
+#endif
+#ifdef HAVE_ZSTD
+	if (z->type == ZINPUT_ZSTD)
+		decode_zstd(z, inbuf);
+#endif
+	free(inbuf);
+
+	pthread_mutex_lock(&z->lock);
+	z->done = 1;
+	pthread_cond_broadcast(&z->filled);
+	pthread_mutex_unlock(&z->lock);
+	return NULL;
+}
+
+zinput *zinput_open(int type, int fd, const char *data, size_t datalen,
+		const char *prefix, size_t prefixlen) {
+	zinput *z;
+	int i;
+
+#ifndef HAVE_ZLIB
+	if (type == ZINPUT_GZIP) {
+		fputs("-- Error: gzip input needs statgen built with HAVE_ZLIB.\n",
+				stderr);
+		exit(1);
+	}
+#endif
+#ifndef HAVE_ZSTD
+	if (type == ZINPUT_ZSTD) {
+		fputs("-- Error: zstd input needs statgen built with HAVE_ZSTD.\n",
+				stderr);
+		exit(1);
+	}
+#endif
+
+	z = xalloc(sizeof(*z));
+	memset(z, 0, sizeof(*z));
+	z->type = type;
+	z->fd = fd;
+	z->data = data;
+	z->datalen = datalen;
+	if (prefixlen > 0) {
+		z->prefix = xalloc(prefixlen);
+		memcpy(z->prefix, prefix, prefixlen);
+		z->prefixlen = prefixlen;
+	}
+	for (i = 0; i < ZINPUT_RING; i++)
+		z->ring[i].data = xalloc(ZINPUT_BLOCK_SIZE);
+	pthread_mutex_init(&z->lock, NULL);
+	pthread_cond_init(&z->filled, NULL);
+	pthread_cond_init(&z->drained, NULL);
+	if (pthread_create(&z->thread, NULL, decoder, z) != 0) {
+		fputs("-- Error: could not start the decompression thread.\n", stderr);
+		exit(1);
+	}
+	return z;
+}
+
+size_t zinput_read(zinput *z, char *dst, size_t size) {
+	zinput_buffer *b;
+	size_t n;
+
+	pthread_mutex_lock(&z->lock);
+	while (z->count == 0 && !z->done)
+		pthread_cond_wait(&z->filled, &z->lock);
+	if (z->count == 0) {
+		pthread_mutex_unlock(&z->lock);
+		return 0;
+	}
+	b = &z->ring[z->head];
+	pthread_mutex_unlock(&z->lock);
+
+	n = MIN(size, b->len - z->pos);
+	memcpy(dst, b->data + z->pos, n);
+	if ((z->pos += n) == b->len) {
+		pthread_mutex_lock(&z->lock);
+		z->head = (z->head + 1) % ZINPUT_RING;
+		z->count--;
+		z->pos = 0;
+		pthread_cond_signal(&z->drained);
+		pthread_mutex_unlock(&z->lock);
+	}
+	return n;
+}
+
+/* Wait up to timeout_ms for output; returns 0 on timeout. */
+int zinput_poll(zinput *z, int timeout_ms) {
+	struct timespec deadline;
+	int ready;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += timeout_ms / 1000;
+	deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+	pthread_mutex_lock(&z->lock);
+	while (z->count == 0 && !z->done &&
+			pthread_cond_timedwait(&z->filled, &z->lock, &deadline) == 0)
+		;
+	ready = z->count > 0 || z->done;
+	pthread_mutex_unlock(&z->lock);
+	return ready;
+}
+
+/* Cancel decoding, in case the input has not all been read, and wait. */
+void zinput_close(zinput *z) {
+	int i;
+
+	pthread_mutex_lock(&z->lock);
+	z->cancelled = 1;
+	pthread_cond_broadcast(&z->drained);
+	pthread_mutex_unlock(&z->lock);
+	pthread_join(z->thread, NULL);
+	pthread_mutex_destroy(&z->lock);
+	pthread_cond_destroy(&z->filled);
+	pthread_cond_destroy(&z->drained);
+	for (i = 0; i < ZINPUT_RING; i++)
+		free(z->ring[i].data);
+	free(z->prefix);
+	free(z);
+}
@@ -0,0 +1,70 @@
+/*
+-- Compressed input for statgen
+--
+-- Decompresses gzip input (and zstd input, when built with HAVE_ZSTD)
+-- in a thread of its own. The thread fills a ring of buffers while the
+-- parser drains it, so decompression overlaps with parsing instead of
+-- costing an extra process and pipe as zcat does.
+*/
+
+#ifndef __ZINPUT_H
+#define __ZINPUT_H
+
+#include <pthread.h>
+#include <stddef.h>
+
+#define ZINPUT_NONE			0
+#define ZINPUT_GZIP			1
+#define ZINPUT_ZSTD			2
+
+#define ZINPUT_MAGIC_SIZE	4		/* bytes needed by zinput_detect() */
+#define ZINPUT_RING			4		/* buffers between the two threads */
+#define ZINPUT_BLOCK_SIZE	(1 << 20)
+
+typedef struct zinput_buffer {
+	char         *data;
+	size_t        len;
+} zinput_buffer;
+
+typedef struct zinput {
+	int           type;
+	int           fd;        /* compressed input, or -1 if it is in memory */
+	const char   *data;      /* compressed input in memory (a mapping) */
+	size_t        datalen;
+	char         *prefix;    /* compressed bytes already read from fd */
+	size_t        prefixlen;
+
+	pthread_t     thread;
+	pthread_mutex_t lock;
+	pthread_cond_t  filled;  /* a buffer was filled, or the input ended */
+	pthread_cond_t  drained; /* a buffer was handed back to the thread */
+	zinput_buffer ring[ZINPUT_RING];
+	int           head;      /* next buffer to drain */
+	int           count;     /* filled buffers */
+	size_t        pos;       /* bytes of ring[head] already drained */
+	int           done;
+	int           cancelled; /* by zinput_close() before the end */
+} zinput;
+
+/*
+-- Public interface of the module:
+--
+--  zinput_detect() recognizes a compressed stream from its first bytes;
+--  zinput_prefix() tells whether more of them are needed to be sure.
+--  zinput_open() starts decompressing either the in-memory data or,
+--  after the prefix already read from it, the file descriptor fd.
+--  zinput_read() works like read(): it blocks until some output is
+--  ready and returns 0 at the end. Damaged input is a fatal error.
+--  zinput_close() may be called before the end, and then stops the
+--  thread once any read() it is waiting on returns.
+*/
+extern int          zinput_detect(const char *p, size_t len);
+extern int          zinput_prefix(const char *p, size_t len);
+extern zinput      *zinput_open(int type, int fd, const char *data,
+                                size_t datalen, const char *prefix,
+                                size_t prefixlen);
+extern size_t       zinput_read(zinput *z, char *dst, size_t size);
+extern int          zinput_poll(zinput *z, int timeout_ms);
+extern void         zinput_close(zinput *z);
+
+#endif /* __ZINPUT_H */
@@ -0,0 +1,416 @@
+/*
+-- Python binding of the statistics ADT
+--
+-- The Summary type holds a stats_data and is updated by the routines of
+-- ../c/stats.c, included inline as statgen does. Summary.add_values()
+-- takes anything with the buffer protocol (a NumPy array, array.array,
+-- memoryview) without copying it: contiguous doubles go straight to
+-- stats_update_batch() and its SIMD kernel with the GIL released, and
+-- other numeric formats or strides are converted a block at a time.
+-- Without the GIL, the values are summarized apart and merged into the
+-- Summary once it is held again, so other threads may use it meanwhile.
+-- Lists and other sequences of numbers are converted the same way. The
+-- sum is kept as well, and the first value, which the Python Summary of
+-- stats.py shifts the values by.
+--
+-- stats.py wraps a Summary in its Stats class, which checks the counts
+-- and works out the confidence intervals, and falls back on a Summary
+-- of its own in Python if this module has not been built.
+*/
+
+#include <Python.h>
+#include <string.h>
+
+#define  INLINE  /* open-code stats routines */
+#include "stats.h"
+
+#if PY_MAJOR_VERSION >= 3
+#	define PyInt_FromSize_t  PyLong_FromSize_t
+#else
+#	undef PyUnicode_FromString
+#	define PyUnicode_FromString  PyString_FromString
+#endif
+
+typedef struct {
+	PyObject_HEAD
+	stats_data      data;
+	double          sum;
+	double          first;   /* the Python Summary's _K */
+} Summary;
+
+/* Summarized values not yet added to a Summary. */
+typedef struct {
+	stats_data      data;
+	double          sum;
+	double          first;
+} Partial;
+
+static PyTypeObject SummaryType;
+
+static int Summary_init(Summary *self, PyObject *args, PyObject *kwds) {
+	static char *keywords[] = { NULL };
+
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, ":Summary", keywords))
+		return -1;
+	stats_init(&self->data);
+	self->sum = self->first = 0.0;
+	return 0;
+}
+
+static void PartialInit(Partial *part) {
+	stats_init(&part->data);
+	part->sum = part->first = 0.0;
+}
+
+/* Summarize n values into part. */
+static void PartialAdd(Partial *part, const double *xs, size_t n) {
+	double sum = 0.0;
+	size_t i;
+
+	if (n > 0 && part->data.count == 0)
+		part->first = xs[0];
+	stats_update_batch(&part->data, xs, n);
+	for (i = 0; i < n; i++)
+		sum += xs[i];
+	part->sum += sum;
+}
+
+/* Add the values summarized by part (or by another Summary) to self. */
+static void Merge(Summary *self, const stats_data *data, double sum,
+		double first) {
+	if (data->count == 0)
+		return;
+	if (self->data.count == 0)
+		self->first = first;
+	stats_merge(&self->data, data);
+	self->sum += sum;
+}
+
+static PyObject *Summary_add(Summary *self, PyObject *value) {
+	double x = PyFloat_AsDouble(value);
+
+	if (x == -1.0 && PyErr_Occurred())
+		return NULL;
+	if (self->data.count == 0)
+		self->first = x;
+	stats_update(&self->data, x);
+	self->sum += x;
+	Py_RETURN_NONE;
+}
+
+/* Convert n items of a buffer, stride bytes apart, to doubles in xs. */
+static void ConvertItems(const char *p, Py_ssize_t stride, char format,
+		double *xs, size_t n) {
+	size_t i;
+
+#define CONVERT(type) \
+	for (i = 0; i < n; i++, p += stride) { \
+		type v; \
+		memcpy(&v, p, sizeof(v)); \
+		xs[i] = (double)v; \
+	} \
+	break
+
+	switch (format) {
+	 case 'b': CONVERT(signed char);
+	 case 'B': CONVERT(unsigned char);
+	 case 'h': CONVERT(short);
+	 case 'H': CONVERT(unsigned short);
+	 case 'i': CONVERT(int);
+	 case 'I': CONVERT(unsigned int);
+	 case 'l': CONVERT(long);
+	 case 'L': CONVERT(unsigned long);
+	 case 'q': CONVERT(long long);
+	 case 'Q': CONVERT(unsigned long long);
+	 case 'f': CONVERT(float);
+	 case 'd': CONVERT(double);
+	}
+#undef CONVERT
+}
+
+/* The size of the C type ConvertItems() reads for a format. */
+static size_t ItemSize(char format) {
+	switch (format) {
+	 case 'b': case 'B': return sizeof(char);
+	 case 'h': case 'H': return sizeof(short);
+	 case 'i': case 'I': return sizeof(int);
+	 case 'l': case 'L': return sizeof(long);
+	 case 'q': case 'Q': return sizeof(long long);
+	 case 'f': return sizeof(float);
+	 case 'd': return sizeof(double);
+	}
+	return 0;
+}
+
+/*
+-- Summarize a buffer, or return 1 if it does not hold native numbers.
+-- Under '=' the items have standard sizes, which need not be those of
+-- the C types (a long has 4 bytes), so the item size is checked too.
+*/
+static int AddBuffer(Summary *self, Py_buffer *view) {
+	double xs[STATS_BATCH_BLOCK];
+	const char *format = view->format != NULL ? view->format : "B";
+	const char *p = view->buf;
+	Py_ssize_t stride = view->itemsize;
+	size_t n, len;
+	Partial part;
+
+	if (*format == '@' || *format == '=')
+		format++;
+	if (format[0] == '\0' || format[1] != '\0' ||
+			strchr("bBhHiIlLqQfd", format[0]) == NULL ||
+			(size_t)view->itemsize != ItemSize(format[0]))
+		return 1;
+	if (PyBuffer_IsContiguous(view, 'C')) {
+		n = (size_t)(view->len / view->itemsize);
+	} else if (view->ndim == 1) {
+		n = (size_t)view->shape[0];
+		stride = view->strides[0];
+	} else {
+		PyErr_SetString(PyExc_ValueError,
+				"values must be one-dimensional or contiguous");
+		return -1;
+	}
+
+	PartialInit(&part);
+	Py_BEGIN_ALLOW_THREADS
+	for (; n > 0; p += (Py_ssize_t)len * stride, n -= len) {
+		len = n < STATS_BATCH_BLOCK ? n : STATS_BATCH_BLOCK;
+		if (*format == 'd' && stride == sizeof(double)) {
+			PartialAdd(&part, (const double *)p, len);
+		} else {
+			ConvertItems(p, stride, *format, xs, len);
+			PartialAdd(&part, xs, len);
+		}
+	}
+	Py_END_ALLOW_THREADS
+	Merge(self, &part.data, part.sum, part.first);
+	return 0;
+}
+
+static int AddSequence(Summary *self, PyObject *values) {
+	double xs[STATS_BATCH_BLOCK];
+	PyObject *seq, **items;
+	Py_ssize_t i, n;
+	size_t len = 0;
+	Partial part;
+
+	seq = PySequence_Fast(values, "values must be a buffer or a sequence "
+			"of numbers");
+	if (seq == NULL)
+		return -1;
+	n = PySequence_Fast_GET_SIZE(seq);
+	items = PySequence_Fast_ITEMS(seq);
+	PartialInit(&part);
+	for (i = 0; i < n; i++) {
+		xs[len] = PyFloat_AsDouble(items[i]);
+		if (xs[len] == -1.0 && PyErr_Occurred()) {
+			Py_DECREF(seq);
+			return -1;
+		}
+		if (++len == STATS_BATCH_BLOCK) {
+			PartialAdd(&part, xs, len);
+			len = 0;
+		}
+	}
+	PartialAdd(&part, xs, len);
+	Merge(self, &part.data, part.sum, part.first);
+	Py_DECREF(seq);
+	return 0;
+}
+
+static PyObject *Summary_add_values(Summary *self, PyObject *values) {
+	Py_buffer view;
+	int status = 1;
+
+	if (PyObject_CheckBuffer(values)) {
+		if (PyObject_GetBuffer(values, &view, PyBUF_RECORDS_RO) == 0) {
+			status = AddBuffer(self, &view);
+			PyBuffer_Release(&view);
+			if (status < 0)
+				return NULL;
+		} else {
+			PyErr_Clear();
+		}
+	}
+	if (status != 0 && AddSequence(self, values) != 0)
+		return NULL;
+	Py_RETURN_NONE;
+}
+
+static PyObject *Summary_merge(Summary *self, PyObject *other) {
+	Summary *src = (Summary *)other;
+
+	if (!PyObject_TypeCheck(other, &SummaryType)) {
+		PyErr_SetString(PyExc_TypeError, "only a Summary can be merged");
+		return NULL;
+	}
+	Merge(self, &src->data, src->sum, src->first);
+	Py_RETURN_NONE;
+}
+
+static PyObject *Summary_reset(Summary *self, PyObject *unused) {
+	(void)unused;
+	stats_init(&self->data);
+	self->sum = self->first = 0.0;
+	Py_RETURN_NONE;
+}
+
+static PyObject *Summary_count(Summary *self, PyObject *unused) {
+	(void)unused;
+	return PyInt_FromSize_t((size_t)stats_count(&self->data));
+}
+
+static PyObject *Summary_sum(Summary *self, PyObject *unused) {
+	(void)unused;
+	return PyFloat_FromDouble(self->sum);
+}
+
+static PyObject *Summary_min(Summary *self, PyObject *unused) {
+	(void)unused;
+	return PyFloat_FromDouble(stats_min(&self->data));
+}
+
+static PyObject *Summary_max(Summary *self, PyObject *unused) {
+	(void)unused;
+	return PyFloat_FromDouble(stats_max(&self->data));
+}
+
+static PyObject *Summary_mean(Summary *self, PyObject *unused) {
+	(void)unused;
+	return PyFloat_FromDouble(stats_mean(&self->data));
+}
+
+static PyObject *Summary_var(Summary *self, PyObject *unused) {
+	(void)unused;
+	return PyFloat_FromDouble(stats_variance(&self->data));
+}
+
+/* Add a float to dict under key; FALSE if out of memory. */
+static int SetFloat(PyObject *dict, const char *key, double x) {
+	PyObject *value = PyFloat_FromDouble(x);
+	int status;
+
+	if (value == NULL)
+		return 0;
+	status = PyDict_SetItemString(dict, key, value);
+	Py_DECREF(value);
+	return status == 0;
+}
+
+/*
+-- The fields of the Python Summary, in its order, worked out from the
+-- sum and the moments: _Ex and _Ex2 are the sums of the values and of
+-- their squares after shifting them by _K, the first value.
+*/
+static PyObject *Summary_fields(Summary *self, PyObject *unused) {
+	stats_data *data = &self->data;
+	double n = (double)data->count, k = 0.0, shifted = 0.0;
+	PyObject *dict, *count;
+
+	(void)unused;
+	if (data->count > 0) {
+		k = self->first;
+		shifted = data->mean - k;
+	}
+	if ((dict = PyDict_New()) == NULL)
+		return NULL;
+	count = PyInt_FromSize_t((size_t)data->count);
+	if (count == NULL || PyDict_SetItemString(dict, "_count", count) != 0 ||
+			!SetFloat(dict, "_minimum", n > 0 ? data->min : Py_HUGE_VAL) ||
+			!SetFloat(dict, "_maximum", n > 0 ? data->max : -Py_HUGE_VAL) ||
+			!SetFloat(dict, "_K", k) ||
+			!SetFloat(dict, "_Ex", self->sum - n * k) ||
+			!SetFloat(dict, "_Ex2", n > 1 ? data->variance * (n - 1) +
+				n * shifted * shifted : 0.0) ||
+			!SetFloat(dict, "_sum", self->sum)) {
+		Py_XDECREF(count);
+		Py_DECREF(dict);
+		return NULL;
+	}
+	Py_DECREF(count);
+	return dict;
+}
+
+static PyObject *Summary_repr(Summary *self) {
+	char buf[160];
+
+	PyOS_snprintf(buf, sizeof(buf), "Summary(count=%llu, mean=%.17g, "
+			"variance=%.17g)", (unsigned long long)stats_count(&self->data),
+			stats_mean(&self->data), stats_variance(&self->data));
+	return PyUnicode_FromString(buf);
+}
+
+static PyMethodDef Summary_methods[] = {
+	{ "add", (PyCFunction)Summary_add, METH_O,
+	  "Add a value." },
+	{ "add_values", (PyCFunction)Summary_add_values, METH_O,
+	  "Add the numbers in a buffer (such as a NumPy array) or a sequence." },
+	{ "merge", (PyCFunction)Summary_merge, METH_O,
+	  "Add the values summarized by another Summary." },
+	{ "reset", (PyCFunction)Summary_reset, METH_NOARGS,
+	  "Forget every value." },
+	{ "count", (PyCFunction)Summary_count, METH_NOARGS,
+	  "Return the number of values." },
+	{ "sum", (PyCFunction)Summary_sum, METH_NOARGS,
+	  "Return the sum of the values." },
+	{ "min", (PyCFunction)Summary_min, METH_NOARGS,
+	  "Return the least value." },
+	{ "max", (PyCFunction)Summary_max, METH_NOARGS,
+	  "Return the greatest value." },
+	{ "mean", (PyCFunction)Summary_mean, METH_NOARGS,
+	  "Return the mean of the values." },
+	{ "var", (PyCFunction)Summary_var, METH_NOARGS,
+	  "Return the sample variance of the values (0 below two)." },
+	{ "fields", (PyCFunction)Summary_fields, METH_NOARGS,
+	  "Return the fields of the Python Summary as a dict." },
+	{ NULL, NULL, 0, NULL }
+};
+
+static PyTypeObject SummaryType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name = "_stats.Summary",
+	.tp_basicsize = sizeof(Summary),
+	.tp_repr = (reprfunc)Summary_repr,
+	.tp_flags = Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+	.tp_doc = "Count, minimum, maximum, mean and variance of values.",
+	.tp_methods = Summary_methods,
+	.tp_init = (initproc)Summary_init,
+	.tp_new = PyType_GenericNew,
+};
+
+#if PY_MAJOR_VERSION >= 3
+
+static struct PyModuleDef statsModule = {
+	PyModuleDef_HEAD_INIT, "_stats", "The statistics ADT of statgen.", -1,
+	NULL, NULL, NULL, NULL, NULL
+};
+
+PyMODINIT_FUNC PyInit__stats(void) {
+	PyObject *module;
+
+	if (PyType_Ready(&SummaryType) < 0)
+		return NULL;
+	module = PyModule_Create(&statsModule);
+	if (module == NULL)
+		return NULL;
+	Py_INCREF(&SummaryType);
+	PyModule_AddObject(module, "Summary", (PyObject *)&SummaryType);
+	return module;
+}
+
+#else
+
+PyMODINIT_FUNC init_stats(void) {
+	PyObject *module;
+
+	if (PyType_Ready(&SummaryType) < 0)
+		return;
+	module = Py_InitModule3("_stats", NULL, "The statistics ADT of statgen.");
+	if (module == NULL)
+		return;
+	Py_INCREF(&SummaryType);
+	PyModule_AddObject(module, "Summary", (PyObject *)&SummaryType);
+}
+
+#endif /* PY_MAJOR_VERSION */
@@ -8,10 +8,84 @@
 -- Note: computation of mean and variance is based on incremental computation from
 --       https://en.wikipedia.org/wiki/Algorithms_for_calculating_variance
 --       (Should probably switch to Welford's algorithm at that URL.)
+--       The values are summarized by _stats.Summary, the C statistics ADT
+--       of statgen (see _stats.c, built by make), when it can be imported,
+--       and otherwise by the Summary class below. Stats.add_values() then
+--       takes a NumPy array or other buffer without copying it.
 """
 
 import math
 
+class Summary:
+    '''
+    Count, minimum, maximum, mean and variance of values, in Python.
+    '''
+    def __init__(self):
+        self.reset()
+
+    def add(self, value):
+        self._minimum = min(self._minimum, value)
+        self._maximum = max(self._maximum, value)
+        if self._count == 0:
+            self._K = value
+        self._count += 1
+        self._Ex += value - self._K
+        self._Ex2 += (value - self._K) * (value - self._K)
+        self._sum += value
+
+    def add_values(self, values):
+        for value in values:
+            self.add(float(value))
+
+    def merge(self, other):
+        if other._count == 0:
+            return
+        if self._count == 0:
+            self._K = other._K
+        shift = other._K - self._K
+        self._minimum = min(self._minimum, other._minimum)
+        self._maximum = max(self._maximum, other._maximum)
+        self._Ex2 += other._Ex2 + 2 * shift * other._Ex + \
+            other._count * shift * shift
+        self._Ex += other._Ex + other._count * shift
+        self._count += other._count
+        self._sum += other._sum
+
+    def reset(self):
+        self._count = 0
+        self._minimum = float('inf')
+        self._maximum = -float('inf')
+        self._K = 0.0
+        self._Ex = 0.0
+        self._Ex2 = 0.0
+        self._sum = 0.0
+
+    def count(self):
+        return self._count
+
+    def sum(self):
+        return self._sum
+
+    def min(self):
+        return self._minimum
+
+    def max(self):
+        return self._maximum
+
+    def mean(self):
+        return self._K + self._Ex / self._count
+
+    def var(self):
+        return (self._Ex2 - (self._Ex * self._Ex) / self._count) / (self._count - 1)
+
+    def fields(self):
+        return self.__dict__
+
+try:
+    from _stats import Summary
+except ImportError:
+    pass
+
 class Stats:
     '''
     Class of objects that compute descriptive statistics.
@@ -26,20 +100,27 @@ class Stats:
         '''
         Convert to string representation.
         '''
-        return str(self.__dict__)
+        return str(self._summary.fields())
 
     def add(self, value):
         '''
         Update the statistics to include the value.
         '''
-        self._minimum = min(self._minimum, value)
-        self._maximum = max(self._maximum, value)
-        if self._count is 0:
-            self._K = value
-        self._count += 1
-        self._Ex += value - self._K
-        self._Ex2 += (value - self._K) * (value - self._K)
-        self._sum += value
+        self._summary.add(value)
+
+    def add_values(self, values):
+        '''
+        Update the statistics to include each of the values, which may be
+        a NumPy array, array.array or other buffer of numbers, or a list.
+        '''
+        self._summary.add_values(values)
+
+    def merge(self, other):
+        '''
+        Update the statistics to include the values of other Stats, as if
+        they had been added here.
+        '''
+        self._summary.merge(other._summary)
 
     def remove(self, value):
         '''
@@ -56,53 +137,53 @@ class Stats:
         '''
         Return the sample count.
         '''
-        return self._count
+        return self._summary.count()
 
     def sum(self):
         '''
         Return the sum of the values seen.
         '''
-        if self._count < 1:
+        if self.count() < 1:
             raise StatsException(Stats._need1ErrStr % 'sum')
-        return self._sum
+        return self._summary.sum()
 
     def min(self):
         '''
         Return the minimum value seen.
         '''
-        if self._count < 1:
+        if self.count() < 1:
             raise StatsException(Stats._need1ErrStr % 'minimum')
-        return self._minimum
+        return self._summary.min()
 
     def max(self):
         '''
         Return the maxium value seen.
         '''
-        if self._count < 1:
+        if self.count() < 1:
             raise StatsException(Stats._need1ErrStr % 'maximum')
-        return self._maximum
+        return self._summary.max()
 
     def mean(self):
         '''
         Return the mean of the values.
         '''
-        if self._count < 1:
+        if self.count() < 1:
             raise StatsException(Stats._need1ErrStr % 'mean')
-        return self._K + self._Ex / self._count
+        return self._summary.mean()
 
     def var(self):
         '''
         Return the variance of the values.
         '''
-        if self._count < 2:
+        if self.count() < 2:
             raise StatsException(Stats._need2ErrStr % 'variance')
-        return (self._Ex2 - (self._Ex * self._Ex) / self._count) / (self._count - 1)
+        return self._summary.var()
 
     def stddev(self):
         '''
         Return the standard deviation of the values.
         '''
-        if self._count < 2:
+        if self.count() < 2:
             raise StatsException(Stats._need2ErrStr % 'stddev')
         return math.sqrt(self.var())
 
@@ -110,20 +191,20 @@ class Stats:
         '''
         Return the standard error of the values.
         '''
-        if self._count < 2:
+        if self.count() < 2:
             raise StatsException(Stats._need2ErrStr % 'stderr')
-        return math.sqrt(self.var() / self._count)
+        return math.sqrt(self.var() / self.count())
 
     def conf(self, level = 0.95):
         '''
         Return the (half) width of the confidence interval centered
         on the mean at the required confidence level.
         '''
-        if self._count < 2:
+        if self.count() < 2:
             raise StatsException(Stats._need2ErrStr % 'confidence interval')
         centered = (1.0 - level) / 2
-        if self._count > 1 and self._count < 30:
-            fudge = self.T(centered, self._count - 1)
+        if self.count() > 1 and self.count() < 30:
+            fudge = self.T(centered, self.count() - 1)
         else:
             fudge = self.Z(centered)
         return fudge * self.stderr()
@@ -132,13 +213,7 @@ class Stats:
         '''
         Reset internal state.
         '''
-        self._count = 0
-        self._minimum = float('inf')
-        self._maximum = -float('inf')
-        self._K = 0.0
-        self._Ex = 0.0
-        self._Ex2 = 0.0
-        self._sum = 0.0
+        self._summary = Summary()
 
     _need1ErrStr = '%s is undefined for less than one sample'
     _need2ErrStr = '%s is undefined for less than two samples'
@@ -193,6 +268,7 @@ if __name__ == '__main__':
     Unit test for Stats class
     """
 
+    import array
     import stats
     import unittest
 
@@ -262,4 +338,63 @@ if __name__ == '__main__':
             s.add(4.0)
             self.assertAlmostEqual(s.conf(0.99), 3.4905535)
 
+        def test_addValues(self):
+            s = stats.Stats()
+            s.add_values(array.array('d', [1.0, 2.0, 3.0, 4.0]))
+            s.add_values([5, 6])
+            self.assertEqual(s.count(), 6)
+            self.assertEqual(s.min(), 1.0)
+            self.assertEqual(s.max(), 6.0)
+            self.assertAlmostEqual(s.mean(), 3.5)
+            self.assertAlmostEqual(s.var(), 3.5)
+
+        def test_merge(self):
+            s, t = stats.Stats(), stats.Stats()
+            s.add(1.0)
+            s.add(2.0)
+            t.add(3.0)
+            t.add(4.0)
+            s.merge(t)
+            self.assertEqual(s.count(), 4)
+            self.assertEqual(s.max(), 4.0)
+            self.assertAlmostEqual(s.sum(), 10.0)
+            self.assertAlmostEqual(s.var(), 1.6666667)
+
+        def test_sum(self):
+            # Summed as added, not worked out from the mean (as 1.0).
+            values = [0.1] * 10
+            s, t = stats.Stats(), stats.Stats()
+            for value in values:
+                s.add(value)
+            t.add_values(array.array('d', values))
+            self.assertEqual(s.sum(), sum(values))
+            self.assertEqual(t.sum(), sum(values))
+
+        def test_str(self):
+            s = stats.Stats()
+            for value in [1.0, 2.0, 3.0]:
+                s.add(value)
+            fields = {}
+            for name, value in [('_count', 3), ('_minimum', 1.0),
+                    ('_maximum', 3.0), ('_K', 1.0), ('_Ex', 3.0),
+                    ('_Ex2', 5.0), ('_sum', 6.0)]:
+                fields[name] = value
+            self.assertEqual(str(s), str(fields))
+
+        def test_threads(self):
+            import threading
+            s = stats.Stats()
+            ones = array.array('d', [1.0]) * 100000
+            def add():
+                for i in range(10):
+                    s.add_values(ones)
+            threads = [threading.Thread(target=add) for i in range(4)]
+            for thread in threads:
+                thread.start()
+            for thread in threads:
+                thread.join()
+            self.assertEqual(s.count(), 4000000)
+            self.assertEqual(s.sum(), 4000000.0)
+            self.assertEqual(s.mean(), 1.0)
+
     unittest.main()